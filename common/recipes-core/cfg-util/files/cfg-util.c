@@ -24,10 +24,11 @@
 #include <stdint.h>
 #include <string.h>
 #include <openbmc/pal.h>
+#include <openbmc/kv.h>
 
 static void
 print_usage(void) {
-  printf("Usage: cfg-util <dump-all|key> <value>\n");
+  printf("Usage: cfg-util <dump-all|sync|stats|key> <value>\n");
 }
 
 int
@@ -48,6 +49,28 @@ main(int argc, char **argv) {
       return 0;
   }
 
+  // Handle write of the pending write-behind values to flash
+  if ((argc == 2) && (!strcmp(argv[1], "sync"))) {
+    if (kv_flush(NULL)) {
+      goto err_exit;
+    }
+    return 0;
+  }
+
+  // Handle dump of the write counters
+  if ((argc == 2) && (!strcmp(argv[1], "stats"))) {
+    kv_stats_t stats;
+
+    if (kv_get_stats(&stats)) {
+      goto err_exit;
+    }
+    printf("requested: %u\n", stats.requested);
+    printf("skipped: %u\n", stats.skipped);
+    printf("coalesced: %u\n", stats.coalesced);
+    printf("committed: %u\n", stats.committed);
+    return 0;
+  }
+
   // Handle Get the Configuration
   if (argc == 2) {
     snprintf(key, MAX_KEY_LEN, "%s", argv[1]);
@@ -50,6 +50,8 @@
 #include <string.h>
 #include <syslog.h>
 #include <pthread.h>
+#include <poll.h>
+#include <time.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/ioctl.h>
@@ -76,35 +78,165 @@
 #define MQ_MAX_NUM_MSGS 20
 
 #define SEQ_NUM_MAX 64
+#define SEQ_NONE -1
+
+// Session of the requests ipmbd sends on its own
+#define SESS_NONE -1
+
+// Timer wheel reaping the requests without response, must span TIMEOUT_IPMB
+#define WHEEL_TICK_MS 100
+#define WHEEL_SLOTS 128
 
 #define I2C_RETRIES_MAX 6
 
 #define IPMB_PKT_MIN_SIZE 6
 
-// Structure for i2c file descriptor and socket
-typedef struct _ipmb_sfd_t {
-  int fd;
-  int sock;
-} ipmb_sfd_t;
-
-// Structure for sequence number and buffer
+#define MAX_IPMB_SESS 64
+
+// Wait of the polling rx fallback, shortened while a response is due
+#define RX_POLL_WAIT_MS 10
+#define RX_POLL_FAST_MS 1
+#define RX_FAST_WINDOW_MS 100
+
+// poll() wakeups finding nothing to read before assuming no driver support
+#define RX_SPURIOUS_MAX 100
+
+// Requests of one priority class waiting for a seq#
+#define PRIO_QUEUE_MAX 32
+
+// Response timeout of a command: its p99 latency times TMO_P99_FACTOR,
+// kept within [TMO_FLOOR_MS, TIMEOUT_IPMB]. Latencies go in log2 ms
+// buckets, halved every TMO_DECAY_SAMPLES to follow the BIC over time.
+#define TMO_CMDS_MAX 128
+#define TMO_BUCKETS 14
+#define TMO_MIN_SAMPLES 32
+#define TMO_DECAY_SAMPLES 1024
+#define TMO_P99_FACTOR 3
+#define TMO_FLOOR_MS 1000
+
+// Fail requests right away once BRK_MISS_MAX responses in a row went
+// missing, and probe the BIC every BRK_PROBE_MS until it answers again
+#define BRK_MISS_MAX 3
+#define BRK_PROBE_MS 2000
+
+// Long-lived connection of a lib_ipmb_handle() client process
+typedef struct _ipmb_sess_t {
+  int sock; // -1 when the entry is free
+  uint32_t gen; // bumped on close, so late responses get dropped
+  pthread_mutex_t m_send; // serializes responses and close
+  uint16_t rx_len; // bytes of a partial request frame in rx
+  uint8_t rx[sizeof(ipmb_sess_hdr_t) + MAX_IPMB_RES_LEN];
+} ipmb_sess_t;
+
+// Structure for sequence number and the request waiting on it
 typedef struct _seq_buf_t {
   bool in_use; // seq# is being used
-  uint8_t len; // buffer size
-  uint8_t *p_buf; // pointer to buffer
-  sem_t s_seq; // semaphore for thread sync.
+  bool armed; // linked in the timer wheel
+  int sess; // session that sent the request
+  uint32_t gen; // generation of that session
+  uint32_t tag; // client tag of the request
+  uint64_t deadline; // CLOCK_MONOTONIC ms to give up on the response
+  uint64_t sent; // CLOCK_MONOTONIC ms the request went out on the bus
+  int8_t next; // links of the timer wheel slot
+  int8_t prev;
+  uint8_t slot; // timer wheel slot holding the seq#
+  uint8_t prio; // priority class of the request
+  uint8_t netfn; // command of the request, for its latency
+  uint8_t cmd;
 } seq_buf_t;
 
-// Structure for holding currently used sequence number and
+// Request waiting for its priority class to get a free slot
+typedef struct _ipmb_pend_t {
+  int sess;
+  uint32_t gen;
+  ipmb_sess_hdr_t hdr;
+  uint64_t queued; // CLOCK_MONOTONIC ms it was queued
+  unsigned char buf[MAX_IPMB_RES_LEN];
+} ipmb_pend_t;
+
+// FIFO and counters of one priority class
+typedef struct _ipmb_prio_t {
+  uint8_t max_inflight; // seq# the class may hold at once
+  uint8_t inflight;
+  uint8_t head;
+  uint8_t cnt;
+  ipmb_pend_t q[PRIO_QUEUE_MAX];
+  uint32_t reqs; // requests started on the bus
+  uint32_t queued; // requests that had to wait for a slot
+  uint32_t dropped; // requests failed because the queue was full
+  uint32_t expired; // requests failed after waiting TIMEOUT_IPMB
+  uint64_t wait_total; // ms spent queued
+  uint32_t wait_max;
+} ipmb_prio_t;
+
+// Response latency of one (netfn, cmd)
+typedef struct _ipmb_cmd_tmo_t {
+  bool used;
+  uint8_t netfn;
+  uint8_t cmd;
+  uint32_t cnt;
+  uint32_t hist[TMO_BUCKETS]; // bucket b: latency < 2^b ms
+  uint32_t timeout_ms; // 0 until TMO_MIN_SAMPLES are in
+  uint64_t last; // time of the latest sample, to evict the LRU entry
+} ipmb_cmd_tmo_t;
+
+// Circuit breaker of the bus
+typedef struct _ipmb_brk_t {
+  bool open; // BIC not answering, fail requests right away
+  uint8_t miss; // responses missed in a row
+  uint64_t opened; // CLOCK_MONOTONIC ms the breaker opened
+  uint64_t next_probe;
+  uint32_t trips;
+  uint32_t fast_fails; // requests failed without going on the bus
+  uint32_t probes;
+} ipmb_brk_t;
+
+// Receive path counters, dumped to syslog on SIGUSR2
+typedef struct _ipmb_rx_stats_t {
+  uint32_t frames; // frames read off the slave device
+  uint32_t wakeups; // times the rx thread woke up to read
+  uint32_t empty; // wakeups that found nothing to read
+  uint32_t res_cnt; // responses matched to a request
+  uint64_t res_lat_total; // request sent to response read, in ms
+  uint32_t res_lat_max;
+} ipmb_rx_stats_t;
+
+// Structure for holding the free sequence numbers and
 // array of all possible sequence number
 typedef struct _ipmb_sbuf_t {
-  uint8_t curr_seq; // currently used seq#
+  // FIFO of free seq#, so a seq# is reused as late as possible and a
+  // late response can't be taken for the reply to a newer request
+  uint8_t free_q[SEQ_NUM_MAX];
+  uint8_t free_head;
+  uint8_t free_cnt;
+  int8_t wheel[WHEEL_SLOTS]; // first seq# expiring in each tick slot
+  uint64_t wheel_tick; // next tick to reap
+  uint8_t in_use_cnt;
   seq_buf_t seq[SEQ_NUM_MAX]; //array of all possible seq# struct.
 } ipmb_sbuf_t;
 
 // Global storage for holding IPMB sequence number and buffer
 ipmb_sbuf_t g_seq;
 
+// Sessions of the library clients
+static ipmb_sess_t g_sess[MAX_IPMB_SESS];
+
+// Priority classes, bulk transfers hold few seq# so they can't crowd
+// out telemetry and power control
+static ipmb_prio_t g_prio[IPMB_PRIO_CNT] = {
+  [IPMB_PRIO_CTRL] = { .max_inflight = 16 },
+  [IPMB_PRIO_SENSOR] = { .max_inflight = 32 },
+  [IPMB_PRIO_BULK] = { .max_inflight = 2 },
+};
+
+// Response timeouts learned per command, and the bus circuit breaker,
+// both protected by m_seq
+static ipmb_cmd_tmo_t g_tmo[TMO_CMDS_MAX];
+static ipmb_brk_t g_brk;
+
+// Written by the response handler to wake up the lib handler
+static int g_wake_pipe[2] = { -1, -1 };
+
 // mutex to protect global data access
 pthread_mutex_t m_seq;
 
@@ -112,6 +244,11 @@ pthread_mutex_t m_i2c;
 
 static int g_bus_id = 0; // store the i2c bus ID for debug print
 
+static bool g_rx_polling = false; // use the polling rx fallback only
+static volatile uint64_t g_rx_fast_until = 0;
+static ipmb_rx_stats_t g_rx_stats;
+static volatile sig_atomic_t g_stats_req = 0;
+
 static sem_t event_sem;
 static int i2c_slave_read(int fd, uint8_t *buf, uint8_t *len);
 static int i2c_slave_open(uint8_t bus_num);
@@ -134,6 +271,10 @@ void sig_handler_user(int sig)
 {
   sem_post(&event_sem);
 }
+void sig_handler_stats(int sig)
+{
+  g_stats_req++;
+}
 
 #ifdef CONFIG_YOSEMITE
 // Returns the payload ID from IPMB bus routing
@@ -165,6 +306,14 @@ get_payload_id(uint8_t bus_id) {
 #endif
 
 
+static uint64_t
+get_mono_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
 // Calculate checksum
 static inline uint8_t
 calc_cksum(uint8_t *buf, uint8_t len) {
@@ -178,41 +327,232 @@ calc_cksum(uint8_t *buf, uint8_t len) {
   return (ZERO_CKSUM_CONST - cksum);
 }
 
-// Returns an unused seq# from all possible seq#
+static void
+seq_init(void) {
+  int i;
+
+  for (i = 0; i < SEQ_NUM_MAX; i++) {
+    g_seq.seq[i].in_use = false;
+    g_seq.free_q[i] = i;
+  }
+  g_seq.free_head = 0;
+  g_seq.free_cnt = SEQ_NUM_MAX;
+  g_seq.in_use_cnt = 0;
+
+  for (i = 0; i < WHEEL_SLOTS; i++) {
+    g_seq.wheel[i] = SEQ_NONE;
+  }
+  g_seq.wheel_tick = get_mono_ms() / WHEEL_TICK_MS;
+}
+
+static void seq_arm(int8_t index, uint64_t deadline);
+static uint32_t tmo_get(uint8_t netfn, uint8_t cmd);
+
+/*
+ * Returns an unused seq# from all possible seq#, already recording who
+ * waits for the response and armed in the timer wheel: a late response
+ * can't find it in use but not yet armed.
+ */
 static int8_t
-seq_get_new(void) {
+seq_get_new(uint8_t prio, int sess, uint32_t gen, uint32_t tag,
+            uint8_t netfn, uint8_t cmd) {
+  seq_buf_t *p_seq;
   int8_t ret = -1;
-  uint8_t index;
 
   pthread_mutex_lock(&m_seq);
 
-  // Search for unused sequence number
-  index = g_seq.curr_seq;
-  do {
-    if (g_seq.seq[index].in_use == false) {
-      // Found it!
-      ret = index;
-      g_seq.seq[index].in_use = true;
-      g_seq.seq[index].len = 0;
+  if (g_seq.free_cnt > 0 &&
+      g_prio[prio].inflight < g_prio[prio].max_inflight) {
+    ret = g_seq.free_q[g_seq.free_head];
+    g_seq.free_head = (g_seq.free_head + 1) % SEQ_NUM_MAX;
+    g_seq.free_cnt--;
+    g_seq.in_use_cnt++;
+    g_prio[prio].inflight++;
+
+    p_seq = &g_seq.seq[ret];
+    p_seq->in_use = true;
+    p_seq->armed = false;
+    p_seq->prio = prio;
+    p_seq->next = SEQ_NONE;
+    p_seq->prev = SEQ_NONE;
+    p_seq->sess = sess;
+    p_seq->gen = gen;
+    p_seq->tag = tag;
+    p_seq->netfn = netfn;
+    p_seq->cmd = cmd;
+    p_seq->sent = get_mono_ms();
+    seq_arm(ret, p_seq->sent + tmo_get(netfn, cmd));
+  }
+
+  pthread_mutex_unlock(&m_seq);
+
+  return ret;
+}
+
+// Queue a seq# in the timer wheel slot of its deadline, m_seq held
+static void
+seq_arm(int8_t index, uint64_t deadline) {
+  seq_buf_t *p_seq = &g_seq.seq[index];
+  uint64_t tick;
+
+  // Only a seq# being used, and only once
+  if (!p_seq->in_use || p_seq->armed)
+    return;
+
+  // Round up, and keep the deadline within one turn of the wheel
+  tick = (deadline + WHEEL_TICK_MS - 1) / WHEEL_TICK_MS;
+  if (tick < g_seq.wheel_tick)
+    tick = g_seq.wheel_tick;
+  if (tick >= g_seq.wheel_tick + WHEEL_SLOTS)
+    tick = g_seq.wheel_tick + WHEEL_SLOTS - 1;
+
+  p_seq->deadline = deadline;
+  p_seq->slot = tick % WHEEL_SLOTS;
+  p_seq->prev = SEQ_NONE;
+  p_seq->next = g_seq.wheel[p_seq->slot];
+  if (p_seq->next != SEQ_NONE)
+    g_seq.seq[p_seq->next].prev = index;
+  g_seq.wheel[p_seq->slot] = index;
+  p_seq->armed = true;
+}
+
+// Release a seq# once its request is done, m_seq held
+static void
+seq_put(int8_t index) {
+  seq_buf_t *p_seq = &g_seq.seq[index];
+
+  // Unlink it from the timer wheel, if armed
+  if (p_seq->armed) {
+    if (p_seq->prev != SEQ_NONE)
+      g_seq.seq[p_seq->prev].next = p_seq->next;
+    else if (g_seq.wheel[p_seq->slot] == index)
+      g_seq.wheel[p_seq->slot] = p_seq->next;
+    if (p_seq->next != SEQ_NONE)
+      g_seq.seq[p_seq->next].prev = p_seq->prev;
+    p_seq->next = SEQ_NONE;
+    p_seq->prev = SEQ_NONE;
+    p_seq->armed = false;
+  }
+
+  if (!p_seq->in_use)
+    return;
+
+  p_seq->in_use = false;
+  g_prio[p_seq->prio].inflight--;
+  g_seq.free_q[(g_seq.free_head + g_seq.free_cnt) % SEQ_NUM_MAX] = index;
+  g_seq.free_cnt++;
+  g_seq.in_use_cnt--;
+}
+
+/*
+ * Latency entry of a command. If it has none yet, NULL unless alloc, then
+ * a free entry or else the least recently used one is taken over. Entries
+ * are reused in place and never freed, so probe sequences stay intact.
+ */
+static ipmb_cmd_tmo_t *
+tmo_lookup(uint8_t netfn, uint8_t cmd, bool alloc) {
+  ipmb_cmd_tmo_t *p_tmo, *p_lru = NULL;
+  int i, idx;
+
+  idx = (netfn * 31 + cmd) % TMO_CMDS_MAX;
+  for (i = 0; i < TMO_CMDS_MAX; i++) {
+    p_tmo = &g_tmo[(idx + i) % TMO_CMDS_MAX];
+    if (!p_tmo->used) {
+      if (!alloc)
+        return NULL;
+      p_lru = p_tmo;
       break;
     }
+    if (p_tmo->netfn == netfn && p_tmo->cmd == cmd)
+      return p_tmo;
+    if (p_lru == NULL || p_tmo->last < p_lru->last)
+      p_lru = p_tmo;
+  }
 
-    if (++index == SEQ_NUM_MAX) {
-      index = 0;
-    }
-  } while (index != g_seq.curr_seq);
+  if (!alloc)
+    return NULL;
 
-  // Update the current seq num
-  if (ret >= 0) {
-    if (++index == SEQ_NUM_MAX) {
-      index = 0;
+  memset(p_lru, 0, sizeof(ipmb_cmd_tmo_t));
+  p_lru->used = true;
+  p_lru->netfn = netfn;
+  p_lru->cmd = cmd;
+  return p_lru;
+}
+
+// Record the response latency of a command, m_seq held
+static void
+tmo_record(uint8_t netfn, uint8_t cmd, uint32_t lat) {
+  ipmb_cmd_tmo_t *p_tmo;
+  uint32_t sum = 0, p99;
+  int b, i;
+
+  p_tmo = tmo_lookup(netfn, cmd, true);
+  p_tmo->last = get_mono_ms();
+
+  for (b = 0; b < TMO_BUCKETS - 1 && lat >= (1U << b); b++);
+  p_tmo->hist[b]++;
+  p_tmo->cnt++;
+
+  if (p_tmo->cnt >= TMO_DECAY_SAMPLES) {
+    p_tmo->cnt = 0;
+    for (i = 0; i < TMO_BUCKETS; i++) {
+      p_tmo->hist[i] /= 2;
+      p_tmo->cnt += p_tmo->hist[i];
     }
-    g_seq.curr_seq = index;
   }
 
-  pthread_mutex_unlock(&m_seq);
+  if (p_tmo->cnt < TMO_MIN_SAMPLES)
+    return;
 
-  return ret;
+  p99 = p_tmo->cnt - p_tmo->cnt / 100;
+  for (b = 0; b < TMO_BUCKETS - 1; b++) {
+    sum += p_tmo->hist[b];
+    if (sum >= p99)
+      break;
+  }
+
+  p_tmo->timeout_ms = (1U << b) * TMO_P99_FACTOR;
+  if (p_tmo->timeout_ms < TMO_FLOOR_MS)
+    p_tmo->timeout_ms = TMO_FLOOR_MS;
+  if (p_tmo->timeout_ms > TIMEOUT_IPMB * 1000)
+    p_tmo->timeout_ms = TIMEOUT_IPMB * 1000;
+}
+
+// Response timeout of a command in ms, m_seq held
+static uint32_t
+tmo_get(uint8_t netfn, uint8_t cmd) {
+  ipmb_cmd_tmo_t *p_tmo;
+
+  p_tmo = tmo_lookup(netfn, cmd, false);
+  if (p_tmo == NULL || p_tmo->timeout_ms == 0)
+    return TIMEOUT_IPMB * 1000;
+
+  return p_tmo->timeout_ms;
+}
+
+// A response arrived: the BIC is alive, m_seq held
+static void
+brk_success(void) {
+  g_brk.miss = 0;
+  if (g_brk.open) {
+    g_brk.open = false;
+    syslog(LOG_WARNING, "bus: %d, BIC responding again after %llu ms",
+           g_bus_id, (unsigned long long) (get_mono_ms() - g_brk.opened));
+  }
+}
+
+// A response did not arrive in time, m_seq held
+static void
+brk_miss(void) {
+  if (g_brk.open || ++g_brk.miss < BRK_MISS_MAX)
+    return;
+
+  g_brk.open = true;
+  g_brk.trips++;
+  g_brk.opened = get_mono_ms();
+  g_brk.next_probe = g_brk.opened;
+  syslog(LOG_WARNING, "bus: %d, BIC not responding, failing requests "
+         "until it recovers", g_bus_id);
 }
 
 static int
@@ -465,6 +805,38 @@ ipmb_req_handler(void *bus_num) {
   }
 }
 
+// Send a response frame to a session, unless it was closed meanwhile
+static void
+sess_reply(int sess, uint32_t gen, uint32_t tag, uint8_t *buf, uint8_t len) {
+  ipmb_sess_t *p_sess;
+  uint8_t frame[sizeof(ipmb_sess_hdr_t) + MAX_BYTES];
+  ipmb_sess_hdr_t *hdr = (ipmb_sess_hdr_t *) frame;
+
+  // Nobody to tell about the requests of ipmbd itself
+  if (sess == SESS_NONE)
+    return;
+  p_sess = &g_sess[sess];
+
+  memset(hdr, 0, sizeof(ipmb_sess_hdr_t));
+  hdr->tag = tag;
+  hdr->len = len;
+  if (len)
+    memcpy(&frame[sizeof(ipmb_sess_hdr_t)], buf, len);
+
+  pthread_mutex_lock(&p_sess->m_send);
+  if (p_sess->sock >= 0 && p_sess->gen == gen) {
+    if (send(p_sess->sock, frame, sizeof(ipmb_sess_hdr_t) + len,
+             MSG_NOSIGNAL) < 0) {
+#ifdef DEBUG
+      syslog(LOG_WARNING, "ipmbd: send() failed\n");
+#endif
+      // Let the lib handler notice and clean up the session
+      shutdown(p_sess->sock, SHUT_RDWR);
+    }
+  }
+  pthread_mutex_unlock(&p_sess->m_send);
+}
+
 // Thread to handle the incoming responses
 static void*
 ipmb_res_handler(void *bus_num) {
@@ -474,6 +846,8 @@ ipmb_res_handler(void *bus_num) {
   mqd_t mq;
   ipmb_res_t *p_res;
   uint8_t index;
+  seq_buf_t seq;
+  uint32_t lat;
   char mq_ipmb_res[64] = {0};
 
   sprintf(mq_ipmb_res, "%s_%d", MQ_IPMB_RES, *bnum);
@@ -501,17 +875,32 @@ ipmb_res_handler(void *bus_num) {
     // Check if the response is being waited for
     pthread_mutex_lock(&m_seq);
     if (g_seq.seq[index].in_use) {
-      // Copy the response to the requester's buffer
-      memcpy(g_seq.seq[index].p_buf, buf, len);
-      g_seq.seq[index].len = len;
-
-      // Wake up the worker thread to receive the response
-      sem_post(&g_seq.seq[index].s_seq);
+      seq = g_seq.seq[index];
+      seq_put(index);
+      lat = get_mono_ms() - seq.sent;
+      tmo_record(seq.netfn, seq.cmd, lat);
+      brk_success();
+      pthread_mutex_unlock(&m_seq);
+
+      g_rx_stats.res_cnt++;
+      g_rx_stats.res_lat_total += lat;
+      if (lat > g_rx_stats.res_lat_max)
+        g_rx_stats.res_lat_max = lat;
+
+      // Pass the response straight to the client session
+      sess_reply(seq.sess, seq.gen, seq.tag, buf, len);
+
+      // A slot is free, let the lib handler start queued requests
+      if (write(g_wake_pipe[1], "", 1) < 0) {
+#ifdef DEBUG
+        syslog(LOG_WARNING, "ipmbd: wakeup failed\n");
+#endif
+      }
     } else {
+      pthread_mutex_unlock(&m_seq);
       // Either the IPMB packet is corrupted or arrived late after client exits
       syslog(LOG_WARNING, "bus: %d, WRONG packet received with seq#%d\n", g_bus_id, index);
     }
-    pthread_mutex_unlock(&m_seq);
 
 #ifdef DEBUG
     syslog(LOG_WARNING, "Received Response of %d bytes\n", len);
@@ -571,23 +960,60 @@ ipmb_rx_handler(void *bus_num) {
   struct sigaction usr_action;
   int pid;
   struct timespec ts;
+  struct pollfd pfd;
+  bool ready = false;
+  int spurious = 0;
+  int wait_ms;
   sigemptyset(&usr_action.sa_mask);
   usr_action.sa_flags = 0;
   usr_action.sa_handler = sig_handler_term;
   sigaction (SIGTERM, &usr_action, NULL);
   usr_action.sa_handler = sig_handler_user;
   sigaction (SIGUSR1, &usr_action, NULL);
+  usr_action.sa_handler = sig_handler_stats;
+  sigaction (SIGUSR2, &usr_action, NULL);
   pid = getpid();
   // Loop that retrieves messages
   while (1) {
     // Read messages from i2c driver
      *((int *)buf) = pid;
+     g_rx_stats.wakeups++;
      if (i2c_slave_read(fd, buf, &len) < 0) {
+      g_rx_stats.empty++;
+
+      // A driver without poll() support reports the device always ready
+      if (!g_rx_polling && ready && ++spurious > RX_SPURIOUS_MAX) {
+        syslog(LOG_WARNING, "bus: %d, no poll() support, polling for rx\n", g_bus_id);
+        g_rx_polling = true;
+      }
+
+      if (!g_rx_polling) {
+        // Sleep until the slave device has a frame
+        pfd.fd = fd;
+        pfd.events = POLLIN;
+        pfd.revents = 0;
+        ready = (poll(&pfd, 1, 1000) > 0);
+        if (pfd.revents & (POLLERR | POLLNVAL)) {
+          syslog(LOG_WARNING, "bus: %d, poll() failed, polling for rx\n", g_bus_id);
+          g_rx_polling = true;
+        }
+        continue;
+      }
+
+      // Polling fallback: the driver's SIGUSR1 cuts the wait short
+      wait_ms = (get_mono_ms() < g_rx_fast_until) ?
+                RX_POLL_FAST_MS : RX_POLL_WAIT_MS;
       clock_gettime(CLOCK_REALTIME, &ts);
-      ts.tv_nsec += 10000000;
+      ts.tv_nsec += wait_ms * 1000000;
+      if (ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+      }
       sem_timedwait(&event_sem, &ts);
       continue;
     }
+    spurious = 0;
+    g_rx_stats.frames++;
 
     // TODO: HACK: Due to i2cdriver issues, we are seeing two different type of packet corruptions
     // 1. The firstbyte(BMC's slave address) byte is same as second byte
@@ -672,121 +1098,371 @@ cleanup:
 
 /*
  * Function to handle all IPMB requests
+ *
+ * Sends the request on the bus and returns right away; the response
+ * handler passes the response to the session, or the lib handler fails
+ * the request once its deadline has passed.
  */
-static void
-ipmb_handle (int fd, unsigned char *request, unsigned char req_len,
-       unsigned char *response, unsigned char *res_len)
+static int
+ipmb_handle (int fd, int sess, uint32_t gen, ipmb_sess_hdr_t *hdr,
+             unsigned char *request)
 {
   ipmb_req_t *req = (ipmb_req_t *) request;
-  ipmb_res_t *res = (ipmb_res_t *) response;
-
+  unsigned char req_len = hdr->len;
+  uint8_t prio = hdr->flags & IPMB_SESS_PRIO_MASK;
   int8_t index;
-  struct timespec ts;
+  seq_buf_t *p_seq;
+  int i;
 
-  // Allocate right sequence Number
-  index = seq_get_new();
+  // Allocate right sequence Number, remembering who is waiting for the
+  // response
+  index = seq_get_new(prio, sess, gen, hdr->tag, req->netfn_lun >> LUN_OFFSET,
+                      req->cmd);
   if (index < 0) {
-    *res_len = 0;
-    return ;
+    return -1;
   }
+  g_prio[prio].reqs++;
+  p_seq = &g_seq.seq[index];
 
   req->seq_lun = index << LUN_OFFSET;
 
   // Calculate/update dataCksum
   // Note: dataCkSum byte is last byte
-  int i;
   for (i = IPMB_DATA_OFFSET; i < req_len-1; i++) {
     request[req_len-1] += request[i];
   }
 
   request[req_len-1] = ZERO_CKSUM_CONST - request[req_len-1];
 
-  // Setup response buffer
-  pthread_mutex_lock(&m_seq);
-  g_seq.seq[index].p_buf = response;
-  pthread_mutex_unlock(&m_seq);
+  // The polling rx fallback checks more often while a response is due
+  g_rx_fast_until = get_mono_ms() + RX_FAST_WINDOW_MS;
 
   // Send request over i2c bus
   // Note: Need not send first byte SlaveAddress automatically added by driver
   if (i2c_write(fd, &request[1], req_len-1)) {
-    goto ipmb_handle_out;
+    // Unless a stray response or the timer released it meanwhile
+    pthread_mutex_lock(&m_seq);
+    if (p_seq->in_use && p_seq->sess == sess && p_seq->gen == gen &&
+        p_seq->tag == hdr->tag) {
+      seq_put(index);
+    }
+    pthread_mutex_unlock(&m_seq);
+    sess_reply(sess, gen, hdr->tag, NULL, 0);
   }
 
-  // Wait on semaphore for that sequence Number
-  clock_gettime(CLOCK_REALTIME, &ts);
+  return 0;
+}
 
-  ts.tv_sec += TIMEOUT_IPMB;
+/*
+ * Start the queued requests, highest priority class first, as long as
+ * their class has slots left. Requests queued for TIMEOUT_IPMB or longer
+ * fail instead: a response would come too late to be of use.
+ */
+static void
+ipmb_dispatch(int fd) {
+  ipmb_prio_t *p_prio;
+  ipmb_pend_t *p_pend;
+  uint32_t wait;
+  int prio;
+
+  for (prio = 0; prio < IPMB_PRIO_CNT; prio++) {
+    p_prio = &g_prio[prio];
+    while (p_prio->cnt > 0) {
+      p_pend = &p_prio->q[p_prio->head];
+
+      // Drop the requests of clients gone while they were queued
+      if (p_pend->gen != g_sess[p_pend->sess].gen) {
+        p_prio->head = (p_prio->head + 1) % PRIO_QUEUE_MAX;
+        p_prio->cnt--;
+        continue;
+      }
+
+      // The BIC stopped answering while they were queued
+      if (g_brk.open) {
+        g_brk.fast_fails++;
+        sess_reply(p_pend->sess, p_pend->gen, p_pend->hdr.tag, NULL, 0);
+        p_prio->head = (p_prio->head + 1) % PRIO_QUEUE_MAX;
+        p_prio->cnt--;
+        continue;
+      }
+
+      wait = get_mono_ms() - p_pend->queued;
+      if (wait >= TIMEOUT_IPMB * 1000) {
+        p_prio->expired++;
+        sess_reply(p_pend->sess, p_pend->gen, p_pend->hdr.tag, NULL, 0);
+        p_prio->head = (p_prio->head + 1) % PRIO_QUEUE_MAX;
+        p_prio->cnt--;
+        continue;
+      }
+
+      if (ipmb_handle(fd, p_pend->sess, p_pend->gen, &p_pend->hdr,
+                      p_pend->buf) < 0) {
+        break;
+      }
+
+      p_prio->wait_total += wait;
+      if (wait > p_prio->wait_max)
+        p_prio->wait_max = wait;
+
+      p_prio->head = (p_prio->head + 1) % PRIO_QUEUE_MAX;
+      p_prio->cnt--;
+    }
+  }
+}
+
+// Start a request from a session right away, or queue it by priority
+static void
+ipmb_submit(int fd, int sess, ipmb_sess_hdr_t *hdr, unsigned char *request) {
+  uint8_t prio = hdr->flags & IPMB_SESS_PRIO_MASK;
+  ipmb_prio_t *p_prio;
+  ipmb_pend_t *p_pend;
+  int i;
+
+  if (hdr->len < IPMB_PKT_MIN_SIZE || prio >= IPMB_PRIO_CNT) {
+    sess_reply(sess, g_sess[sess].gen, hdr->tag, NULL, 0);
+    return;
+  }
+  p_prio = &g_prio[prio];
+
+  // Don't make the client wait for a timeout the BIC is sure to hit
+  if (g_brk.open) {
+    g_brk.fast_fails++;
+    sess_reply(sess, g_sess[sess].gen, hdr->tag, NULL, 0);
+    return;
+  }
+
+  // Nothing of this or a higher class waiting: don't queue
+  for (i = 0; i <= prio; i++) {
+    if (g_prio[i].cnt)
+      break;
+  }
+  if (i > prio &&
+      ipmb_handle(fd, sess, g_sess[sess].gen, hdr, request) == 0) {
+    return;
+  }
 
-  int ret;
-  ret = sem_timedwait(&g_seq.seq[index].s_seq, &ts);
-  if (ret == -1) {
-    syslog(LOG_DEBUG, "No response for sequence number: %d\n", index);
-    *res_len = 0;
+  if (p_prio->cnt == PRIO_QUEUE_MAX) {
+    p_prio->dropped++;
+    sess_reply(sess, g_sess[sess].gen, hdr->tag, NULL, 0);
+    return;
   }
 
-ipmb_handle_out:
-  // Reply to user with data
+  p_pend = &p_prio->q[(p_prio->head + p_prio->cnt) % PRIO_QUEUE_MAX];
+  p_pend->sess = sess;
+  p_pend->gen = g_sess[sess].gen;
+  p_pend->hdr = *hdr;
+  p_pend->queued = get_mono_ms();
+  memcpy(p_pend->buf, request, hdr->len);
+  p_prio->cnt++;
+  p_prio->queued++;
+}
+
+/*
+ * Fail the requests whose response did not arrive in time, walking only
+ * the timer wheel slots of the ticks passed since the last call. Returns
+ * the ms until the next tick, or 1 sec if nothing is in flight.
+ */
+static int
+seq_expire(void) {
+  uint64_t now = get_mono_ms();
+  uint64_t now_tick = now / WHEEL_TICK_MS;
+  seq_buf_t seq;
+  int8_t index;
+  int wait;
+
   pthread_mutex_lock(&m_seq);
-  *res_len = g_seq.seq[index].len;
+  while (g_seq.wheel_tick <= now_tick) {
+    while ((index = g_seq.wheel[g_seq.wheel_tick % WHEEL_SLOTS]) != SEQ_NONE) {
+      seq = g_seq.seq[index];
+      seq_put(index);
+      // Late responses count as taking at least the timeout
+      tmo_record(seq.netfn, seq.cmd, (uint32_t) (seq.deadline - seq.sent));
+      brk_miss();
+      pthread_mutex_unlock(&m_seq);
+
+      syslog(LOG_DEBUG, "No response for sequence number: %d\n", index);
+      sess_reply(seq.sess, seq.gen, seq.tag, NULL, 0);
+
+      pthread_mutex_lock(&m_seq);
+    }
+    g_seq.wheel_tick++;
+  }
+  wait = g_seq.in_use_cnt ?
+         (int) (g_seq.wheel_tick * WHEEL_TICK_MS - now) : 1000;
+  pthread_mutex_unlock(&m_seq);
+
+  return wait;
+}
 
-  g_seq.seq[index].in_use = false;
+/*
+ * While the breaker is open, send a Get Device ID to the BIC every
+ * BRK_PROBE_MS; its response closes the breaker. The lib handler wakes
+ * up at least once a second, which is often enough to keep the pace.
+ */
+static void
+brk_probe(int fd) {
+  unsigned char buf[IPMB_HDR_SIZE + IPMI_REQ_HDR_SIZE] = { 0 };
+  ipmb_req_t *req = (ipmb_req_t *) buf;
+  ipmb_sess_hdr_t hdr;
+  uint64_t now = get_mono_ms();
+
+  pthread_mutex_lock(&m_seq);
+  if (!g_brk.open || now < g_brk.next_probe) {
+    pthread_mutex_unlock(&m_seq);
+    return;
+  }
+  g_brk.next_probe = now + BRK_PROBE_MS;
+  g_brk.probes++;
   pthread_mutex_unlock(&m_seq);
 
-  return;
+  req->res_slave_addr = BRIDGE_SLAVE_ADDR << 1;
+  req->netfn_lun = NETFN_APP_REQ << LUN_OFFSET;
+  req->hdr_cksum = ZERO_CKSUM_CONST -
+                   (uint8_t) (req->res_slave_addr + req->netfn_lun);
+  req->req_slave_addr = BMC_SLAVE_ADDR << 1;
+  req->cmd = CMD_APP_GET_DEVICE_ID;
+
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.len = sizeof(buf);
+  hdr.flags = IPMB_PRIO_CTRL;
+  ipmb_handle(fd, SESS_NONE, 0, &hdr, buf);
 }
 
-void
-*conn_handler(void *sfd) {
-  ipmb_sfd_t *p_sfd = (ipmb_sfd_t *) sfd;
+static void
+rx_dump_stats(void) {
+  uint32_t n = g_rx_stats.res_cnt ? g_rx_stats.res_cnt : 1;
+  int i;
+
+  syslog(LOG_INFO, "bus: %d, rx: %s, frames: %u, wakeups: %u, empty: %u, "
+         "responses: %u, latency avg: %llu ms, max: %u ms", g_bus_id,
+         g_rx_polling ? "polling" : "poll()", g_rx_stats.frames,
+         g_rx_stats.wakeups, g_rx_stats.empty, g_rx_stats.res_cnt,
+         (unsigned long long) (g_rx_stats.res_lat_total / n),
+         g_rx_stats.res_lat_max);
+
+  for (i = 0; i < IPMB_PRIO_CNT; i++) {
+    n = g_prio[i].queued ? g_prio[i].queued : 1;
+    syslog(LOG_INFO, "bus: %d, class: %d, requests: %u, in flight: %u/%u, "
+           "queued: %u, dropped: %u, expired: %u, queue wait avg: %llu ms, "
+           "max: %u ms", g_bus_id, i, g_prio[i].reqs, g_prio[i].inflight,
+           g_prio[i].max_inflight, g_prio[i].queued, g_prio[i].dropped,
+           g_prio[i].expired,
+           (unsigned long long) (g_prio[i].wait_total / n),
+           g_prio[i].wait_max);
+  }
 
-  int sock = p_sfd->sock;
-  int fd = p_sfd->fd;
-  int n;
-  unsigned char req_buf[MAX_IPMB_RES_LEN];
-  unsigned char res_buf[MAX_IPMB_RES_LEN];
-  unsigned char res_len = 0;
+  syslog(LOG_INFO, "bus: %d, breaker: %s, missed in a row: %u, trips: %u, "
+         "fast fails: %u, probes: %u", g_bus_id,
+         g_brk.open ? "open" : "closed", g_brk.miss, g_brk.trips,
+         g_brk.fast_fails, g_brk.probes);
+
+  for (i = 0; i < TMO_CMDS_MAX; i++) {
+    if (g_tmo[i].used && g_tmo[i].timeout_ms) {
+      syslog(LOG_INFO, "bus: %d, netfn: 0x%X, cmd: 0x%X, samples: %u, "
+             "timeout: %u ms", g_bus_id, g_tmo[i].netfn, g_tmo[i].cmd,
+             g_tmo[i].cnt, g_tmo[i].timeout_ms);
+    }
+  }
+}
+
+static void
+sess_open(int sock) {
+  int i;
   struct timeval tv;
 
-  // setup timeout for receving on socket
-  tv.tv_sec = TIMEOUT_IPMB;
+  // Don't let a client that stops reading stall the bus. Reads never
+  // block, see sess_recv()
+  tv.tv_sec = 1;
   tv.tv_usec = 0;
+  setsockopt(sock, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv,sizeof(struct timeval));
+
+  for (i = 0; i < MAX_IPMB_SESS; i++) {
+    if (g_sess[i].sock < 0) {
+      pthread_mutex_lock(&g_sess[i].m_send);
+      g_sess[i].sock = sock;
+      g_sess[i].rx_len = 0;
+      pthread_mutex_unlock(&g_sess[i].m_send);
+      return;
+    }
+  }
+
+  syslog(LOG_WARNING, "ipmbd: too many clients, connection refused\n");
+  close(sock);
+}
 
-  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv,sizeof(struct timeval));
+static void
+sess_close(int sess) {
+  pthread_mutex_lock(&g_sess[sess].m_send);
+  close(g_sess[sess].sock);
+  g_sess[sess].sock = -1;
+  g_sess[sess].gen++;
+  pthread_mutex_unlock(&g_sess[sess].m_send);
+}
+
+/*
+ * Read what a session has sent so far, without blocking, and start or
+ * queue each complete request frame. A partial frame stays in the
+ * session buffer until the rest arrives, so a slow client can't stall
+ * the poll loop and the bus with it.
+ */
+static void
+sess_recv(int fd, int sess) {
+  ipmb_sess_t *p_sess = &g_sess[sess];
+  ipmb_sess_hdr_t hdr;
+  uint16_t off = 0, frame_len;
+  int n;
 
-  n = recv(sock, req_buf, sizeof(req_buf), 0);
+  n = recv(p_sess->sock, &p_sess->rx[p_sess->rx_len],
+           sizeof(p_sess->rx) - p_sess->rx_len, MSG_DONTWAIT);
+  if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+    return;
   if (n <= 0) {
-      syslog(LOG_WARNING, "ipmbd: recv() failed with %d\n", n);
-      goto conn_cleanup;
+    sess_close(sess);
+    return;
   }
+  p_sess->rx_len += n;
 
-  ipmb_handle(fd, req_buf, n, res_buf, &res_len);
+  while (p_sess->rx_len - off >= sizeof(hdr)) {
+    memcpy(&hdr, &p_sess->rx[off], sizeof(hdr));
+    if (hdr.len > MAX_IPMB_RES_LEN) {
+      sess_close(sess);
+      return;
+    }
+    frame_len = sizeof(hdr) + hdr.len;
+    if (p_sess->rx_len - off < frame_len)
+      break;
 
-  if (send(sock, res_buf, res_len, MSG_NOSIGNAL) < 0) {
-#ifdef DEBUG
-    syslog(LOG_WARNING, "ipmbd: send() failed\n");
-#endif
+    ipmb_submit(fd, sess, &hdr, &p_sess->rx[off + sizeof(hdr)]);
+    off += frame_len;
   }
 
-conn_cleanup:
-  close(sock);
-  free(p_sfd);
-
-  pthread_exit(NULL);
-  return 0;
+  // Keep the partial frame at the start of the buffer
+  if (off) {
+    p_sess->rx_len -= off;
+    memmove(p_sess->rx, &p_sess->rx[off], p_sess->rx_len);
+  }
 }
 
-// Thread to receive the IPMB lib messages from various apps
+/*
+ * Thread to receive the IPMB lib messages from various apps
+ *
+ * Clients keep their connection open and may have several requests in
+ * flight on it, so one poll() loop serves all of them: requests are sent
+ * on the bus as they arrive and the responses are matched by seq#.
+ */
 static void*
 ipmb_lib_handler(void *bus_num) {
   int s, s2, t, len;
   struct sockaddr_un local, remote;
-  pthread_t tid;
-  ipmb_sfd_t *sfd;
+  struct pollfd pfd[MAX_IPMB_SESS + 2];
+  int pfd_sess[MAX_IPMB_SESS + 2];
+  char drain[16];
   int fd;
   uint8_t *bnum = (uint8_t*) bus_num;
   char sock_path[20] = {0};
   int rc = 0;
-  pthread_attr_t attr;
+  int i, n, cnt, wait;
+  sig_atomic_t stats_seen = 0;
 
   // Open the i2c bus for sending request
   fd = i2c_open(*bnum);
@@ -796,19 +1472,24 @@ ipmb_lib_handler(void *bus_num) {
   }
 
   // Initialize g_seq structure
-  int i;
-  for (i = 0; i < SEQ_NUM_MAX; i++) {
-    g_seq.seq[i].in_use = false;
-    sem_init(&g_seq.seq[i].s_seq, 0, 0);
-    g_seq.seq[i].len = 0;
-  }
+  seq_init();
 
-  pthread_attr_init(&attr);
-  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  for (i = 0; i < MAX_IPMB_SESS; i++) {
+    g_sess[i].sock = -1;
+    g_sess[i].gen = 0;
+    pthread_mutex_init(&g_sess[i].m_send, NULL);
+  }
 
   // Initialize mutex to access global structure
   pthread_mutex_init(&m_seq, NULL);
 
+  if (pipe(g_wake_pipe) < 0) {
+    syslog(LOG_WARNING, "ipmbd: pipe() failed\n");
+    exit (1);
+  }
+  fcntl(g_wake_pipe[0], F_SETFL, O_NONBLOCK);
+  fcntl(g_wake_pipe[1], F_SETFL, O_NONBLOCK);
+
   if ((s = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
   {
     syslog(LOG_WARNING, "ipmbd: socket() failed\n");
@@ -834,34 +1515,59 @@ ipmb_lib_handler(void *bus_num) {
   }
 
   while(1) {
-    int n;
-    t = sizeof (remote);
-    // TODO: Seen accept() call failure and need further debug
-    if ((s2 = accept (s, (struct sockaddr *) &remote, &t)) < 0) {
-      rc = errno;
-      syslog(LOG_WARNING, "ipmbd: accept() failed with ret: %x, errno: %x\n", s2, rc);
-      sleep(5);
-      continue;
+    wait = seq_expire();
+    brk_probe(fd);
+    ipmb_dispatch(fd);
+
+    if (stats_seen != g_stats_req) {
+      stats_seen = g_stats_req;
+      rx_dump_stats();
     }
 
-    // Creating a worker thread to handle the request
-    // TODO: Need to monitor the server performance with higher load and
-    // see if we need to create pre-defined number of workers and schedule
-    // the requests among them.
-    sfd = (ipmb_sfd_t *) malloc(sizeof(ipmb_sfd_t));
-    sfd->fd = fd;
-    sfd->sock = s2;
-    if (pthread_create(&tid, &attr, conn_handler, (void*) sfd) < 0) {
-        syslog(LOG_WARNING, "ipmbd: pthread_create failed\n");
-        close(s2);
+    pfd[0].fd = s;
+    pfd[0].events = POLLIN;
+    pfd[1].fd = g_wake_pipe[0];
+    pfd[1].events = POLLIN;
+    cnt = 2;
+    for (i = 0; i < MAX_IPMB_SESS; i++) {
+      if (g_sess[i].sock < 0)
         continue;
+      pfd[cnt].fd = g_sess[i].sock;
+      pfd[cnt].events = POLLIN;
+      pfd_sess[cnt] = i;
+      cnt++;
+    }
+
+    n = poll(pfd, cnt, wait);
+    if (n <= 0)
+      continue;
+
+    if (pfd[1].revents & POLLIN) {
+      while (read(g_wake_pipe[0], drain, sizeof(drain)) > 0);
     }
 
+    for (i = 2; i < cnt; i++) {
+      if (pfd[i].revents & POLLIN)
+        sess_recv(fd, pfd_sess[i]);
+      else if (pfd[i].revents & (POLLHUP | POLLERR | POLLNVAL))
+        sess_close(pfd_sess[i]);
+    }
+
+    if (pfd[0].revents & POLLIN) {
+      t = sizeof (remote);
+      // TODO: Seen accept() call failure and need further debug
+      if ((s2 = accept (s, (struct sockaddr *) &remote, &t)) < 0) {
+        rc = errno;
+        syslog(LOG_WARNING, "ipmbd: accept() failed with ret: %x, errno: %x\n", s2, rc);
+        sleep(5);
+        continue;
+      }
+      sess_open(s2);
+    }
   }
 
   close(s);
   pthread_mutex_destroy(&m_seq);
-  pthread_attr_destroy(&attr);
 
   return 0;
 }
@@ -882,11 +1588,15 @@ main(int argc, char * const argv[]) {
   daemon(1, 0);
   openlog("ipmbd", LOG_CONS, LOG_DAEMON);
 
-  if (argc != 2) {
-    syslog(LOG_WARNING, "ipmbd: Usage: ipmbd <bus#>");
+  if (argc < 2 || argc > 3 ||
+      (argc == 3 && strcmp(argv[2], "--poll-rx"))) {
+    syslog(LOG_WARNING, "ipmbd: Usage: ipmbd <bus#> [--poll-rx]");
     exit(1);
   }
 
+  // Kernels whose slave driver can't poll() keep the timed polling rx
+  g_rx_polling = (argc == 3);
+
   ipmb_bus_num = atoi(argv[1]);
   g_bus_id = ipmb_bus_num;
 
@@ -29,16 +29,51 @@
 #include <errno.h>
 #include <syslog.h>
 #include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <signal.h>
+#include <time.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
+#include <sys/epoll.h>
 #include <openbmc/ipmi.h>
 #include <openbmc/pal.h>
 
 #define SIZE_IANA_ID 3
 #define SIZE_SYS_GUID 16
 
+#define MAX_NETFN 64
+#define MAX_CMD 256
+#define IPMI_CMD_ANY -1
+
+// Threads serving the requests, and the clients connected at once
+#define IPMI_WORKERS 4
+#define MAX_IPMI_CONN 64
+
+typedef void (*ipmi_cmd_handler_t)(unsigned char *request,
+    unsigned char req_len, unsigned char *response, unsigned char *res_len);
+
+// Entry of the command dispatch table
+typedef struct _ipmi_cmd_t {
+  unsigned char netfn;
+  int cmd; // IPMI_CMD_ANY: all the commands of netfn not listed
+  ipmi_cmd_handler_t handler;
+  pthread_rwlock_t *lock; // NULL if the handler touches no shared state
+  bool excl; // take the lock for writing
+  // Call statistics, protected by m_cmd_stats
+  uint32_t calls;
+  uint64_t lat_total_us;
+  uint32_t lat_max_us;
+} ipmi_cmd_t;
+
+// Client connection
+typedef struct _ipmi_conn_t {
+  int sock; // -1 when the entry is free
+  uint64_t accepted; // CLOCK_MONOTONIC ms, 0 once handed to a worker
+} ipmi_conn_t;
+
 extern void plat_lan_init(lan_config_t *lan);
 
 // TODO: Once data storage is finalized, the following structure needs
@@ -50,15 +85,24 @@ static dimm_info_t g_dimm_info[MAX_NUM_DIMMS] = { 0 };
 // TODO: Need to store this info after identifying proper storage
 static sys_info_param_t g_sys_info_params;
 
-// TODO: Based on performance testing results, might need fine grained locks
-// Since the global data is specific to a NetFunction, adding locs at NetFn level
-static pthread_mutex_t m_chassis;
-static pthread_mutex_t m_sensor;
-static pthread_mutex_t m_app;
-static pthread_mutex_t m_storage;
-static pthread_mutex_t m_transport;
-static pthread_mutex_t m_oem;
-static pthread_mutex_t m_oem_1s;
+// Locks of the state shared between commands, see the dispatch table
+static pthread_rwlock_t m_sel = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t m_sdr = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t m_sys_info = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t m_lan = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t m_oem_info = PTHREAD_RWLOCK_INITIALIZER;
+static pthread_rwlock_t m_post = PTHREAD_RWLOCK_INITIALIZER;
+
+static pthread_mutex_t m_cmd_stats = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t g_stats_req = 0;
+
+// Connections and the queue of those ready for a worker, under m_work
+static ipmi_conn_t g_conn[MAX_IPMI_CONN];
+static int g_work_q[MAX_IPMI_CONN];
+static int g_work_head = 0;
+static int g_work_cnt = 0;
+static pthread_mutex_t m_work = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t c_work = PTHREAD_COND_INITIALIZER;
 
 static void ipmi_handle(unsigned char *request, unsigned char req_len,
        unsigned char *response, unsigned char *res_len);
@@ -68,7 +112,8 @@ static void ipmi_handle(unsigned char *request, unsigned char req_len,
  */
 // Get Chassis Status (IPMI/Section 28.2)
 static void
-chassis_get_status (unsigned char *response, unsigned char *res_len)
+chassis_get_status (unsigned char *request, unsigned char req_len,
+                    unsigned char *response, unsigned char *res_len)
 {
   ipmi_res_t *res = (ipmi_res_t *) response;
   unsigned char *data = &res->data[0];
@@ -87,8 +132,8 @@ chassis_get_status (unsigned char *response, unsigned char *res_len)
 
 // Get System Boot Options (IPMI/Section 28.12)
 static void
-chassis_get_boot_options (unsigned char *request, unsigned char *response,
-			  unsigned char *res_len)
+chassis_get_boot_options (unsigned char *request, unsigned char req_len,
+                          unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res= (ipmi_res_t *) response;
@@ -147,31 +192,6 @@ chassis_get_boot_options (unsigned char *request, unsigned char *response,
   }
 }
 
-// Handle Chassis Commands (IPMI/Section 28)
-static void
-ipmi_handle_chassis (unsigned char *request, unsigned char req_len,
-		     unsigned char *response, unsigned char *res_len)
-{
-  ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
-  ipmi_res_t *res = (ipmi_res_t *) response;
-  unsigned char cmd = req->cmd;
-
-  pthread_mutex_lock(&m_chassis);
-  switch (cmd)
-  {
-    case CMD_CHASSIS_GET_STATUS:
-      chassis_get_status (response, res_len);
-      break;
-    case CMD_CHASSIS_GET_BOOT_OPTIONS:
-      chassis_get_boot_options (request, response, res_len);
-      break;
-    default:
-      res->cc = CC_INVALID_CMD;
-      break;
-  }
-  pthread_mutex_unlock(&m_chassis);
-}
-
 /*
  * Function(s) to handle IPMI messages with NetFn: Sensor
  */
@@ -201,34 +221,13 @@ sensor_plat_event_msg(unsigned char *request, unsigned char req_len,
   res->cc = CC_SUCCESS;
 }
 
-// Handle Sensor/Event Commands (IPMI/Section 29)
-static void
-ipmi_handle_sensor(unsigned char *request, unsigned char req_len,
-                   unsigned char *response, unsigned char *res_len)
-{
-  ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
-  ipmi_res_t *res = (ipmi_res_t *) response;
-  unsigned char cmd = req->cmd;
-
-  pthread_mutex_lock(&m_sensor);
-  switch (cmd)
-  {
-    case CMD_SENSOR_PLAT_EVENT_MSG:
-      sensor_plat_event_msg(request, req_len, response, res_len);
-      break;
-    default:
-      res->cc = CC_INVALID_CMD;
-      break;
-  }
-  pthread_mutex_unlock(&m_sensor);
-}
-
 /*
  * Function(s) to handle IPMI messages with NetFn: Application
  */
 // Get Device ID (IPMI/Section 20.1)
 static void
-app_get_device_id (unsigned char *response, unsigned char *res_len)
+app_get_device_id (unsigned char *request, unsigned char req_len,
+                   unsigned char *response, unsigned char *res_len)
 {
 
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -258,7 +257,8 @@ app_get_device_id (unsigned char *response, unsigned char *res_len)
 
 // Cold Reset (IPMI/Section 20.2)
 static void
-app_cold_reset(void)
+app_cold_reset (unsigned char *request, unsigned char req_len,
+                unsigned char *response, unsigned char *res_len)
 {
   system("/sbin/reboot");
 }
@@ -266,7 +266,8 @@ app_cold_reset(void)
 
 // Get Self Test Results (IPMI/Section 20.4)
 static void
-app_get_selftest_results (unsigned char *response, unsigned char *res_len)
+app_get_selftest_results (unsigned char *request, unsigned char req_len,
+                          unsigned char *response, unsigned char *res_len)
 {
 
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -283,7 +284,8 @@ app_get_selftest_results (unsigned char *response, unsigned char *res_len)
 
 // Get Device GUID (IPMI/Section 20.8)
 static void
-app_get_device_guid (unsigned char *response, unsigned char *res_len)
+app_get_device_guid (unsigned char *request, unsigned char req_len,
+                     unsigned char *response, unsigned char *res_len)
 {
   ipmi_res_t *res = (ipmi_res_t *) response;
   unsigned char *data = &res->data[0];
@@ -312,8 +314,8 @@ app_get_device_guid (unsigned char *response, unsigned char *res_len)
 }
 
 static void
-app_get_device_sys_guid (unsigned char *request, unsigned char *response,
-                         unsigned char *res_len)
+app_get_device_sys_guid (unsigned char *request, unsigned char req_len,
+                         unsigned char *response, unsigned char *res_len)
 {
   int ret;
 
@@ -333,7 +335,8 @@ app_get_device_sys_guid (unsigned char *request, unsigned char *response,
 
 // Get BMC Global Enables (IPMI/Section 22.2)
 static void
-app_get_global_enables (unsigned char *response, unsigned char *res_len)
+app_get_global_enables (unsigned char *request, unsigned char req_len,
+                        unsigned char *response, unsigned char *res_len)
 {
 
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -348,8 +351,8 @@ app_get_global_enables (unsigned char *response, unsigned char *res_len)
 
 // Set System Info Params (IPMI/Section 22.14a)
 static void
-app_set_sys_info_params (unsigned char *request, unsigned char *response,
-			 unsigned char *res_len)
+app_set_sys_info_params (unsigned char *request, unsigned char req_len,
+                         unsigned char *response, unsigned char *res_len)
 {
 
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
@@ -395,8 +398,8 @@ app_set_sys_info_params (unsigned char *request, unsigned char *response,
 
 // Get System Info Params (IPMI/Section 22.14b)
 static void
-app_get_sys_info_params (unsigned char *request, unsigned char *response,
-			 unsigned char *res_len)
+app_get_sys_info_params (unsigned char *request, unsigned char req_len,
+                         unsigned char *response, unsigned char *res_len)
 {
 
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
@@ -454,55 +457,13 @@ app_get_sys_info_params (unsigned char *request, unsigned char *response,
   return;
 }
 
-// Handle Appliction Commands (IPMI/Section 20)
-static void
-ipmi_handle_app (unsigned char *request, unsigned char req_len,
-		 unsigned char *response, unsigned char *res_len)
-{
-  ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
-  ipmi_res_t *res = (ipmi_res_t *) response;
-  unsigned char cmd = req->cmd;
-
-  pthread_mutex_lock(&m_app);
-  switch (cmd)
-  {
-    case CMD_APP_GET_DEVICE_ID:
-      app_get_device_id (response, res_len);
-      break;
-    case CMD_APP_COLD_RESET:
-      app_cold_reset ();
-      break;
-    case CMD_APP_GET_SELFTEST_RESULTS:
-      app_get_selftest_results (response, res_len);
-      break;
-    case CMD_APP_GET_DEVICE_GUID:
-      app_get_device_guid (response, res_len);
-      break;
-    case CMD_APP_GET_SYSTEM_GUID:
-      app_get_device_sys_guid (request, response, res_len);
-      break;
-    case CMD_APP_GET_GLOBAL_ENABLES:
-      app_get_global_enables (response, res_len);
-      break;
-    case CMD_APP_SET_SYS_INFO_PARAMS:
-      app_set_sys_info_params (request, response, res_len);
-      break;
-    case CMD_APP_GET_SYS_INFO_PARAMS:
-      app_get_sys_info_params (request, response, res_len);
-      break;
-    default:
-      res->cc = CC_INVALID_CMD;
-      break;
-  }
-  pthread_mutex_unlock(&m_app);
-}
-
 /*
  * Function(s) to handle IPMI messages with NetFn: Storage
  */
 
 static void
-storage_get_fruid_info(unsigned char *request, unsigned char *response, unsigned char *res_len)
+storage_get_fruid_info (unsigned char *request, unsigned char req_len,
+                        unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -521,8 +482,8 @@ storage_get_fruid_info(unsigned char *request, unsigned char *response, unsigned
 }
 
 static void
-storage_get_fruid_data(unsigned char *request, unsigned char *response,
-    unsigned char *res_len)
+storage_get_fruid_data (unsigned char *request, unsigned char req_len,
+                        unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -547,7 +508,8 @@ storage_get_fruid_data(unsigned char *request, unsigned char *response,
 }
 
 static void
-storage_get_sdr_info (unsigned char *response, unsigned char *res_len)
+storage_get_sdr_info (unsigned char *request, unsigned char req_len,
+                      unsigned char *response, unsigned char *res_len)
 {
   ipmi_res_t *res = (ipmi_res_t *) response;
   unsigned char *data = &res->data[0];
@@ -584,7 +546,8 @@ storage_get_sdr_info (unsigned char *response, unsigned char *res_len)
 }
 
 static void
-storage_rsv_sdr (unsigned char *request, unsigned char *response, unsigned char *res_len)
+storage_rsv_sdr (unsigned char *request, unsigned char req_len,
+                 unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -609,8 +572,8 @@ storage_rsv_sdr (unsigned char *request, unsigned char *response, unsigned char
 }
 
 static void
-storage_get_sdr (unsigned char *request, unsigned char *response,
-		 unsigned char *res_len)
+storage_get_sdr (unsigned char *request, unsigned char req_len,
+                 unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -621,17 +584,16 @@ storage_get_sdr (unsigned char *request, unsigned char *response,
   int rsv_id;			// Reservation ID for the request
   int rec_offset;		// Read offset into the record
   int rec_bytes;		// Number of bytes to be read
-  sdr_rec_t entry;		// SDR record entry
-  int ret;
 
   rsv_id = (req->data[1] << 8) | req->data[0];
   read_rec_id = (req->data[3] << 8) | req->data[2];
   rec_offset = req->data[4];
   rec_bytes = req->data[5];
 
-  // Use platform API to read the record Id and get next ID
-  ret = sdr_get_entry (req->payload_id, rsv_id, read_rec_id, &entry, &next_rec_id);
-  if (ret)
+  // Use platform API to copy the record bytes and get next ID
+  rec_bytes = sdr_get_entry (req->payload_id, rsv_id, read_rec_id, rec_offset,
+                             rec_bytes, &data[2], &next_rec_id);
+  if (rec_bytes < 0)
   {
       res->cc = CC_UNSPECIFIED_ERROR;
       return;
@@ -641,7 +603,6 @@ storage_get_sdr (unsigned char *request, unsigned char *response,
   *data++ = next_rec_id & 0xFF;	// next record ID
   *data++ = (next_rec_id >> 8) & 0xFF;
 
-  memcpy (data, &entry.rec[rec_offset], rec_bytes);
   data += rec_bytes;
 
   *res_len = data - &res->data[0];
@@ -650,8 +611,8 @@ storage_get_sdr (unsigned char *request, unsigned char *response,
 }
 
 static void
-storage_get_sel_info (unsigned char *request, unsigned char *response,
-                      unsigned char *res_len)
+storage_get_sel_info (unsigned char *request, unsigned char req_len,
+                      unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -689,8 +650,8 @@ storage_get_sel_info (unsigned char *request, unsigned char *response,
 }
 
 static void
-storage_rsv_sel (unsigned char * request, unsigned char *response,
-                  unsigned char *res_len)
+storage_rsv_sel (unsigned char *request, unsigned char req_len,
+                 unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -715,8 +676,8 @@ storage_rsv_sel (unsigned char * request, unsigned char *response,
 }
 
 static void
-storage_get_sel (unsigned char *request, unsigned char *response,
-		 unsigned char *res_len)
+storage_get_sel (unsigned char *request, unsigned char req_len,
+                 unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -760,8 +721,8 @@ storage_get_sel (unsigned char *request, unsigned char *response,
 }
 
 static void
-storage_add_sel (unsigned char *request, unsigned char *response,
-		 unsigned char *res_len)
+storage_add_sel (unsigned char *request, unsigned char req_len,
+                 unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -793,8 +754,8 @@ storage_add_sel (unsigned char *request, unsigned char *response,
 }
 
 static void
-storage_clr_sel (unsigned char *request, unsigned char *response,
-		 unsigned char *res_len)
+storage_clr_sel (unsigned char *request, unsigned char req_len,
+                 unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -845,7 +806,8 @@ storage_clr_sel (unsigned char *request, unsigned char *response,
 }
 
 static void
-storage_get_sel_time (unsigned char *response, unsigned char *res_len)
+storage_get_sel_time (unsigned char *request, unsigned char req_len,
+                      unsigned char *response, unsigned char *res_len)
 {
   ipmi_res_t *res = (ipmi_res_t *) response;
 
@@ -859,7 +821,8 @@ storage_get_sel_time (unsigned char *response, unsigned char *res_len)
 }
 
 static void
-storage_get_sel_utc (unsigned char *response, unsigned char *res_len)
+storage_get_sel_utc (unsigned char *request, unsigned char req_len,
+                     unsigned char *response, unsigned char *res_len)
 {
   ipmi_res_t *res = (ipmi_res_t *) response;
   unsigned char *data = &res->data[0];
@@ -875,73 +838,14 @@ storage_get_sel_utc (unsigned char *response, unsigned char *res_len)
   *res_len = data - &res->data[0];
 }
 
-static void
-ipmi_handle_storage (unsigned char *request, unsigned char req_len,
-		     unsigned char *response, unsigned char *res_len)
-{
-  ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
-  ipmi_res_t *res = (ipmi_res_t *) response;
-  unsigned char cmd = req->cmd;
-
-  res->cc = CC_SUCCESS;
-  *res_len = 0;
-
-  pthread_mutex_lock(&m_storage);
-  switch (cmd)
-  {
-    case CMD_STORAGE_GET_FRUID_INFO:
-      storage_get_fruid_info (request, response, res_len);
-      break;
-    case CMD_STORAGE_READ_FRUID_DATA:
-      storage_get_fruid_data (request, response, res_len);
-      break;
-    case CMD_STORAGE_GET_SEL_INFO:
-      storage_get_sel_info (request, response, res_len);
-      break;
-    case CMD_STORAGE_RSV_SEL:
-      storage_rsv_sel (request, response, res_len);
-      break;
-    case CMD_STORAGE_ADD_SEL:
-      storage_add_sel (request, response, res_len);
-      break;
-    case CMD_STORAGE_GET_SEL:
-      storage_get_sel (request, response, res_len);
-      break;
-    case CMD_STORAGE_CLR_SEL:
-      storage_clr_sel (request, response, res_len);
-      break;
-    case CMD_STORAGE_GET_SEL_TIME:
-      storage_get_sel_time (response, res_len);
-      break;
-    case CMD_STORAGE_GET_SEL_UTC:
-      storage_get_sel_utc (response, res_len);
-      break;
-    case CMD_STORAGE_GET_SDR_INFO:
-      storage_get_sdr_info (response, res_len);
-      break;
-    case CMD_STORAGE_RSV_SDR:
-      storage_rsv_sdr (request, response, res_len);
-      break;
-    case CMD_STORAGE_GET_SDR:
-      storage_get_sdr (request, response, res_len);
-      break;
-    default:
-      res->cc = CC_INVALID_CMD;
-      break;
-  }
-
-  pthread_mutex_unlock(&m_storage);
-  return;
-}
-
 /*
  * Function(s) to handle IPMI messages with NetFn: Transport
  */
 
 // Set LAN Configuration (IPMI/Section 23.1)
 static void
-transport_set_lan_config (unsigned char *request, unsigned char *response,
-			  unsigned char *res_len)
+transport_set_lan_config (unsigned char *request, unsigned char req_len,
+                          unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -1025,8 +929,8 @@ transport_set_lan_config (unsigned char *request, unsigned char *response,
 
 // Get LAN Configuration (IPMI/Section 23.2)
 static void
-transport_get_lan_config (unsigned char *request, unsigned char *response,
-			  unsigned char *res_len)
+transport_get_lan_config (unsigned char *request, unsigned char req_len,
+                          unsigned char *response, unsigned char *res_len)
 {
 
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
@@ -1130,31 +1034,6 @@ transport_get_lan_config (unsigned char *request, unsigned char *response,
   }
 }
 
-// Handle Transport Commands (IPMI/Section 23)
-static void
-ipmi_handle_transport (unsigned char *request, unsigned char req_len,
-		       unsigned char *response, unsigned char *res_len)
-{
-  ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
-  ipmi_res_t *res = (ipmi_res_t *) response;
-  unsigned char cmd = req->cmd;
-
-  pthread_mutex_lock(&m_transport);
-  switch (cmd)
-  {
-    case CMD_TRANSPORT_SET_LAN_CONFIG:
-      transport_set_lan_config (request, response, res_len);
-      break;
-    case CMD_TRANSPORT_GET_LAN_CONFIG:
-      transport_get_lan_config (request, response, res_len);
-      break;
-    default:
-      res->cc = CC_INVALID_CMD;
-      break;
-  }
-  pthread_mutex_unlock(&m_transport);
-}
-
 /*
  * Function(s) to handle IPMI messages with NetFn: DCMI
  */
@@ -1188,8 +1067,8 @@ ipmi_handle_dcmi(unsigned char *request, unsigned char req_len,
  * Function(s) to handle IPMI messages with NetFn: OEM
  */
 static void
-oem_set_proc_info (unsigned char *request, unsigned char *response,
-		   unsigned char *res_len)
+oem_set_proc_info (unsigned char *request, unsigned char req_len,
+                   unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -1203,8 +1082,8 @@ oem_set_proc_info (unsigned char *request, unsigned char *response,
 }
 
 static void
-oem_set_dimm_info (unsigned char *request, unsigned char *response,
-		   unsigned char *res_len)
+oem_set_dimm_info (unsigned char *request, unsigned char req_len,
+                   unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -1222,8 +1101,8 @@ oem_set_dimm_info (unsigned char *request, unsigned char *response,
 }
 
 static void
-oem_set_post_start (unsigned char *request, unsigned char *response,
-                  unsigned char *res_len)
+oem_set_post_start (unsigned char *request, unsigned char req_len,
+                    unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -1236,8 +1115,8 @@ oem_set_post_start (unsigned char *request, unsigned char *response,
 }
 
 static void
-oem_set_post_end (unsigned char *request, unsigned char *response,
-                unsigned char *res_len)
+oem_set_post_end (unsigned char *request, unsigned char req_len,
+                  unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -1251,8 +1130,8 @@ oem_set_post_end (unsigned char *request, unsigned char *response,
 }
 
 static void
-oem_get_slot_info(unsigned char *request, unsigned char *response,
-                  unsigned char *res_len)
+oem_get_slot_info (unsigned char *request, unsigned char req_len,
+                   unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
@@ -1286,40 +1165,6 @@ oem_get_slot_info(unsigned char *request, unsigned char *response,
   *res_len = 0x01;
 }
 
-static void
-ipmi_handle_oem (unsigned char *request, unsigned char req_len,
-		 unsigned char *response, unsigned char *res_len)
-{
-  ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
-  ipmi_res_t *res = (ipmi_res_t *) response;
-
-  unsigned char cmd = req->cmd;
-
-  pthread_mutex_lock(&m_oem);
-  switch (cmd)
-  {
-    case CMD_OEM_SET_PROC_INFO:
-      oem_set_proc_info (request, response, res_len);
-      break;
-    case CMD_OEM_SET_DIMM_INFO:
-      oem_set_dimm_info (request, response, res_len);
-      break;
-    case CMD_OEM_SET_POST_START:
-      oem_set_post_start (request, response, res_len);
-      break;
-    case CMD_OEM_SET_POST_END:
-      oem_set_post_end (request, response, res_len);
-      break;
-    case CMD_OEM_GET_SLOT_INFO:
-      oem_get_slot_info (request, response, res_len);
-      break;
-    default:
-      res->cc = CC_INVALID_CMD;
-      break;
-  }
-  pthread_mutex_unlock(&m_oem);
-}
-
 static void
 oem_1s_handle_ipmb_kcs(unsigned char *request, unsigned char req_len,
        unsigned char *response, unsigned char *res_len)
@@ -1395,92 +1240,253 @@ oem_1s_handle_ipmb_req(unsigned char *request, unsigned char req_len,
 }
 
 static void
-ipmi_handle_oem_1s(unsigned char *request, unsigned char req_len,
-		 unsigned char *response, unsigned char *res_len)
+oem_1s_intr(unsigned char *request, unsigned char req_len,
+            unsigned char *response, unsigned char *res_len)
+{
+  ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
+  ipmi_res_t *res = (ipmi_res_t *) response;
+
+  syslog(LOG_INFO, "oem_1s_intr: 1S server interrupt#%d received "
+            "for payload#%d\n", req->data[3], req->payload_id);
+
+  res->cc = CC_SUCCESS;
+  memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
+  *res_len = 3;
+}
+
+static void
+oem_1s_post_buf(unsigned char *request, unsigned char req_len,
+                unsigned char *response, unsigned char *res_len)
 {
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
   int i;
 
-  unsigned char cmd = req->cmd;
+  // Skip the first 3 bytes of IANA ID and one byte of length field
+  for (i = SIZE_IANA_ID+1; i <= req->data[3]; i++) {
+    pal_post_handle(req->payload_id, req->data[i]);
+  }
 
-  pthread_mutex_lock(&m_oem_1s);
-  switch (cmd)
-  {
-    case CMD_OEM_1S_MSG_IN:
-      oem_1s_handle_ipmb_req(request, req_len, response, res_len);
-      break;
-    case CMD_OEM_1S_INTR:
-      syslog(LOG_INFO, "ipmi_handle_oem_1s: 1S server interrupt#%d received "
-                "for payload#%d\n", req->data[3], req->payload_id);
+  res->cc = CC_SUCCESS;
+  memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
+  *res_len = 3;
+}
 
-      res->cc = CC_SUCCESS;
-      memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
-      *res_len = 3;
-      break;
-    case CMD_OEM_1S_POST_BUF:
-      // Skip the first 3 bytes of IANA ID and one byte of length field
-      for (i = SIZE_IANA_ID+1; i <= req->data[3]; i++) {
-        pal_post_handle(req->payload_id, req->data[i]);
-      }
+static void
+oem_1s_plat_disc(unsigned char *request, unsigned char req_len,
+                 unsigned char *response, unsigned char *res_len)
+{
+  ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
+  ipmi_res_t *res = (ipmi_res_t *) response;
 
-      res->cc = CC_SUCCESS;
-      memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
-      *res_len = 3;
-      break;
-    case CMD_OEM_1S_PLAT_DISC:
-      syslog(LOG_INFO, "ipmi_handle_oem_1s: Platform Discovery received for "
-                "payload#%d\n", req->payload_id);
-      res->cc = CC_SUCCESS;
-      memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
-      *res_len = 3;
-      break;
-    case CMD_OEM_1S_BIC_RESET:
-      syslog(LOG_INFO, "ipmi_handle_oem_1s: BIC Reset received "
-                "for payload#%d\n", req->payload_id);
-
-      if (req->data[3] == 0x0) {
-         syslog(LOG_WARNING, "Cold Reset by Firmware Update\n");
-         res->cc = CC_SUCCESS;
-      } else if (req->data[3] == 0x01) {
-         syslog(LOG_WARNING, "WDT Reset\n");
-         res->cc = CC_SUCCESS;
-      } else {
-         syslog(LOG_WARNING, "Error\n");
-         res->cc = CC_INVALID_PARAM;
-      }
+  syslog(LOG_INFO, "oem_1s_plat_disc: Platform Discovery received for "
+            "payload#%d\n", req->payload_id);
+  res->cc = CC_SUCCESS;
+  memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
+  *res_len = 3;
+}
+
+static void
+oem_1s_bic_reset(unsigned char *request, unsigned char req_len,
+                 unsigned char *response, unsigned char *res_len)
+{
+  ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
+  ipmi_res_t *res = (ipmi_res_t *) response;
+
+  syslog(LOG_INFO, "oem_1s_bic_reset: BIC Reset received "
+            "for payload#%d\n", req->payload_id);
+
+  if (req->data[3] == 0x0) {
+     syslog(LOG_WARNING, "Cold Reset by Firmware Update\n");
+     res->cc = CC_SUCCESS;
+  } else if (req->data[3] == 0x01) {
+     syslog(LOG_WARNING, "WDT Reset\n");
+     res->cc = CC_SUCCESS;
+  } else {
+     syslog(LOG_WARNING, "Error\n");
+     res->cc = CC_INVALID_PARAM;
+  }
+
+  memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
+  *res_len = 3;
+}
+
+static void
+oem_1s_bic_update_mode(unsigned char *request, unsigned char req_len,
+                       unsigned char *response, unsigned char *res_len)
+{
+  ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
+  ipmi_res_t *res = (ipmi_res_t *) response;
 
-      memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
-      *res_len = 3;
-      break;
-    case CMD_OEM_1S_BIC_UPDATE_MODE:
 #ifdef DEBUG
-      syslog(LOG_INFO, "ipmi_handle_oem_1s: BIC Update Mode received "
-                "for payload#%d\n", req->payload_id);
+  syslog(LOG_INFO, "oem_1s_bic_update_mode: BIC Update Mode received "
+            "for payload#%d\n", req->payload_id);
 #endif
-      if (req->data[3] == 0x1) {
-         syslog(LOG_INFO, "BIC Mode: Normal\n");
-         res->cc = CC_SUCCESS;
-      } else if (req->data[3] == 0x0F) {
-         syslog(LOG_INFO, "BIC Mode: Update\n");
-         res->cc = CC_SUCCESS;
-      } else {
-         syslog(LOG_WARNING, "Error\n");
-         res->cc = CC_INVALID_PARAM;
-      }
+  if (req->data[3] == 0x1) {
+     syslog(LOG_INFO, "BIC Mode: Normal\n");
+     res->cc = CC_SUCCESS;
+  } else if (req->data[3] == 0x0F) {
+     syslog(LOG_INFO, "BIC Mode: Update\n");
+     res->cc = CC_SUCCESS;
+  } else {
+     syslog(LOG_WARNING, "Error\n");
+     res->cc = CC_INVALID_PARAM;
+  }
 
-      pal_inform_bic_mode(req->payload_id, req->data[3]);
+  pal_inform_bic_mode(req->payload_id, req->data[3]);
 
-      memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
-      *res_len = 3;
-      break;
-    default:
-      res->cc = CC_INVALID_CMD;
-      memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
-      *res_len = 3;
-      break;
+  memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
+  *res_len = 3;
+}
+
+// Unknown 1S commands still echo the IANA ID
+static void
+oem_1s_invalid_cmd(unsigned char *request, unsigned char req_len,
+                   unsigned char *response, unsigned char *res_len)
+{
+  ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
+  ipmi_res_t *res = (ipmi_res_t *) response;
+
+  res->cc = CC_INVALID_CMD;
+  memcpy(res->data, req->data, SIZE_IANA_ID); //IANA ID
+  *res_len = 3;
+}
+
+static void
+ipmi_invalid_cmd(unsigned char *request, unsigned char req_len,
+                 unsigned char *response, unsigned char *res_len)
+{
+  ipmi_res_t *res = (ipmi_res_t *) response;
+
+  res->cc = CC_INVALID_CMD;
+}
+
+/*
+ * Command dispatch table
+ *
+ * Each (netfn, cmd) names its handler and the lock guarding the ipmid
+ * state the handler touches: commands without a lock run fully in
+ * parallel, the others take their lock shared (read) or exclusive
+ * (write). An IPMI_CMD_ANY entry handles the commands of its netfn
+ * not listed otherwise; netfns without any entry are not supported.
+ */
+static ipmi_cmd_t g_cmds[] = {
+  // Chassis (IPMI/Section 28)
+  { NETFN_CHASSIS_REQ, CMD_CHASSIS_GET_STATUS, chassis_get_status, NULL, false },
+  { NETFN_CHASSIS_REQ, CMD_CHASSIS_GET_BOOT_OPTIONS, chassis_get_boot_options, NULL, false },
+  { NETFN_CHASSIS_REQ, IPMI_CMD_ANY, ipmi_invalid_cmd, NULL, false },
+
+  // Sensor/Event (IPMI/Section 29)
+  { NETFN_SENSOR_REQ, CMD_SENSOR_PLAT_EVENT_MSG, sensor_plat_event_msg, &m_sel, true },
+  { NETFN_SENSOR_REQ, IPMI_CMD_ANY, ipmi_invalid_cmd, NULL, false },
+
+  // Application (IPMI/Section 20)
+  { NETFN_APP_REQ, CMD_APP_GET_DEVICE_ID, app_get_device_id, NULL, false },
+  { NETFN_APP_REQ, CMD_APP_COLD_RESET, app_cold_reset, NULL, false },
+  { NETFN_APP_REQ, CMD_APP_GET_SELFTEST_RESULTS, app_get_selftest_results, NULL, false },
+  { NETFN_APP_REQ, CMD_APP_GET_DEVICE_GUID, app_get_device_guid, NULL, false },
+  { NETFN_APP_REQ, CMD_APP_GET_SYSTEM_GUID, app_get_device_sys_guid, NULL, false },
+  { NETFN_APP_REQ, CMD_APP_GET_GLOBAL_ENABLES, app_get_global_enables, NULL, false },
+  { NETFN_APP_REQ, CMD_APP_SET_SYS_INFO_PARAMS, app_set_sys_info_params, &m_sys_info, true },
+  // Refreshes the cached system firmware version
+  { NETFN_APP_REQ, CMD_APP_GET_SYS_INFO_PARAMS, app_get_sys_info_params, &m_sys_info, true },
+  { NETFN_APP_REQ, IPMI_CMD_ANY, ipmi_invalid_cmd, NULL, false },
+
+  // Storage (IPMI/Section 31, 33)
+  { NETFN_STORAGE_REQ, CMD_STORAGE_GET_FRUID_INFO, storage_get_fruid_info, NULL, false },
+  { NETFN_STORAGE_REQ, CMD_STORAGE_READ_FRUID_DATA, storage_get_fruid_data, NULL, false },
+  { NETFN_STORAGE_REQ, CMD_STORAGE_GET_SEL_INFO, storage_get_sel_info, &m_sel, false },
+  { NETFN_STORAGE_REQ, CMD_STORAGE_RSV_SEL, storage_rsv_sel, &m_sel, true },
+  { NETFN_STORAGE_REQ, CMD_STORAGE_ADD_SEL, storage_add_sel, &m_sel, true },
+  { NETFN_STORAGE_REQ, CMD_STORAGE_GET_SEL, storage_get_sel, &m_sel, false },
+  { NETFN_STORAGE_REQ, CMD_STORAGE_CLR_SEL, storage_clr_sel, &m_sel, true },
+  { NETFN_STORAGE_REQ, CMD_STORAGE_GET_SEL_TIME, storage_get_sel_time, NULL, false },
+  { NETFN_STORAGE_REQ, CMD_STORAGE_GET_SEL_UTC, storage_get_sel_utc, NULL, false },
+  { NETFN_STORAGE_REQ, CMD_STORAGE_GET_SDR_INFO, storage_get_sdr_info, &m_sdr, false },
+  { NETFN_STORAGE_REQ, CMD_STORAGE_RSV_SDR, storage_rsv_sdr, &m_sdr, true },
+  { NETFN_STORAGE_REQ, CMD_STORAGE_GET_SDR, storage_get_sdr, &m_sdr, false },
+  { NETFN_STORAGE_REQ, IPMI_CMD_ANY, ipmi_invalid_cmd, NULL, false },
+
+  // Transport (IPMI/Section 23)
+  { NETFN_TRANSPORT_REQ, CMD_TRANSPORT_SET_LAN_CONFIG, transport_set_lan_config, &m_lan, true },
+  { NETFN_TRANSPORT_REQ, CMD_TRANSPORT_GET_LAN_CONFIG, transport_get_lan_config, &m_lan, false },
+  { NETFN_TRANSPORT_REQ, IPMI_CMD_ANY, ipmi_invalid_cmd, NULL, false },
+
+  // DCMI, handled by the platform
+  { NETFN_DCMI_REQ, IPMI_CMD_ANY, ipmi_handle_dcmi, NULL, false },
+
+  // OEM
+  { NETFN_OEM_REQ, CMD_OEM_SET_PROC_INFO, oem_set_proc_info, &m_oem_info, true },
+  { NETFN_OEM_REQ, CMD_OEM_SET_DIMM_INFO, oem_set_dimm_info, &m_oem_info, true },
+  { NETFN_OEM_REQ, CMD_OEM_SET_POST_START, oem_set_post_start, NULL, false },
+  { NETFN_OEM_REQ, CMD_OEM_SET_POST_END, oem_set_post_end, NULL, false },
+  { NETFN_OEM_REQ, CMD_OEM_GET_SLOT_INFO, oem_get_slot_info, NULL, false },
+  { NETFN_OEM_REQ, IPMI_CMD_ANY, ipmi_invalid_cmd, NULL, false },
+
+  // OEM 1S, bridged messages dispatch again through ipmi_handle()
+  { NETFN_OEM_1S_REQ, CMD_OEM_1S_MSG_IN, oem_1s_handle_ipmb_req, NULL, false },
+  { NETFN_OEM_1S_REQ, CMD_OEM_1S_INTR, oem_1s_intr, NULL, false },
+  { NETFN_OEM_1S_REQ, CMD_OEM_1S_POST_BUF, oem_1s_post_buf, &m_post, true },
+  { NETFN_OEM_1S_REQ, CMD_OEM_1S_PLAT_DISC, oem_1s_plat_disc, NULL, false },
+  { NETFN_OEM_1S_REQ, CMD_OEM_1S_BIC_RESET, oem_1s_bic_reset, NULL, false },
+  { NETFN_OEM_1S_REQ, CMD_OEM_1S_BIC_UPDATE_MODE, oem_1s_bic_update_mode, &m_post, true },
+  { NETFN_OEM_1S_REQ, IPMI_CMD_ANY, oem_1s_invalid_cmd, NULL, false },
+};
+
+#define NUM_IPMI_CMDS (sizeof(g_cmds) / sizeof(g_cmds[0]))
+
+// Entry# + 1 of the handler of each (netfn, cmd), 0 if none
+static unsigned char g_cmd_idx[MAX_NETFN][MAX_CMD];
+
+static void
+ipmi_cmd_init(void)
+{
+  int i, cmd;
+
+  // Catch-all entries first, so specific ones take precedence
+  for (i = 0; i < NUM_IPMI_CMDS; i++) {
+    if (g_cmds[i].cmd != IPMI_CMD_ANY)
+      continue;
+    for (cmd = 0; cmd < MAX_CMD; cmd++) {
+      g_cmd_idx[g_cmds[i].netfn][cmd] = i + 1;
+    }
+  }
+
+  for (i = 0; i < NUM_IPMI_CMDS; i++) {
+    if (g_cmds[i].cmd != IPMI_CMD_ANY)
+      g_cmd_idx[g_cmds[i].netfn][g_cmds[i].cmd] = i + 1;
+  }
+}
+
+static uint64_t
+get_mono_us(void)
+{
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// Log the per command counters, on SIGUSR1
+static void
+ipmi_cmd_dump_stats(void)
+{
+  ipmi_cmd_t *p_cmd;
+  int i;
+
+  pthread_mutex_lock(&m_cmd_stats);
+  for (i = 0; i < NUM_IPMI_CMDS; i++) {
+    p_cmd = &g_cmds[i];
+    if (!p_cmd->calls)
+      continue;
+    syslog(LOG_INFO, "netfn: 0x%X, cmd: %s0x%X, calls: %u, "
+           "latency avg: %llu us, max: %u us", p_cmd->netfn,
+           (p_cmd->cmd == IPMI_CMD_ANY) ? "other than listed, " : "",
+           (p_cmd->cmd == IPMI_CMD_ANY) ? 0 : p_cmd->cmd, p_cmd->calls,
+           (unsigned long long) (p_cmd->lat_total_us / p_cmd->calls),
+           p_cmd->lat_max_us);
   }
-  pthread_mutex_unlock(&m_oem_1s);
+  pthread_mutex_unlock(&m_cmd_stats);
 }
 
 /*
@@ -1494,51 +1500,42 @@ ipmi_handle (unsigned char *request, unsigned char req_len,
   ipmi_mn_req_t *req = (ipmi_mn_req_t *) request;
   ipmi_res_t *res = (ipmi_res_t *) response;
   unsigned char netfn;
+  unsigned char idx;
+  ipmi_cmd_t *p_cmd;
+  uint64_t start;
+  uint32_t lat;
 
   netfn = req->netfn_lun >> 2;
 
   // Provide default values in the response message
+  res->netfn_lun = (netfn + 1) << 2;
   res->cmd = req->cmd;
   res->cc = 0xFF;		// Unspecified completion code
   *res_len = 0;
 
-  switch (netfn)
-  {
-    case NETFN_CHASSIS_REQ:
-      res->netfn_lun = NETFN_CHASSIS_RES << 2;
-      ipmi_handle_chassis (request, req_len, response, res_len);
-      break;
-    case NETFN_SENSOR_REQ:
-      res->netfn_lun = NETFN_SENSOR_RES << 2;
-      ipmi_handle_sensor (request, req_len, response, res_len);
-      break;
-    case NETFN_APP_REQ:
-      res->netfn_lun = NETFN_APP_RES << 2;
-      ipmi_handle_app (request, req_len, response, res_len);
-      break;
-    case NETFN_STORAGE_REQ:
-      res->netfn_lun = NETFN_STORAGE_RES << 2;
-      ipmi_handle_storage (request, req_len, response, res_len);
-      break;
-    case NETFN_TRANSPORT_REQ:
-      res->netfn_lun = NETFN_TRANSPORT_RES << 2;
-      ipmi_handle_transport (request, req_len, response, res_len);
-      break;
-    case NETFN_DCMI_REQ:
-      res->netfn_lun = NETFN_DCMI_RES << 2;
-      ipmi_handle_dcmi(request, req_len, response, res_len);
-      break;
-    case NETFN_OEM_REQ:
-      res->netfn_lun = NETFN_OEM_RES << 2;
-      ipmi_handle_oem (request, req_len, response, res_len);
-      break;
-    case NETFN_OEM_1S_REQ:
-      res->netfn_lun = NETFN_OEM_1S_RES << 2;
-      ipmi_handle_oem_1s(request, req_len, response, res_len);
-      break;
-    default:
-      res->netfn_lun = (netfn + 1) << 2;
-      break;
+  idx = g_cmd_idx[netfn][req->cmd];
+  if (idx) {
+    p_cmd = &g_cmds[idx - 1];
+    start = get_mono_us();
+
+    if (p_cmd->lock == NULL) {
+      p_cmd->handler(request, req_len, response, res_len);
+    } else {
+      if (p_cmd->excl)
+        pthread_rwlock_wrlock(p_cmd->lock);
+      else
+        pthread_rwlock_rdlock(p_cmd->lock);
+      p_cmd->handler(request, req_len, response, res_len);
+      pthread_rwlock_unlock(p_cmd->lock);
+    }
+
+    lat = get_mono_us() - start;
+    pthread_mutex_lock(&m_cmd_stats);
+    p_cmd->calls++;
+    p_cmd->lat_total_us += lat;
+    if (lat > p_cmd->lat_max_us)
+      p_cmd->lat_max_us = lat;
+    pthread_mutex_unlock(&m_cmd_stats);
   }
 
   // This header includes NetFunction, Command, and Completion Code
@@ -1547,52 +1544,81 @@ ipmi_handle (unsigned char *request, unsigned char req_len,
   return;
 }
 
-void
-*conn_handler(void *socket_desc) {
-  int *p_sock = (int*)socket_desc;
-  int sock = *p_sock;
+// Serve the one request of a client connection, then close it
+static void
+conn_handle(int sock)
+{
   int n;
   unsigned char req_buf[MAX_IPMI_MSG_SIZE];
   unsigned char res_buf[MAX_IPMI_MSG_SIZE];
   unsigned char res_len = 0;
-  struct timeval tv;
   int rc = 0;
 
-  // setup timeout for receving on socket
-  tv.tv_sec = TIMEOUT_IPMI;
-  tv.tv_usec = 0;
-
-  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv,sizeof(struct timeval));
-
   n = recv (sock, req_buf, sizeof(req_buf), 0);
   rc = errno;
   if (n <= 0) {
       syslog(LOG_WARNING, "ipmid: recv() failed with %d, errno: %d\n", n, rc);
-      goto conn_cleanup;
+      return;
   }
 
   ipmi_handle(req_buf, n, res_buf, &res_len);
 
-  if (send (sock, res_buf, res_len, 0) < 0) {
+  if (send (sock, res_buf, res_len, MSG_NOSIGNAL) < 0) {
     syslog(LOG_WARNING, "ipmid: send() failed\n");
   }
+}
+
+static void
+conn_free(int idx)
+{
+  close(g_conn[idx].sock);
+  g_conn[idx].sock = -1;
+}
 
-conn_cleanup:
-  close(sock);
-  free(p_sock);
+// Worker thread: serves the connections the main loop found readable
+static void *
+worker_handler(void *arg)
+{
+  int idx;
 
-  pthread_exit(NULL);
-  return 0;
+  while (1) {
+    pthread_mutex_lock(&m_work);
+    while (g_work_cnt == 0) {
+      pthread_cond_wait(&c_work, &m_work);
+    }
+    idx = g_work_q[g_work_head];
+    g_work_head = (g_work_head + 1) % MAX_IPMI_CONN;
+    g_work_cnt--;
+    pthread_mutex_unlock(&m_work);
+
+    conn_handle(g_conn[idx].sock);
+
+    pthread_mutex_lock(&m_work);
+    conn_free(idx);
+    pthread_mutex_unlock(&m_work);
+  }
+
+  return NULL;
 }
 
+static void
+sig_handler_stats(int sig)
+{
+  g_stats_req++;
+}
 
 int
 main (void)
 {
   int s, s2, t, len;
   struct sockaddr_un local, remote;
+  struct epoll_event ev, events[MAX_IPMI_CONN + 1];
+  struct sigaction sa;
   pthread_t tid;
-  int *p_s2;
+  int efd;
+  int i, n, idx;
+  uint64_t now;
+  sig_atomic_t stats_seen = 0;
   int rc = 0;
 
   daemon(1, 1);
@@ -1606,13 +1632,24 @@ main (void)
   sdr_init();
   sel_init();
 
-  pthread_mutex_init(&m_chassis, NULL);
-  pthread_mutex_init(&m_sensor, NULL);
-  pthread_mutex_init(&m_app, NULL);
-  pthread_mutex_init(&m_storage, NULL);
-  pthread_mutex_init(&m_transport, NULL);
-  pthread_mutex_init(&m_oem, NULL);
-  pthread_mutex_init(&m_oem_1s, NULL);
+  ipmi_cmd_init();
+
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = sig_handler_stats;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGUSR1, &sa, NULL);
+
+  for (i = 0; i < MAX_IPMI_CONN; i++) {
+    g_conn[i].sock = -1;
+  }
+
+  for (i = 0; i < IPMI_WORKERS; i++) {
+    if (pthread_create(&tid, NULL, worker_handler, NULL) < 0) {
+      syslog(LOG_WARNING, "ipmid: pthread_create failed\n");
+      exit (1);
+    }
+    pthread_detach(tid);
+  }
 
   if ((s = socket (AF_UNIX, SOCK_STREAM, 0)) == -1)
   {
@@ -1636,41 +1673,94 @@ main (void)
     exit (1);
   }
 
+  efd = epoll_create(MAX_IPMI_CONN + 1);
+  if (efd < 0) {
+    syslog(LOG_WARNING, "ipmid: epoll_create() failed\n");
+    exit (1);
+  }
+
+  ev.events = EPOLLIN;
+  ev.data.u32 = MAX_IPMI_CONN;
+  epoll_ctl(efd, EPOLL_CTL_ADD, s, &ev);
+
+  /*
+   * The main thread only waits for events: new connections are accepted
+   * and watched for their request, which a worker then reads, handles and
+   * answers. Clients that connect but send nothing are dropped after
+   * TIMEOUT_IPMI seconds.
+   */
   while(1) {
-    int n;
-    t = sizeof (remote);
-    // TODO: seen accept() call fails and need further debug
-    if ((s2 = accept (s, (struct sockaddr *) &remote, &t)) < 0) {
-      rc = errno;
-      syslog(LOG_WARNING, "ipmid: accept() failed with ret: %x, errno: %x\n", s2, rc);
-      sleep(5);
-      continue;
+    n = epoll_wait(efd, events, MAX_IPMI_CONN + 1, 1000);
+
+    if (stats_seen != g_stats_req) {
+      stats_seen = g_stats_req;
+      ipmi_cmd_dump_stats();
     }
 
-    // Creating a worker thread to handle the request
-    // TODO: Need to monitor the server performance with higher load and
-    // see if we need to create pre-defined number of workers and schedule
-    // the requests among them.
-    p_s2 = malloc(sizeof(int));
-    *p_s2 = s2;
-    if (pthread_create(&tid, NULL, conn_handler, (void*) p_s2) < 0) {
-        syslog(LOG_WARNING, "ipmid: pthread_create failed\n");
+    now = get_mono_us() / 1000;
+
+    for (i = 0; i < n; i++) {
+      idx = events[i].data.u32;
+      if (idx < MAX_IPMI_CONN) {
+        // Readable or hung up: either way a worker finishes it
+        pthread_mutex_lock(&m_work);
+        epoll_ctl(efd, EPOLL_CTL_DEL, g_conn[idx].sock, NULL);
+        g_conn[idx].accepted = 0;
+        g_work_q[(g_work_head + g_work_cnt) % MAX_IPMI_CONN] = idx;
+        g_work_cnt++;
+        pthread_cond_signal(&c_work);
+        pthread_mutex_unlock(&m_work);
+        continue;
+      }
+
+      t = sizeof (remote);
+      // TODO: seen accept() call fails and need further debug
+      if ((s2 = accept (s, (struct sockaddr *) &remote, &t)) < 0) {
+        rc = errno;
+        syslog(LOG_WARNING, "ipmid: accept() failed with ret: %x, errno: %x\n", s2, rc);
+        continue;
+      }
+
+      pthread_mutex_lock(&m_work);
+      for (idx = 0; idx < MAX_IPMI_CONN; idx++) {
+        if (g_conn[idx].sock < 0)
+          break;
+      }
+      if (idx == MAX_IPMI_CONN) {
+        pthread_mutex_unlock(&m_work);
+        syslog(LOG_WARNING, "ipmid: too many connections, dropping one\n");
         close(s2);
         continue;
+      }
+      g_conn[idx].sock = s2;
+      g_conn[idx].accepted = now;
+      pthread_mutex_unlock(&m_work);
+
+      ev.events = EPOLLIN;
+      ev.data.u32 = idx;
+      if (epoll_ctl(efd, EPOLL_CTL_ADD, s2, &ev) < 0) {
+        syslog(LOG_WARNING, "ipmid: epoll_ctl() failed\n");
+        pthread_mutex_lock(&m_work);
+        conn_free(idx);
+        pthread_mutex_unlock(&m_work);
+      }
     }
 
-    pthread_detach(tid);
+    // Drop the clients that did not send their request in time
+    pthread_mutex_lock(&m_work);
+    for (idx = 0; idx < MAX_IPMI_CONN; idx++) {
+      if (g_conn[idx].sock >= 0 && g_conn[idx].accepted &&
+          now - g_conn[idx].accepted > TIMEOUT_IPMI * 1000) {
+        syslog(LOG_WARNING, "ipmid: no request received, closing connection\n");
+        epoll_ctl(efd, EPOLL_CTL_DEL, g_conn[idx].sock, NULL);
+        conn_free(idx);
+      }
+    }
+    pthread_mutex_unlock(&m_work);
   }
 
+  close(efd);
   close(s);
 
-  pthread_mutex_destroy(&m_chassis);
-  pthread_mutex_destroy(&m_sensor);
-  pthread_mutex_destroy(&m_app);
-  pthread_mutex_destroy(&m_storage);
-  pthread_mutex_destroy(&m_transport);
-  pthread_mutex_destroy(&m_oem);
-  pthread_mutex_destroy(&m_oem_1s);
-
   return 0;
 }
@@ -42,7 +42,7 @@
 #define SDR_RSVID_MIN  0x01
 #define SDR_RSVID_MAX  0xFFFE
 
-#define SDR_RECORDS_MAX 64 // to support around 64 sensors
+#define SDR_RECORDS_MAX 256 // one per sensor number
 
 // SDR index to keep track
 #define SDR_INDEX_MIN 0
@@ -59,6 +59,10 @@
 #define SDR_VERSION 0x51
 #define SDR_LEN_MAX 64
 
+// Record Header: Record ID, SDR Version, Record Type, Record Length
+#define SDR_HDR_SIZE 5
+#define SDR_ENC_MAX (SDR_HDR_SIZE + SDR_LEN_MAX)
+
 #define SDR_FULL_TYPE 0x01
 #define SDR_MGMT_TYPE 0x12
 #define SDR_OEM_TYPE 0xC0
@@ -80,13 +84,29 @@ typedef struct {
 // Keep track of last Reservation ID
 static int g_rsv_id[MAX_NODES+1];
 
+// Where a record lives in the SDR image
+typedef struct {
+  unsigned short offset;
+  unsigned char len; // Record Header plus Record Length bytes
+} sdr_idx_t;
+
 // SDR Header and data global structures
 static sdr_hdr_t g_sdr_hdr;
-static sdr_rec_t g_sdr_data[SDR_RECORDS_MAX];
+
+/*
+ * The repository is encoded once into g_sdr_image, the records back to
+ * back exactly as Get SDR returns them, so a (partial) read is a single
+ * copy out of the image at the offset the index gives.
+ */
+static unsigned char g_sdr_image[SDR_RECORDS_MAX * SDR_ENC_MAX];
+static int g_sdr_image_size;
+static sdr_idx_t g_sdr_idx[SDR_RECORDS_MAX];
 
 // Add a new SDR entry
 static int
 sdr_add_entry(sdr_rec_t *rec, int *rec_id) {
+  sdr_idx_t *idx = &g_sdr_idx[g_sdr_hdr.end];
+
   // If SDR is full, return error
   if (sdr_num_entries() == SDR_RECORDS_MAX) {
       syslog(LOG_WARNING, "sdr_add_entry: SDR full\n");
@@ -94,10 +114,18 @@ sdr_add_entry(sdr_rec_t *rec, int *rec_id) {
   }
 
   // Add Record ID which is array index + 1
-  rec->rec[0] = g_sdr_hdr.end+1;
-
-  // Add the enry at end
-  memcpy(g_sdr_data[g_sdr_hdr.end].rec, rec->rec, sizeof(sdr_rec_t));
+  rec->rec[0] = (g_sdr_hdr.end+1) & 0xFF;
+  rec->rec[1] = ((g_sdr_hdr.end+1) >> 8) & 0xFF;
+
+  // Add the enry at end of the image, bytes past sdr_rec_t read as 0
+  idx->offset = g_sdr_image_size;
+  idx->len = SDR_HDR_SIZE + rec->rec[4];
+  if (idx->len > SDR_ENC_MAX) {
+    idx->len = SDR_ENC_MAX;
+  }
+  memcpy(&g_sdr_image[idx->offset], rec->rec,
+         (idx->len < sizeof(sdr_rec_t)) ? idx->len : sizeof(sdr_rec_t));
+  g_sdr_image_size += idx->len;
 
   // Return the newly added record ID
   *rec_id = g_sdr_hdr.end+1;
@@ -314,13 +342,15 @@ sdr_rsv_id(int node) {
   return g_rsv_id[node];
 }
 
-// Get the SDR entry for a given record ID
+// Read (part of) the SDR entry for a given record ID, returns the number
+// of bytes copied; reads past the end of the record are cut short
 // IPMI/Section 33.12
 int
-sdr_get_entry(int node, int rsv_id, int read_rec_id, sdr_rec_t *rec,
-                   int *next_rec_id) {
+sdr_get_entry(int node, int rsv_id, int read_rec_id, int offset, int len,
+              unsigned char *buf, int *next_rec_id) {
 
   int index;
+  sdr_idx_t *idx;
 
   // Make sure the rsv_id matches
   if (rsv_id != g_rsv_id[node]) {
@@ -355,17 +385,26 @@ sdr_get_entry(int node, int rsv_id, int read_rec_id, sdr_rec_t *rec,
     return -1;
   }
 
-  memcpy(rec->rec, g_sdr_data[index].rec, sizeof(sdr_rec_t));
+  idx = &g_sdr_idx[index];
+  if (offset > idx->len) {
+    syslog(LOG_WARNING, "sdr_get_entry: Offset %d beyond Record ID %d\n",
+           offset, read_rec_id);
+    return -1;
+  }
+  if (len > idx->len - offset) {
+    len = idx->len - offset;
+  }
 
-  // Return the next record ID in the log
-  *next_rec_id = ++read_rec_id;
+  memcpy(buf, &g_sdr_image[idx->offset + offset], len);
 
-  // If this is the last entry in the log, return 0xFFFF
-  if (*next_rec_id == g_sdr_hdr.end) {
+  // Return the next record ID in the log, 0xFFFF after the last entry
+  if (index + 1 < g_sdr_hdr.end) {
+    *next_rec_id = index + 2;
+  } else {
     *next_rec_id = SDR_RECID_LAST;
   }
 
-  return 0;
+  return len;
 }
 
 
@@ -384,6 +423,7 @@ sdr_init(void) {
   g_sdr_hdr.version = SDR_HDR_VERSION;
   g_sdr_hdr.begin = SDR_INDEX_MIN;
   g_sdr_hdr.end = SDR_INDEX_MIN;
+  g_sdr_image_size = 0;
   memset(g_sdr_hdr.ts_add.ts, 0x0, 4);
   memset(g_sdr_hdr.ts_erase.ts, 0x0, 4);
 
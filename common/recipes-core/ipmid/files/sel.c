@@ -5,10 +5,6 @@
  * This file represents platform specific implementation for storing
  * SEL logs and acts as back-end for IPMI stack
  *
- * TODO: Optimize the file handling to keep file open always instead of
- * current open/seek/close
- *
- *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
  * the Free Software Foundation; either version 2 of the License, or
@@ -32,44 +28,74 @@
 #include <syslog.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <fcntl.h>
 #include <sys/types.h>
 #include <time.h>
 #include <openbmc/pal.h>
 
-// SEL File.
-#define SEL_LOG_FILE  "/mnt/data/sel%d.bin"
+// SEL log segments, and the SEL file of older releases
+#define SEL_SEG_FILE  "/mnt/data/sel%d_%d.log"
+#define SEL_OLD_FILE  "/mnt/data/sel%d.bin"
 #define SIZE_PATH_MAX 32
 
-// SEL Header magic number
-#define SEL_HDR_MAGIC 0xFBFBFBFB
+// SEL segment magic and version number
+#define SEL_LOG_MAGIC 0xFBFB5E15
+#define SEL_LOG_VERSION 0x01
 
-// SEL Header version number
-#define SEL_HDR_VERSION 0x01
-
-// SEL Data offset from file beginning
+// SEL Header magic number and data offset of the old SEL file
+#define SEL_HDR_MAGIC 0xFBFBFBFB
 #define SEL_DATA_OFFSET 0x100
+#define SEL_OLD_ELEMS 129
 
 // SEL reservation IDs can not be 0x00 or 0xFFFF
 #define SEL_RSVID_MIN  0x01
 #define SEL_RSVID_MAX  0xFFFE
 
-// Number of SEL records before wrap
-#define SEL_RECORDS_MAX 128 // TODO: Based on need we can make it bigger
-#define SEL_ELEMS_MAX (SEL_RECORDS_MAX+1)
-
-// Index for circular array
-#define SEL_INDEX_MIN 0x00
-#define SEL_INDEX_MAX SEL_RECORDS_MAX
+/*
+ * The SEL is an append-only log spread over SEL_SEG_CNT segment files of
+ * SEL_SEG_RECORDS records each. Adding an entry appends one record to the
+ * active segment; once it is full, the oldest segment is truncated and
+ * reused, dropping its entries. So the log keeps between
+ * (SEL_SEG_CNT - 1) * SEL_SEG_RECORDS and SEL_RECORDS_MAX entries.
+ */
+#define SEL_SEG_CNT 8
+#define SEL_SEG_RECORDS 256
+#define SEL_RECORDS_MAX (SEL_SEG_CNT * SEL_SEG_RECORDS)
 
-// Record ID can not be 0x0 (IPMI/Section 31)
-#define SEL_RECID_MIN (SEL_INDEX_MIN+1)
-#define SEL_RECID_MAX (SEL_INDEX_MAX+1)
+// Record ID can not be 0x0, 0xFFFF is the last one (IPMI/Section 31)
+#define SEL_RECID_RANGE 0xFFFE
 
 // Special RecID value for first and last (IPMI/Section 31)
 #define SEL_RECID_FIRST 0x0000
 #define SEL_RECID_LAST 0xFFFF
 
-// SEL header struct to keep track of SEL Log entries
+// Types of log records
+enum {
+  SEL_LOG_ADD = 0x01,
+  SEL_LOG_ERASE = 0x02,
+};
+
+// Header written once when a segment is started
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t seg_seq; // segments are replayed in this order
+  uint32_t first_seq; // sequence# of the first entry in the segment
+  uint32_t crc;
+} sel_seg_hdr_t;
+
+// Log record, a torn or corrupted one ends the replay of its segment
+typedef struct {
+  uint32_t seq; // sequence# of the entry, the next one for an erase
+  uint8_t type;
+  uint8_t rsvd[3];
+  sel_msg_t msg; // the entry, or the erase time stamp
+  uint32_t crc;
+} sel_log_rec_t;
+
+// SEL header of older releases, only read to import their SEL
 typedef struct {
   int magic; // Magic number to check validity
   int version; // version number of this header
@@ -79,130 +105,275 @@ typedef struct {
   time_stamp_t ts_erase; // last erase time stamp
 } sel_hdr_t;
 
+// In-memory state of the SEL of a node
+typedef struct {
+  int fd; // active segment, open for appending
+  int seg; // active segment#
+  int seg_cnt; // records in the active segment
+  uint32_t seg_seq[SEL_SEG_CNT]; // 0 if the segment is unused
+  uint32_t seg_first[SEL_SEG_CNT];
+  uint32_t first_seq; // oldest entry kept
+  uint32_t next_seq; // entries are [first_seq, next_seq)
+  time_stamp_t ts_add; // last addition time stamp
+  time_stamp_t ts_erase; // last erase time stamp
+  sel_msg_t ents[SEL_RECORDS_MAX]; // entry of seq at seq % SEL_RECORDS_MAX
+} sel_log_t;
+
 // Keep track of last Reservation ID
 static int g_rsv_id[MAX_NODES+1];
 
-// Cached version of SEL Header and data
-static sel_hdr_t g_sel_hdr[MAX_NODES+1];
-static sel_msg_t g_sel_data[MAX_NODES+1][SEL_ELEMS_MAX];
+// Cached SEL of each node
+static sel_log_t g_sel[MAX_NODES+1];
+
+static uint32_t
+sel_crc32(const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  uint32_t crc = 0xFFFFFFFF;
+  int i;
+
+  while (len--) {
+    crc ^= *p++;
+    for (i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+
+  return ~crc;
+}
 
-// Local helper functions to interact with file system
+// Record ID of an entry, wrapping within 0x0001..0xFFFE
 static int
-file_get_sel_hdr(int node) {
-  FILE *fp;
-  char fpath[SIZE_PATH_MAX] = {0};
+sel_rec_id(uint32_t seq) {
+  return ((seq - 1) % SEL_RECID_RANGE) + 1;
+}
 
-  sprintf(fpath, SEL_LOG_FILE, node);
+// Sequence# of a record ID, 0 if no such entry is kept
+static uint32_t
+sel_rec_seq(int node, int rec_id) {
+  sel_log_t *sel = &g_sel[node];
+  uint32_t seq;
 
-  fp = fopen(fpath, "r");
-  if (fp == NULL) {
-    return -1;
+  if (rec_id < 1 || rec_id > SEL_RECID_RANGE) {
+    return 0;
   }
 
-  if (fread(&g_sel_hdr[node], sizeof(sel_hdr_t), 1, fp) <= 0) {
-    syslog(LOG_WARNING, "file_get_sel_hdr: fread\n");
-    fclose (fp);
-    return -1;
+  seq = sel->first_seq + (rec_id - sel_rec_id(sel->first_seq) +
+        SEL_RECID_RANGE) % SEL_RECID_RANGE;
+  if (seq >= sel->next_seq) {
+    return 0;
   }
 
-  fclose(fp);
-  return 0;
+  return seq;
 }
 
+// Start segment# seg, truncating whatever it held
 static int
-file_get_sel_data(int node) {
-  FILE *fp;
-  int i, j;
+file_seg_start(int node, int seg) {
+  sel_log_t *sel = &g_sel[node];
+  sel_seg_hdr_t hdr;
   char fpath[SIZE_PATH_MAX] = {0};
+  uint32_t seg_seq = 0;
+  int i, fd;
 
-  sprintf(fpath, SEL_LOG_FILE, node);
+  for (i = 0; i < SEL_SEG_CNT; i++) {
+    if (sel->seg_seq[i] > seg_seq) {
+      seg_seq = sel->seg_seq[i];
+    }
+  }
 
-  fp = fopen(fpath, "r");
-  if (fp == NULL) {
-    syslog(LOG_WARNING, "file_get_sel_data: fopen\n");
+  sprintf(fpath, SEL_SEG_FILE, node, seg);
+
+  fd = open(fpath, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND, 0644);
+  if (fd < 0) {
+    syslog(LOG_WARNING, "file_seg_start: open %s\n", fpath);
     return -1;
   }
 
-  if (fseek(fp, SEL_DATA_OFFSET, SEEK_SET)) {
-    syslog(LOG_WARNING, "file_get_sel_data: fseek\n");
-    fclose(fp);
+  hdr.magic = SEL_LOG_MAGIC;
+  hdr.version = SEL_LOG_VERSION;
+  hdr.seg_seq = seg_seq + 1;
+  hdr.first_seq = sel->next_seq;
+  hdr.crc = sel_crc32(&hdr, offsetof(sel_seg_hdr_t, crc));
+
+  if (write(fd, &hdr, sizeof(hdr)) != sizeof(hdr)) {
+    syslog(LOG_WARNING, "file_seg_start: write %s\n", fpath);
+    close(fd);
     return -1;
   }
 
-  unsigned char buf[SEL_ELEMS_MAX * 16];
-  if (fread(buf, 1, SEL_ELEMS_MAX * sizeof(sel_msg_t), fp) <= 0) {
-    syslog(LOG_WARNING, "file_get_sel_data: fread\n");
-    fclose(fp);
-    return -1;
+  if (sel->fd >= 0) {
+    close(sel->fd);
   }
+  sel->fd = fd;
+  sel->seg = seg;
+  sel->seg_cnt = 0;
+  sel->seg_seq[seg] = hdr.seg_seq;
+  sel->seg_first[seg] = hdr.first_seq;
 
-  fclose(fp);
+  return 0;
+}
 
-  for (i = 0; i < SEL_ELEMS_MAX; i++) {
-    for (j = 0; j < sizeof(sel_msg_t);j++) {
-      g_sel_data[node][i].msg[j] = buf[i*16 + j];
+// Append a record to the log, moving on to the next segment when full
+static int
+file_log_append(int node, uint8_t type, sel_msg_t *msg) {
+  sel_log_t *sel = &g_sel[node];
+  sel_log_rec_t rec;
+  int next;
+
+  if (sel->seg_cnt == SEL_SEG_RECORDS) {
+    next = (sel->seg + 1) % SEL_SEG_CNT;
+    if (file_seg_start(node, next)) {
+      return -1;
+    }
+
+    // The entries of the reused segment are gone
+    next = (next + 1) % SEL_SEG_CNT;
+    if (sel->seg_seq[next] && sel->seg_first[next] > sel->first_seq) {
+      syslog(LOG_WARNING, "file_log_append: SEL rollover\n");
+      sel->first_seq = sel->seg_first[next];
     }
   }
 
+  memset(&rec, 0, sizeof(rec));
+  rec.seq = sel->next_seq;
+  rec.type = type;
+  memcpy(rec.msg.msg, msg->msg, sizeof(sel_msg_t));
+  rec.crc = sel_crc32(&rec, offsetof(sel_log_rec_t, crc));
+
+  if (write(sel->fd, &rec, sizeof(rec)) != sizeof(rec)) {
+    syslog(LOG_WARNING, "file_log_append: write\n");
+    // Don't leave a torn record behind the next one
+    if (ftruncate(sel->fd, sizeof(sel_seg_hdr_t) +
+                  sel->seg_cnt * sizeof(sel_log_rec_t))) {
+      syslog(LOG_WARNING, "file_log_append: ftruncate\n");
+    }
+    return -1;
+  }
+  sel->seg_cnt++;
+
   return 0;
 }
 
+/*
+ * Replay segment# seg into the cache. The replay stops at the first
+ * record that is torn, fails its CRC or is out of sequence, e.g. after a
+ * power loss in the middle of a write; the segment is truncated there so
+ * that new records follow the last good one. Returns the number of good
+ * records, -1 if the segment holds no valid header.
+ */
 static int
-file_store_sel_hdr(int node) {
-  FILE *fp;
+file_seg_replay(int node, int seg, bool check_only) {
+  sel_log_t *sel = &g_sel[node];
+  sel_seg_hdr_t hdr;
+  sel_log_rec_t rec;
   char fpath[SIZE_PATH_MAX] = {0};
+  int fd, cnt = 0;
 
-  sprintf(fpath, SEL_LOG_FILE, node);
+  sprintf(fpath, SEL_SEG_FILE, node, seg);
 
-  fp = fopen(fpath, "r+");
-  if (fp == NULL) {
-    syslog(LOG_WARNING, "file_store_sel_hdr: fopen\n");
+  fd = open(fpath, check_only ? O_RDONLY : O_RDWR);
+  if (fd < 0) {
     return -1;
   }
 
-  if (fwrite(&g_sel_hdr[node], sizeof(sel_hdr_t), 1, fp) <= 0) {
-    syslog(LOG_WARNING, "file_store_sel_hdr: fwrite\n");
-    fclose(fp);
+  if (read(fd, &hdr, sizeof(hdr)) != sizeof(hdr) ||
+      hdr.magic != SEL_LOG_MAGIC || hdr.version != SEL_LOG_VERSION ||
+      hdr.crc != sel_crc32(&hdr, offsetof(sel_seg_hdr_t, crc))) {
+    close(fd);
     return -1;
   }
 
-  fclose(fp);
+  if (check_only) {
+    sel->seg_seq[seg] = hdr.seg_seq;
+    sel->seg_first[seg] = hdr.first_seq;
+    close(fd);
+    return 0;
+  }
 
-  return 0;
+  // The first segment replayed tells where the log starts. Should an
+  // older segment have lost records, resume at this one's first entry.
+  if (hdr.first_seq != sel->next_seq) {
+    if (sel->next_seq) {
+      syslog(LOG_WARNING, "file_seg_replay: %s, entries %u-%u lost\n",
+             fpath, sel->next_seq, hdr.first_seq - 1);
+    }
+    sel->first_seq = hdr.first_seq;
+    sel->next_seq = hdr.first_seq;
+  }
+
+  while (cnt < SEL_SEG_RECORDS &&
+         read(fd, &rec, sizeof(rec)) == sizeof(rec)) {
+    if (rec.crc != sel_crc32(&rec, offsetof(sel_log_rec_t, crc)) ||
+        rec.seq != sel->next_seq) {
+      break;
+    }
+
+    if (rec.type == SEL_LOG_ADD) {
+      memcpy(sel->ents[rec.seq % SEL_RECORDS_MAX].msg, rec.msg.msg,
+             sizeof(sel_msg_t));
+      memcpy(sel->ts_add.ts, &rec.msg.msg[3], SIZE_TIME_STAMP);
+      sel->next_seq++;
+    } else if (rec.type == SEL_LOG_ERASE) {
+      memcpy(sel->ts_erase.ts, rec.msg.msg, SIZE_TIME_STAMP);
+      sel->first_seq = sel->next_seq;
+    } else {
+      break;
+    }
+    cnt++;
+  }
+
+  if (lseek(fd, 0, SEEK_END) != sizeof(hdr) + cnt * sizeof(rec)) {
+    syslog(LOG_WARNING, "file_seg_replay: %s truncated after %d records\n",
+           fpath, cnt);
+    if (ftruncate(fd, sizeof(hdr) + cnt * sizeof(rec))) {
+      syslog(LOG_WARNING, "file_seg_replay: ftruncate %s\n", fpath);
+    }
+  }
+
+  close(fd);
+  return cnt;
 }
 
-static int
-file_store_sel_data(int node, int recId, sel_msg_t *data) {
+// Import the SEL kept by older releases, then drop its file
+static void
+file_import_old_sel(int node) {
   FILE *fp;
-  int index;
+  sel_hdr_t hdr;
+  sel_msg_t msg;
   char fpath[SIZE_PATH_MAX] = {0};
+  int index;
 
-  sprintf(fpath, SEL_LOG_FILE, node);
+  sprintf(fpath, SEL_OLD_FILE, node);
 
-  fp = fopen(fpath, "r+");
+  fp = fopen(fpath, "r");
   if (fp == NULL) {
-    syslog(LOG_WARNING, "file_store_sel_data: fopen\n");
-    return -1;
+    return;
   }
 
-  // Records are stored using zero-based index
-  index = (recId-1) * sizeof(sel_msg_t);
-
-  if (fseek(fp, SEL_DATA_OFFSET+index, SEEK_SET)) {
-    syslog(LOG_WARNING, "file_store_sel_data: fseek\n");
+  if (fread(&hdr, sizeof(hdr), 1, fp) != 1 || hdr.magic != SEL_HDR_MAGIC ||
+      hdr.begin < 0 || hdr.begin >= SEL_OLD_ELEMS ||
+      hdr.end < 0 || hdr.end >= SEL_OLD_ELEMS) {
     fclose(fp);
-    return -1;
+    return;
   }
 
-  if (fwrite(data->msg, sizeof(sel_msg_t), 1, fp) <= 0) {
-    syslog(LOG_WARNING, "file_store_sel_data: fwrite\n");
-    fclose(fp);
-    return -1;
+  for (index = hdr.begin; index != hdr.end;
+       index = (index + 1) % SEL_OLD_ELEMS) {
+    if (fseek(fp, SEL_DATA_OFFSET + index * sizeof(sel_msg_t), SEEK_SET) ||
+        fread(msg.msg, sizeof(sel_msg_t), 1, fp) != 1 ||
+        file_log_append(node, SEL_LOG_ADD, &msg)) {
+      syslog(LOG_WARNING, "file_import_old_sel: failed for node %d\n", node);
+      fclose(fp);
+      return;
+    }
+    memcpy(g_sel[node].ents[g_sel[node].next_seq % SEL_RECORDS_MAX].msg,
+           msg.msg, sizeof(sel_msg_t));
+    memcpy(g_sel[node].ts_add.ts, &msg.msg[3], SIZE_TIME_STAMP);
+    g_sel[node].next_seq++;
   }
 
   fclose(fp);
-
-  return 0;
+  unlink(fpath);
 }
 
 static void
@@ -295,23 +466,19 @@ parse_sel(uint8_t fru, sel_msg_t *data) {
 // Retrieve time stamp for recent add operation
 void
 sel_ts_recent_add(int node, time_stamp_t *ts) {
-  memcpy(ts->ts, g_sel_hdr[node].ts_add.ts, 0x04);
+  memcpy(ts->ts, g_sel[node].ts_add.ts, 0x04);
 }
 
 // Retrieve time stamp for recent erase operation
 void
 sel_ts_recent_erase(int node, time_stamp_t *ts) {
-  memcpy(ts->ts, g_sel_hdr[node].ts_erase.ts, 0x04);
+  memcpy(ts->ts, g_sel[node].ts_erase.ts, 0x04);
 }
 
 // Retrieve total number of entries in SEL log
 int
 sel_num_entries(int node) {
-  if (g_sel_hdr[node].begin <= g_sel_hdr[node].end) {
-      return (g_sel_hdr[node].end - g_sel_hdr[node].begin);
-  } else {
-    return (g_sel_hdr[node].end + (SEL_INDEX_MAX - g_sel_hdr[node].begin + 1));
-  }
+  return g_sel[node].next_seq - g_sel[node].first_seq;
 }
 
 // Retrieve total free space available in SEL log
@@ -323,6 +490,11 @@ sel_free_space(int node) {
   total_space = SEL_RECORDS_MAX * sizeof(sel_msg_t);
   used_space = sel_num_entries(node) * sizeof(sel_msg_t);
 
+  // FFFFh means 65535 bytes or more (IPMI/Section 31.2)
+  if (total_space - used_space > 0xFFFF) {
+    return 0xFFFF;
+  }
+
   return (total_space - used_space);
 }
 
@@ -342,21 +514,8 @@ sel_rsv_id(int node) {
 // IPMI/Section 31.5
 int
 sel_get_entry(int node, int read_rec_id, sel_msg_t *msg, int *next_rec_id) {
-
-  int index;
-
-  // Find the index in to array based on given index
-  if (read_rec_id == SEL_RECID_FIRST) {
-    index = g_sel_hdr[node].begin;
-  } else if (read_rec_id == SEL_RECID_LAST) {
-    if (g_sel_hdr[node].end) {
-      index = g_sel_hdr[node].end - 1;
-    } else {
-      index = SEL_INDEX_MAX;
-    }
-  } else {
-    index = read_rec_id - 1;
-  }
+  sel_log_t *sel = &g_sel[node];
+  uint32_t seq;
 
   // If the log is empty return error
   if (sel_num_entries(node) == 0) {
@@ -364,39 +523,26 @@ sel_get_entry(int node, int read_rec_id, sel_msg_t *msg, int *next_rec_id) {
     return -1;
   }
 
-  // Check for boundary conditions
-  if ((index < SEL_INDEX_MIN) || (index > SEL_INDEX_MAX)) {
-    syslog(LOG_WARNING, "sel_get_entry: Invalid Record ID %d\n", read_rec_id);
-    return -1;
-  }
-
-  // If begin < end, check to make sure the given id falls between
-  if (g_sel_hdr[node].begin < g_sel_hdr[node].end) {
-    if (index < g_sel_hdr[node].begin || index >= g_sel_hdr[node].end) {
+  // Record IDs map straight to the entries' sequence#
+  if (read_rec_id == SEL_RECID_FIRST) {
+    seq = sel->first_seq;
+  } else if (read_rec_id == SEL_RECID_LAST) {
+    seq = sel->next_seq - 1;
+  } else {
+    seq = sel_rec_seq(node, read_rec_id);
+    if (seq == 0) {
       syslog(LOG_WARNING, "sel_get_entry: Wrong Record ID %d\n", read_rec_id);
       return -1;
     }
   }
 
-  // If end < begin, check to make sure the given id is valid
-  if (g_sel_hdr[node].begin > g_sel_hdr[node].end) {
-    if (index >= g_sel_hdr[node].end && index < g_sel_hdr[node].begin) {
-      syslog(LOG_WARNING, "sel_get_entry: Wrong Record ID2 %d\n", read_rec_id);
-      return -1;
-    }
-  }
+  memcpy(msg->msg, sel->ents[seq % SEL_RECORDS_MAX].msg, sizeof(sel_msg_t));
 
-  memcpy(msg->msg, g_sel_data[node][index].msg, sizeof(sel_msg_t));
-
-  // Return the next record ID in the log
-  *next_rec_id = read_rec_id++;
-  if (*next_rec_id > SEL_INDEX_MAX) {
-    *next_rec_id = SEL_INDEX_MIN;
-  }
-
-  // If this is the last entry in the log, return 0xFFFF
-  if (*next_rec_id == g_sel_hdr[node].end) {
+  // Return the next record ID in the log, 0xFFFF after the last entry
+  if (seq + 1 == sel->next_seq) {
     *next_rec_id = SEL_RECID_LAST;
+  } else {
+    *next_rec_id = sel_rec_id(seq + 1);
   }
 
   return 0;
@@ -406,74 +552,58 @@ sel_get_entry(int node, int read_rec_id, sel_msg_t *msg, int *next_rec_id) {
 // IPMI/Section 31.6
 int
 sel_add_entry(int node, sel_msg_t *msg, int *rec_id) {
-  // If the SEL if full, roll over. To keep track of empty condition, use
-  // one empty location less than the max records.
-  if (sel_num_entries(node) == SEL_RECORDS_MAX) {
-      syslog(LOG_WARNING, "sel_add_entry: SEL rollover\n");
-    if (++g_sel_hdr[node].begin > SEL_INDEX_MAX) {
-      g_sel_hdr[node].begin = SEL_INDEX_MIN;
-    }
-  }
+  sel_log_t *sel = &g_sel[node];
 
   // Update message's time stamp starting at byte 4
   time_stamp_fill(&msg->msg[3]);
 
-  // Add the enry at end
-  memcpy(g_sel_data[node][g_sel_hdr[node].end].msg, msg->msg, sizeof(sel_msg_t));
-
-  // Return the newly added record ID
-  *rec_id = g_sel_hdr[node].end+1;
-
   // Print the data in syslog
   dump_sel_syslog(node, msg);
 
   // Parse the SEL message
   parse_sel((uint8_t) node, msg);
 
-  if (file_store_sel_data(node, *rec_id, msg)) {
-    syslog(LOG_WARNING, "sel_add_entry: file_store_sel_data\n");
+  // A single append, no header to rewrite
+  if (file_log_append(node, SEL_LOG_ADD, msg)) {
+    syslog(LOG_WARNING, "sel_add_entry: file_log_append\n");
     return -1;
   }
 
-  // Increment the end pointer
-  if (++g_sel_hdr[node].end > SEL_INDEX_MAX) {
-    g_sel_hdr[node].end = SEL_INDEX_MIN;
-  }
+  memcpy(sel->ents[sel->next_seq % SEL_RECORDS_MAX].msg, msg->msg,
+         sizeof(sel_msg_t));
+  memcpy(sel->ts_add.ts, &msg->msg[3], SIZE_TIME_STAMP);
 
-  // Update timestamp for add in header
-  time_stamp_fill(g_sel_hdr[node].ts_add.ts);
-
-  // Store the structure persistently
-  if (file_store_sel_hdr(node)) {
-    syslog(LOG_WARNING, "sel_add_entry: file_store_sel_hdr\n");
-    return -1;
-  }
+  // Return the newly added record ID
+  *rec_id = sel_rec_id(sel->next_seq);
+  sel->next_seq++;
 
   return 0;
 }
 
 // Erase the SEL completely
 // IPMI/Section 31.9
-// Note: To reduce wear/tear, instead of erasing, manipulating the metadata
+// Note: To reduce wear/tear, instead of erasing, an erase record is logged
 int
 sel_erase(int node, int rsv_id) {
+  sel_log_t *sel = &g_sel[node];
+  sel_msg_t msg = {0};
+
   if (rsv_id != g_rsv_id[node]) {
     return -1;
   }
 
-  // Erase SEL Logs
-  g_sel_hdr[node].begin = SEL_INDEX_MIN;
-  g_sel_hdr[node].end = SEL_INDEX_MIN;
-
-  // Update timestamp for erase in header
-  time_stamp_fill(g_sel_hdr[node].ts_erase.ts);
+  // Update timestamp for erase
+  time_stamp_fill(msg.msg);
 
-  // Store the structure persistently
-  if (file_store_sel_hdr(node)) {
-    syslog(LOG_WARNING, "sel_erase: file_store_sel_hdr\n");
+  if (file_log_append(node, SEL_LOG_ERASE, &msg)) {
+    syslog(LOG_WARNING, "sel_erase: file_log_append\n");
     return -1;
   }
 
+  // Erase SEL Logs
+  sel->first_seq = sel->next_seq;
+  memcpy(sel->ts_erase.ts, msg.msg, SIZE_TIME_STAMP);
+
   return 0;
 }
 
@@ -492,63 +622,58 @@ sel_erase_status(int node, int rsv_id, sel_erase_stat_t *status) {
   return 0;
 }
 
-// Initialize SEL log file
+// Load the SEL log of a node, replaying its segments oldest first
 static int
 sel_node_init(int node) {
-  FILE *fp;
-  int i;
+  sel_log_t *sel = &g_sel[node];
   char fpath[SIZE_PATH_MAX] = {0};
+  int order[SEL_SEG_CNT];
+  int i, j, n = 0, cnt = 0;
 
-  sprintf(fpath, SEL_LOG_FILE, node);
+  memset(sel, 0, sizeof(sel_log_t));
+  sel->fd = -1;
+  g_rsv_id[node] = 0x01;
 
-  // Check if the file exists or not
-  if (access(fpath, F_OK) == 0) {
-    // Since file is present, fetch all the contents to cache
-    if (file_get_sel_hdr(node)) {
-      syslog(LOG_WARNING, "init_sel: file_get_sel_hdr\n");
-      return -1;
+  for (i = 0; i < SEL_SEG_CNT; i++) {
+    if (file_seg_replay(node, i, true) < 0) {
+      continue;
     }
-
-    if (file_get_sel_data(node)) {
-      syslog(LOG_WARNING, "init_sel: file_get_sel_data\n");
-      return -1;
+    // Insertion sort by seg_seq
+    for (j = n; j > 0 && sel->seg_seq[order[j-1]] > sel->seg_seq[i]; j--) {
+      order[j] = order[j-1];
     }
-
-    return 0;
-  }
-
-  // File not present, so create the file
-  fp = fopen(fpath, "w+");
-  if (fp == NULL) {
-    syslog(LOG_WARNING, "init_sel: fopen\n");
-    return -1;
+    order[j] = i;
+    n++;
   }
 
-  fclose (fp);
-
-  // Populate SEL Header in to the file
-  g_sel_hdr[node].magic = SEL_HDR_MAGIC;
-  g_sel_hdr[node].version = SEL_HDR_VERSION;
-  g_sel_hdr[node].begin = SEL_INDEX_MIN;
-  g_sel_hdr[node].end = SEL_INDEX_MIN;
-  memset(g_sel_hdr[node].ts_add.ts, 0x0, 4);
-  memset(g_sel_hdr[node].ts_erase.ts, 0x0, 4);
-
-  if (file_store_sel_hdr(node)) {
-    syslog(LOG_WARNING, "init_sel: file_store_sel_hdr\n");
-    return -1;
+  for (i = 0; i < n; i++) {
+    cnt = file_seg_replay(node, order[i], false);
+    if (cnt < 0) {
+      cnt = 0;
+    }
   }
 
-  // Populate SEL Data in to the file
-  for (i = 1;  i <= SEL_RECORDS_MAX; i++) {
-    sel_msg_t msg = {0};
-    if (file_store_sel_data(node, i, &msg)) {
-      syslog(LOG_WARNING, "init_sel: file_store_sel_data\n");
+  // Nothing logged yet: start the log, bringing over an older SEL
+  if (n == 0) {
+    sel->first_seq = 1;
+    sel->next_seq = 1;
+    if (file_seg_start(node, 0)) {
+      syslog(LOG_WARNING, "init_sel: file_seg_start\n");
       return -1;
     }
+    file_import_old_sel(node);
+    return 0;
   }
 
-  g_rsv_id[node] = 0x01;
+  // Keep appending to the newest segment
+  sprintf(fpath, SEL_SEG_FILE, node, order[n-1]);
+  sel->fd = open(fpath, O_WRONLY | O_APPEND);
+  if (sel->fd < 0) {
+    syslog(LOG_WARNING, "init_sel: open %s\n", fpath);
+    return -1;
+  }
+  sel->seg = order[n-1];
+  sel->seg_cnt = cnt;
 
   return 0;
 }
@@ -28,15 +28,86 @@
 #include <math.h>
 #include <string.h>
 #include <pthread.h>
+#include <signal.h>
+#include <time.h>
 #include <sys/file.h>
 #include <openbmc/ipmi.h>
 #include <openbmc/sdr.h>
 #include <openbmc/pal.h>
+#include <openbmc/sensor_cache.h>
+#include <openbmc/sensor_history.h>
+#include <openbmc/sensor_stats.h>
 
 #define DELAY 2
 #define MAX_SENSOR_CHECK_RETRY 3
+#define DEFAULT_POLL_INTERVAL (DELAY * 1000)
+#define MIN_POLL_INTERVAL 100
+#define MAX_SENSOR_BUS 16
+#define MAX_BUS_SENSORS 256
+
+/* Scheduling state and lateness stats of one monitored sensor */
+typedef struct {
+  uint8_t fru;
+  uint8_t snr_num;
+  bool discrete;
+  uint32_t interval;      /* poll period in ms */
+  uint64_t due;           /* next deadline, CLOCK_MONOTONIC ms */
+  uint64_t polls;
+  uint64_t late_total;    /* sum of lateness in ms */
+  uint32_t late_max;
+  uint32_t late_last;
+} snr_sched_t;
+
+/*
+ * Work queue of one bus/transport: a min-heap of the sensors on it ordered
+ * by their next deadline, drained by a dedicated worker thread so a slow
+ * or stuck device only delays the sensors sharing its bus.
+ */
+typedef struct {
+  uint8_t bus;
+  pthread_t thread;
+  int cnt;
+  snr_sched_t snr[MAX_BUS_SENSORS];
+  int heap[MAX_BUS_SENSORS];
+  uint64_t dispatches;
+  uint64_t depth_total;   /* sum of due sensors seen at each dispatch */
+  uint32_t depth_max;
+  uint64_t read_total;    /* sum of read + threshold check time in ms */
+  uint32_t read_max;
+} bus_sched_t;
+
+/*
+ * Debounce state of one sensor: number of consecutive samples seen past
+ * each threshold, indexed by the threshold enum.
+ */
+typedef struct {
+  uint8_t assert_cnt[LNR_THRESH + 1];
+  uint8_t deassert_cnt[LNR_THRESH + 1];
+} snr_debounce_t;
+
+/*
+ * Health of one FRU: a bitmap of its sensors currently in a non-zero state.
+ * The pollers update it on every state transition, so the aggregate is
+ * known without scanning all the sensors.
+ */
+typedef struct {
+  uint32_t bad[(MAX_SENSOR_NUM + 1) / 32];
+  uint16_t bad_cnt;
+  int persisted;          /* value last stored with pal, -1 if none yet */
+  bool monitored;         /* FRU given on the command line */
+} snr_health_t;
 
 static thresh_sensor_t g_snr[MAX_NUM_FRUS][MAX_SENSOR_NUM] = {0};
+static snr_debounce_t g_debounce[MAX_NUM_FRUS][MAX_SENSOR_NUM + 1];
+static snr_health_t g_health[MAX_NUM_FRUS];
+static bool g_health_dirty = true;
+static uint64_t g_health_writes = 0;
+static uint64_t g_health_skipped = 0;   /* flash writes avoided */
+static pthread_mutex_t m_health = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t c_health = PTHREAD_COND_INITIALIZER;
+static bus_sched_t *g_bus_sched[MAX_SENSOR_BUS] = {0};
+static int g_bus_cnt = 0;
+static volatile sig_atomic_t g_stats_req = 0;
 
 static void
 print_usage() {
@@ -61,6 +132,35 @@ get_struct_thresh_sensor(uint8_t fru) {
   return snr;
 }
 
+/*
+ * Record the new state of a sensor in its FRU's health bitmap and wake up
+ * the health thread if that flips the FRU between good and bad.
+ */
+static void
+snr_health_update(uint8_t fru, uint8_t snr_num, int curr_state) {
+
+  snr_health_t *h = &g_health[fru-1];
+  uint32_t mask = 1U << (snr_num % 32);
+  uint32_t *word = &h->bad[snr_num / 32];
+  bool bad = (curr_state != 0);
+
+  pthread_mutex_lock(&m_health);
+  if (bad != !!(*word & mask)) {
+    if (bad) {
+      *word |= mask;
+      if (h->bad_cnt++ == 0)
+        g_health_dirty = true;
+    } else {
+      *word &= ~mask;
+      if (--h->bad_cnt == 0)
+        g_health_dirty = true;
+    }
+    if (g_health_dirty)
+      pthread_cond_signal(&c_health);
+  }
+  pthread_mutex_unlock(&m_health);
+}
+
 /* Initialize all thresh_sensor_t structs for all the Yosemite sensors */
 static int
 init_fru_snr_thresh(uint8_t fru) {
@@ -137,8 +237,9 @@ get_snr_thresh_val(uint8_t fru, uint8_t snr_num, uint8_t thresh) {
 }
 
 /*
- * Check the curr sensor values against the threshold and
- * if the curr val has deasserted, log it.
+ * Check the curr sensor value against the threshold and if it has stayed
+ * deasserted for MAX_SENSOR_CHECK_RETRY consecutive samples, log it.
+ * The samples are the regular polls, so this never sleeps or re-reads.
  */
 static int
 check_thresh_deassert(uint8_t fru, uint8_t snr_num, uint8_t thresh,
@@ -147,47 +248,44 @@ check_thresh_deassert(uint8_t fru, uint8_t snr_num, uint8_t thresh,
   float thresh_val;
   char thresh_name[100];
   thresh_sensor_t *snr;
-  uint8_t retry = 0;
-  int ret;
+  snr_debounce_t *dbnc;
 
   snr = get_struct_thresh_sensor(fru);
+  dbnc = &g_debounce[fru-1][snr_num];
 
   if (!GETBIT(snr[snr_num].flag, thresh) ||
-      !GETBIT(snr[snr_num].curr_state, thresh))
+      !GETBIT(snr[snr_num].curr_state, thresh)) {
+    dbnc->deassert_cnt[thresh] = 0;
     return 0;
+  }
 
   thresh_val = get_snr_thresh_val(fru, snr_num, thresh);
 
-  while (retry < MAX_SENSOR_CHECK_RETRY) {
-    switch (thresh) {
-
-      case UNR_THRESH:
-      case UCR_THRESH:
-      case UNC_THRESH:
-        if (*curr_val < (thresh_val - snr[snr_num].pos_hyst))
-          retry++;
-         else
-          return 0;
-        break;
+  switch (thresh) {
 
-      case LNR_THRESH:
-      case LCR_THRESH:
-      case LNC_THRESH:
-        if (*curr_val > (thresh_val + snr[snr_num].neg_hyst))
-          retry++;
-        else
-          return 0;
-        break;
-    }
+    case UNR_THRESH:
+    case UCR_THRESH:
+    case UNC_THRESH:
+      if (!(*curr_val < (thresh_val - snr[snr_num].pos_hyst))) {
+        dbnc->deassert_cnt[thresh] = 0;
+        return 0;
+      }
+      break;
 
-    if (retry < MAX_SENSOR_CHECK_RETRY) {
-      msleep(50);
-      ret = pal_sensor_read_raw(fru, snr_num, curr_val);
-      if (ret < 0)
-        return -1;
-    }
+    case LNR_THRESH:
+    case LCR_THRESH:
+    case LNC_THRESH:
+      if (!(*curr_val > (thresh_val + snr[snr_num].neg_hyst))) {
+        dbnc->deassert_cnt[thresh] = 0;
+        return 0;
+      }
+      break;
   }
 
+  if (++dbnc->deassert_cnt[thresh] < MAX_SENSOR_CHECK_RETRY)
+    return 0;
+  dbnc->deassert_cnt[thresh] = 0;
+
   switch (thresh) {
     case UNC_THRESH:
         curr_state = ~(SETBIT(curr_state, UNR_THRESH) |
@@ -232,6 +330,7 @@ check_thresh_deassert(uint8_t fru, uint8_t snr_num, uint8_t thresh,
 
   if (curr_state) {
     snr[snr_num].curr_state &= curr_state;
+    snr_health_update(fru, snr_num, snr[snr_num].curr_state);
     pal_update_ts_sled();
     syslog(LOG_CRIT, "DEASSERT: %s threshold - settled - FRU: %d, num: 0x%X "
         "curr_val: %.2f %s, thresh_val: %.2f %s, snr: %-16s",thresh_name,
@@ -244,8 +343,9 @@ check_thresh_deassert(uint8_t fru, uint8_t snr_num, uint8_t thresh,
 
 
 /*
- * Check the curr sensor values against the threshold and
- * if the curr val has asserted, log it.
+ * Check the curr sensor value against the threshold and if it has stayed
+ * asserted for MAX_SENSOR_CHECK_RETRY consecutive samples, log it.
+ * Never blocks: the samples are the sensor's regular polls.
  */
 static int
 check_thresh_assert(uint8_t fru, uint8_t snr_num, uint8_t thresh,
@@ -254,47 +354,42 @@ check_thresh_assert(uint8_t fru, uint8_t snr_num, uint8_t thresh,
   float thresh_val;
   char thresh_name[100];
   thresh_sensor_t *snr;
-  uint8_t retry = 0;
-  int ret;
+  snr_debounce_t *dbnc;
 
   snr = get_struct_thresh_sensor(fru);
+  dbnc = &g_debounce[fru-1][snr_num];
 
   if (!GETBIT(snr[snr_num].flag, thresh) ||
-      GETBIT(snr[snr_num].curr_state, thresh))
+      GETBIT(snr[snr_num].curr_state, thresh)) {
+    dbnc->assert_cnt[thresh] = 0;
     return 0;
+  }
 
   thresh_val = get_snr_thresh_val(fru, snr_num, thresh);
 
-  while (retry < MAX_SENSOR_CHECK_RETRY) {
-    switch (thresh) {
-      case UNR_THRESH:
-      case UCR_THRESH:
-      case UNC_THRESH:
-        if (*curr_val >= thresh_val) {
-          retry++;
-        } else {
-          return 0;
-        }
-        break;
-      case LNR_THRESH:
-      case LCR_THRESH:
-      case LNC_THRESH:
-        if (*curr_val <= thresh_val) {
-          retry++;
-        } else {
-          return 0;
-        }
-        break;
-    }
-
-    msleep(50);
-    if (retry < MAX_SENSOR_CHECK_RETRY) {
-      ret = pal_sensor_read_raw(fru, snr_num, curr_val);
-      if (ret < 0)
-        return -1;
-    }
+  switch (thresh) {
+    case UNR_THRESH:
+    case UCR_THRESH:
+    case UNC_THRESH:
+      if (!(*curr_val >= thresh_val)) {
+        dbnc->assert_cnt[thresh] = 0;
+        return 0;
+      }
+      break;
+    case LNR_THRESH:
+    case LCR_THRESH:
+    case LNC_THRESH:
+      if (!(*curr_val <= thresh_val)) {
+        dbnc->assert_cnt[thresh] = 0;
+        return 0;
+      }
+      break;
   }
 
+  if (++dbnc->assert_cnt[thresh] < MAX_SENSOR_CHECK_RETRY)
+    return 0;
+  dbnc->assert_cnt[thresh] = 0;
+
   switch (thresh) {
     case UNR_THRESH:
         curr_state = (SETBIT(curr_state, UNR_THRESH) |
@@ -340,6 +435,7 @@ check_thresh_assert(uint8_t fru, uint8_t snr_num, uint8_t thresh,
   if (curr_state) {
     curr_state &= snr[snr_num].flag;
     snr[snr_num].curr_state |= curr_state;
+    snr_health_update(fru, snr_num, snr[snr_num].curr_state);
     pal_update_ts_sled();
     syslog(LOG_CRIT, "ASSERT: %s threshold - raised - FRU: %d, num: 0x%X"
         " curr_val: %.2f %s, thresh_val: %.2f %s, snr: %-16s", thresh_name,
@@ -351,156 +447,412 @@ check_thresh_assert(uint8_t fru, uint8_t snr_num, uint8_t thresh,
 }
 
 
+static uint64_t
+get_mono_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+sleep_until_ms(uint64_t deadline) {
+  struct timespec ts;
+
+  ts.tv_sec = deadline / 1000;
+  ts.tv_nsec = (deadline % 1000) * 1000000;
+  while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR);
+}
+
+static void
+sched_heap_swap(bus_sched_t *sched, int a, int b) {
+  int tmp = sched->heap[a];
+
+  sched->heap[a] = sched->heap[b];
+  sched->heap[b] = tmp;
+}
+
+static uint64_t
+sched_heap_due(bus_sched_t *sched, int pos) {
+  return sched->snr[sched->heap[pos]].due;
+}
+
+static void
+sched_heap_up(bus_sched_t *sched, int pos) {
+  int parent;
+
+  while (pos > 0) {
+    parent = (pos - 1) / 2;
+    if (sched_heap_due(sched, parent) <= sched_heap_due(sched, pos))
+      break;
+    sched_heap_swap(sched, parent, pos);
+    pos = parent;
+  }
+}
+
+static void
+sched_heap_down(bus_sched_t *sched, int pos) {
+  int child;
+
+  while ((child = 2 * pos + 1) < sched->cnt) {
+    if (child + 1 < sched->cnt &&
+        sched_heap_due(sched, child + 1) < sched_heap_due(sched, child))
+      child++;
+    if (sched_heap_due(sched, pos) <= sched_heap_due(sched, child))
+      break;
+    sched_heap_swap(sched, pos, child);
+    pos = child;
+  }
+}
+
 /*
- * Starts monitoring all the sensors on a fru for all discrete sensors.
- * Each pthread runs this monitoring for a different fru.
+ * Queue for the bus a sensor lives on. Sensors whose bus the PAL does not
+ * know are grouped per FRU, like the old per-FRU monitoring threads.
  */
-static void *
-snr_discrete_monitor(void *arg) {
+static bus_sched_t *
+sched_get_bus(uint8_t fru, uint8_t snr_num) {
+  int i;
+  uint8_t bus;
+  bus_sched_t *sched;
 
-  uint8_t fru = *(uint8_t *) arg;
-  int i, ret;
-  int discrete_cnt;
-  uint8_t snr_num;
-  thresh_sensor_t *snr;
-  float normal_val, curr_val;
+  if (pal_get_sensor_bus(fru, snr_num, &bus) < 0)
+    bus = 0x80 | fru;
 
-  uint8_t *discrete_list;
-  ret = pal_get_fru_discrete_list(fru, &discrete_list, &discrete_cnt);
-  if (ret < 0) {
-    return;
+  for (i = 0; i < g_bus_cnt; i++) {
+    if (g_bus_sched[i]->bus == bus)
+      return g_bus_sched[i];
   }
 
-  if (discrete_cnt == 0)
+  if (g_bus_cnt >= MAX_SENSOR_BUS) {
+    syslog(LOG_WARNING, "sched_get_bus: too many buses, bus %d not added", bus);
+    return NULL;
+  }
+
+  sched = calloc(1, sizeof(bus_sched_t));
+  if (sched == NULL) {
+    syslog(LOG_WARNING, "sched_get_bus: calloc failed for bus %d", bus);
+    return NULL;
+  }
+  sched->bus = bus;
+  g_bus_sched[g_bus_cnt++] = sched;
+
+  return sched;
+}
+
+/* Add a sensor to its bus queue with its PAL-defined poll period */
+static void
+sched_add_sensor(uint8_t fru, uint8_t snr_num, bool discrete, uint64_t now) {
+  bus_sched_t *sched;
+  snr_sched_t *s;
+  uint32_t interval = DEFAULT_POLL_INTERVAL;
+
+  sched = sched_get_bus(fru, snr_num);
+  if (sched == NULL || sched->cnt >= MAX_BUS_SENSORS)
     return;
 
-  snr = get_struct_thresh_sensor(fru);
-  if (snr == NULL) {
-    syslog(LOG_WARNING, "snr_discrete_monitor: get_struct_thresh_sensor failed");
-    exit(-1);
+  pal_get_sensor_poll_interval(fru, snr_num, &interval);
+  if (interval == 0)
+    interval = DEFAULT_POLL_INTERVAL;
+  else if (interval < MIN_POLL_INTERVAL)
+    interval = MIN_POLL_INTERVAL;
+
+  /*
+   * Let other readers share our reading for half a period, which keeps
+   * our own polls going to the hardware.
+   */
+  sensor_cache_set_ttl(fru, snr_num, interval / 2);
+  sensor_stats_set_xport(fru, snr_num, sched->bus);
+
+  s = &sched->snr[sched->cnt];
+  memset(s, 0, sizeof(snr_sched_t));
+  s->fru = fru;
+  s->snr_num = snr_num;
+  s->discrete = discrete;
+  s->interval = interval;
+  s->due = now;
+
+  sched->heap[sched->cnt] = sched->cnt;
+  sched->cnt++;
+  sched_heap_up(sched, sched->cnt - 1);
+}
+
+static void
+sched_dump_stats(bus_sched_t *sched) {
+  int i;
+  snr_sched_t *s;
+  uint64_t n = sched->dispatches ? sched->dispatches : 1;
+
+  syslog(LOG_INFO, "sched: bus: 0x%X, sensors: %d, dispatches: %llu, "
+      "queue depth avg: %llu max: %u, read avg: %llu ms max: %u ms",
+      sched->bus, sched->cnt, (unsigned long long) sched->dispatches,
+      (unsigned long long) (sched->depth_total / n), sched->depth_max,
+      (unsigned long long) (sched->read_total / n), sched->read_max);
+
+  for (i = 0; i < sched->cnt; i++) {
+    s = &sched->snr[i];
+    syslog(LOG_INFO, "sched: FRU: %d, num: 0x%X, period: %u ms, polls: %llu, "
+        "late avg: %llu ms, max: %u ms, last: %u ms", s->fru, s->snr_num,
+        s->interval, (unsigned long long) s->polls,
+        (unsigned long long) (s->polls ? s->late_total / s->polls : 0),
+        s->late_max, s->late_last);
   }
+}
 
-  for (i = 0; i < discrete_cnt; i++) {
-    snr_num = discrete_list[i];
-    pal_get_sensor_name(fru, snr_num, snr[snr_num].name);
+static void
+stats_sig_handler(int sig) {
+  g_stats_req++;
+}
+
+/* Read a discrete sensor and report any change of its state */
+static void
+snr_discrete_poll(uint8_t fru, uint8_t snr_num) {
+  int ret;
+  float curr_val;
+  thresh_sensor_t *snr;
+
+  snr = get_struct_thresh_sensor(fru);
+
+  ret = pal_sensor_read_raw(fru, snr_num, &curr_val);
+
+  if ((snr[snr_num].curr_state != (int) curr_val) && !ret) {
+    pal_sensor_discrete_check(fru, snr_num, snr[snr_num].name,
+        snr[snr_num].curr_state, (int) curr_val);
+    snr[snr_num].curr_state = (int) curr_val;
+    snr_health_update(fru, snr_num, snr[snr_num].curr_state);
   }
+}
 
-  while(1) {
-    for (i = 0; i < discrete_cnt; i++) {
-      snr_num = discrete_list[i];
-      ret = pal_sensor_read_raw(fru, snr_num, &curr_val);
-
-      if ((snr[snr_num].curr_state != (int) curr_val) && !ret) {
-        pal_sensor_discrete_check(fru, snr_num, snr[snr_num].name,
-            snr[snr_num].curr_state, (int) curr_val);
-        snr[snr_num].curr_state = (int) curr_val;
-      }
+/*
+ * Read a threshold sensor once and run all six threshold debounce state
+ * machines on that reading.
+ */
+static void
+snr_thresh_poll(uint8_t fru, uint8_t snr_num) {
+  int ret;
+  float curr_val = 0;
+
+  if (!(ret = pal_sensor_read_raw(fru, snr_num, &curr_val))) {
+
+    sensor_history_add(fru, snr_num, (uint32_t) time(NULL), curr_val);
+
+    check_thresh_assert(fru, snr_num, UNR_THRESH, &curr_val);
+    check_thresh_assert(fru, snr_num, UCR_THRESH, &curr_val);
+    check_thresh_assert(fru, snr_num, UNC_THRESH, &curr_val);
+    check_thresh_assert(fru, snr_num, LNR_THRESH, &curr_val);
+    check_thresh_assert(fru, snr_num, LCR_THRESH, &curr_val);
+    check_thresh_assert(fru, snr_num, LNC_THRESH, &curr_val);
+
+    check_thresh_deassert(fru, snr_num, UNC_THRESH, &curr_val);
+    check_thresh_deassert(fru, snr_num, UCR_THRESH, &curr_val);
+    check_thresh_deassert(fru, snr_num, UNR_THRESH, &curr_val);
+    check_thresh_deassert(fru, snr_num, LNC_THRESH, &curr_val);
+    check_thresh_deassert(fru, snr_num, LCR_THRESH, &curr_val);
+    check_thresh_deassert(fru, snr_num, LNR_THRESH, &curr_val);
+#ifdef DEBUG
+  } else {
+    thresh_sensor_t *snr = get_struct_thresh_sensor(fru);
+
+    syslog(LOG_ERR, "FRU: %d, num: 0x%X, snr:%-16s, read failed",
+        fru, snr_num, snr[snr_num].name);
+#endif /* DEBUG */
+  } /* pal_sensor_read return check */
+}
+
+/*
+ * Number of sensors in the queue that are already due. A heap node is
+ * never due before its parent, so only the due nodes and their children
+ * are visited: a queue that keeps up costs a few compares per dispatch.
+ */
+static uint32_t
+sched_depth(bus_sched_t *sched, uint64_t now) {
+  int stack[MAX_BUS_SENSORS];
+  int top = 0, pos, child;
+  uint32_t depth = 0;
+
+  if (sched->cnt == 0 || sched_heap_due(sched, 0) > now)
+    return 0;
+
+  stack[top++] = 0;
+  while (top > 0) {
+    pos = stack[--top];
+    depth++;
+    for (child = 2 * pos + 1; child <= 2 * pos + 2; child++) {
+      if (child < sched->cnt && sched_heap_due(sched, child) <= now)
+        stack[top++] = child;
     }
-    sleep(DELAY);
   }
+
+  return depth;
 }
 
 /*
- * Starts monitoring all the sensors on a fru for all the threshold values.
- * Each pthread runs this monitoring for a different fru.
+ * Worker for one bus: sleeps until the earliest deadline in the bus
+ * queue, polls that sensor and reschedules it on its own period grid.
+ * Each pthread runs this for a different bus, so reads on different
+ * buses overlap.
  */
 static void *
-snr_thresh_monitor(void *arg) {
+snr_bus_worker(void *arg) {
 
-  uint8_t fru = *(uint8_t *) arg;
-  int i, ret, snr_num, sensor_cnt;
-  float normal_val, curr_val;
-  uint8_t *sensor_list;
+  bus_sched_t *sched = (bus_sched_t *) arg;
+  snr_sched_t *s;
+  uint64_t now, start;
+  uint32_t late, depth, elapsed;
+  sig_atomic_t stats_seen = 0;
+
+  if (sched->cnt == 0)
+    return NULL;
+
+  while(1) {
+    s = &sched->snr[sched->heap[0]];
+
+    sleep_until_ms(s->due);
+
+    start = get_mono_ms();
+    late = (start > s->due) ? (uint32_t) (start - s->due) : 0;
+    s->polls++;
+    s->late_total += late;
+    s->late_last = late;
+    if (late > s->late_max)
+      s->late_max = late;
+
+    depth = sched_depth(sched, start);
+    sched->dispatches++;
+    sched->depth_total += depth;
+    if (depth > sched->depth_max)
+      sched->depth_max = depth;
+
+    if (s->discrete)
+      snr_discrete_poll(s->fru, s->snr_num);
+    else
+      snr_thresh_poll(s->fru, s->snr_num);
+
+    now = get_mono_ms();
+    elapsed = (uint32_t) (now - start);
+    sched->read_total += elapsed;
+    if (elapsed > sched->read_max)
+      sched->read_max = elapsed;
+
+    /* Stay on the period grid unless a whole period has been missed */
+    s->due += s->interval;
+    if (s->due <= now)
+      s->due = now + s->interval;
+    sched_heap_down(sched, 0);
+
+    if (stats_seen != g_stats_req) {
+      stats_seen = g_stats_req;
+      sched_dump_stats(sched);
+    }
+  } /* while loop*/
+} /* function definition */
+
+/* Queue all the threshold and discrete sensors of a fru on their buses */
+static int
+sched_add_fru(uint8_t fru) {
+  int i, ret;
+  int sensor_cnt, discrete_cnt;
+  uint8_t snr_num;
+  uint8_t *sensor_list, *discrete_list;
   thresh_sensor_t *snr;
+  uint64_t now;
+
+  snr = get_struct_thresh_sensor(fru);
+  if (snr == NULL) {
+    syslog(LOG_WARNING, "sched_add_fru: get_struct_thresh_sensor failed");
+    return -1;
+  }
+
+  now = get_mono_ms();
 
   ret = pal_get_fru_sensor_list(fru, &sensor_list, &sensor_cnt);
   if (ret < 0) {
-    return ret;
+    sensor_cnt = 0;
   }
 
-  if (sensor_cnt == 0)
-    return;
+  for (i = 0; i < sensor_cnt; i++) {
+    snr_num = sensor_list[i];
+    if (snr[snr_num].flag)
+      sched_add_sensor(fru, snr_num, false, now);
+  }
 
-  snr = get_struct_thresh_sensor(fru);
-  if (snr == NULL) {
-    syslog(LOG_WARNING, "snr_thresh_monitor: get_struct_thresh_sensor failed");
-    exit(-1);
+  ret = pal_get_fru_discrete_list(fru, &discrete_list, &discrete_cnt);
+  if (ret < 0) {
+    discrete_cnt = 0;
   }
 
-  while(1) {
+  for (i = 0; i < discrete_cnt; i++) {
+    snr_num = discrete_list[i];
+    pal_get_sensor_name(fru, snr_num, snr[snr_num].name);
+    sched_add_sensor(fru, snr_num, true, now);
+  }
 
-    for (i = 0; i < sensor_cnt; i++) {
-      snr_num = sensor_list[i];
-      curr_val = 0;
-      if (snr[snr_num].flag) {
-        if (!(ret = pal_sensor_read_raw(fru, snr_num, &curr_val))) {
-
-          check_thresh_assert(fru, snr_num, UNR_THRESH, &curr_val);
-          check_thresh_assert(fru, snr_num, UCR_THRESH, &curr_val);
-          check_thresh_assert(fru, snr_num, UNC_THRESH, &curr_val);
-          check_thresh_assert(fru, snr_num, LNR_THRESH, &curr_val);
-          check_thresh_assert(fru, snr_num, LCR_THRESH, &curr_val);
-          check_thresh_assert(fru, snr_num, LNC_THRESH, &curr_val);
-
-          check_thresh_deassert(fru, snr_num, UNC_THRESH, &curr_val);
-          check_thresh_deassert(fru, snr_num, UCR_THRESH, &curr_val);
-          check_thresh_deassert(fru, snr_num, UNR_THRESH, &curr_val);
-          check_thresh_deassert(fru, snr_num, LNC_THRESH, &curr_val);
-          check_thresh_deassert(fru, snr_num, LCR_THRESH, &curr_val);
-          check_thresh_deassert(fru, snr_num, LNR_THRESH, &curr_val);
-#ifdef DEBUG
-        } else {
-          syslog(LOG_ERR, "FRU: %d, num: 0x%X, snr:%-16s, read failed",
-              fru, snr_num, snr[snr_num].name);
-#endif /* DEBUG */
-        } /* pal_sensor_read return check */
-      } /* flag check */
-    } /* loop for all sensors */
-    sleep(DELAY);
-  } /* while loop*/
-} /* function definition */
+  return 0;
+}
 
+/*
+ * Stores the health of every FRU with pal, but only when it differs from
+ * the value stored last, since that is a write to the kv store on flash.
+ * Wakes up on a flip, or every DELAY seconds to account for the writes the
+ * periodic update would have done and to retry the writes that failed.
+ */
 static void *
 snr_health_monitor() {
 
   int fru;
-  thresh_sensor_t *snr;
-  uint8_t value = 0;
-  int num;
+  int value[MAX_NUM_FRUS];
+  bool changed[MAX_NUM_FRUS];
+  struct timespec ts;
+  snr_health_t *h;
+  sig_atomic_t stats_seen = 0;
+
+  for (fru = 1; fru <= MAX_NUM_FRUS; fru++)
+    g_health[fru-1].persisted = -1;
 
+  pthread_mutex_lock(&m_health);
   while (1) {
     for (fru = 1; fru <= MAX_NUM_FRUS; fru++) {
+      h = &g_health[fru-1];
+      value[fru-1] = (h->bad_cnt > 0) ? FRU_STATUS_BAD : FRU_STATUS_GOOD;
+      changed[fru-1] = (value[fru-1] != h->persisted);
+      if (!changed[fru-1] && h->monitored)
+        g_health_skipped++;
+    }
+    g_health_dirty = false;
+    pthread_mutex_unlock(&m_health);
 
-      value = 0;
-
-      snr = get_struct_thresh_sensor(fru);
-      if (snr == NULL) {
-        syslog(LOG_WARNING, "snr_health_monitor: get_struct_thresh_sensor failed");
-         exit(-1);
-      }
-
-      for (num = 0; num <= MAX_SENSOR_NUM; num++) {
-        value |= snr[num].curr_state;
+    /* Only this thread uses persisted; a failed write is tried again */
+    for (fru = 1; fru <= MAX_NUM_FRUS; fru++) {
+      if (changed[fru-1] && !pal_set_sensor_health(fru, value[fru-1])) {
+        g_health[fru-1].persisted = value[fru-1];
+        g_health_writes++;
       }
+    }
 
-      value = (value > 0) ? FRU_STATUS_BAD: FRU_STATUS_GOOD;
+    if (stats_seen != g_stats_req) {
+      stats_seen = g_stats_req;
+      syslog(LOG_INFO, "health: flash writes: %llu, avoided: %llu",
+          (unsigned long long) g_health_writes,
+          (unsigned long long) g_health_skipped);
+    }
 
-      pal_set_sensor_health(fru, value);
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec += DELAY;
 
-    } /* for loop for frus */
-    sleep(DELAY);
+    pthread_mutex_lock(&m_health);
+    while (!g_health_dirty) {
+      if (pthread_cond_timedwait(&c_health, &m_health, &ts) == ETIMEDOUT)
+        break;
+    }
   } /* while loop */
 }
 
-/* Spawns a pthread for each fru to monitor all the sensors on it */
+/* Spawns a pthread for each sensor bus to monitor all the sensors on it */
 static int
 run_sensord(int argc, char **argv) {
 
-  int ret, arg;
+  int i, ret, arg;
   uint8_t fru;
   uint8_t fru_flag = 0;
-  pthread_t thread_snr[MAX_NUM_FRUS];
-  pthread_t discrete_snr[MAX_NUM_FRUS];
   pthread_t sensor_health;
 
   arg = 1;
@@ -514,6 +866,9 @@ run_sensord(int argc, char **argv) {
     arg++;
   }
 
+  /* SIGUSR1 dumps the per-bus and per-sensor scheduling stats to syslog */
+  signal(SIGUSR1, stats_sig_handler);
+
   for (fru = 1; fru <= MAX_NUM_FRUS; fru++) {
 
     if (GETBIT(fru_flag, fru)) {
@@ -521,27 +876,24 @@ run_sensord(int argc, char **argv) {
       if (init_fru_snr_thresh(fru) < 0)
         return -1;
 
-      /* Threshold Sensors */
-      if (pthread_create(&thread_snr[fru-1], NULL, snr_thresh_monitor,
-          (void*) &fru) < 0) {
-        syslog(LOG_WARNING, "pthread_create for Threshold Sensors for FRU %d failed\n", fru);
-#ifdef DEBUG
-      } else {
-        syslog(LOG_WARNING, "pthread_create for Threshold Sensors for FRU %d succeed\n", fru);
-#endif /* DEBUG */
-      }
-      sleep(1);
+      if (sched_add_fru(fru) < 0)
+        return -1;
 
-      /* Discrete Sensors */
-      if (pthread_create(&discrete_snr[fru-1], NULL, snr_discrete_monitor,
-            (void*) &fru) < 0) {
-        syslog(LOG_WARNING, "pthread_create for discrete sensors for FRU %d failed\n", fru);
+      g_health[fru-1].monitored = true;
+    }
+  }
+
+  /* Threshold and Discrete Sensors */
+  for (i = 0; i < g_bus_cnt; i++) {
+    if (pthread_create(&g_bus_sched[i]->thread, NULL, snr_bus_worker,
+        (void*) g_bus_sched[i]) < 0) {
+      syslog(LOG_WARNING, "pthread_create for Sensors on bus 0x%X failed\n",
+          g_bus_sched[i]->bus);
 #ifdef DEBUG
-      } else {
-        syslog(LOG_WARNING, "pthread_create for discrete sensors for FRU %d succeed\n", fru);
+    } else {
+      syslog(LOG_WARNING, "pthread_create for Sensors on bus 0x%X succeed\n",
+          g_bus_sched[i]->bus);
 #endif /* DEBUG */
-      }
-      sleep(1);
     }
   }
 
@@ -552,16 +904,8 @@ run_sensord(int argc, char **argv) {
 
   pthread_join(sensor_health, NULL);
 
-  for (fru = 1; fru <= MAX_NUM_FRUS; fru++) {
-
-    if (GETBIT(fru_flag, fru))
-      pthread_join(discrete_snr[fru-1], NULL);
-  }
-
-  for (fru = 1; fru <= MAX_NUM_FRUS; fru++) {
-
-    if (GETBIT(fru_flag, fru))
-      pthread_join(thread_snr[fru-1], NULL);
+  for (i = 0; i < g_bus_cnt; i++) {
+    pthread_join(g_bus_sched[i]->thread, NULL);
   }
 }
 
@@ -27,8 +27,11 @@
 #include <string.h>
 #include <errno.h>
 #include <stdbool.h>
+#include <time.h>
 #include <openbmc/pal.h>
 #include <openbmc/sdr.h>
+#include <openbmc/sensor_history.h>
+#include <openbmc/sensor_stats.h>
 
 #define STATUS_OK   "ok"
 #define STATUS_NS   "ns"
@@ -43,6 +46,9 @@ static int
 print_usage() {
   printf("Usage: sensor-util [ %s ] <--threshold> <sensor num>\n",
       pal_fru_list);
+  printf("       sensor-util [ %s ] --history <sensor num> [--since T]\n",
+      pal_fru_list);
+  printf("       sensor-util <[ %s ]> --stats\n", pal_fru_list);
 }
 
 static void
@@ -128,6 +134,151 @@ get_sensor_reading(uint8_t fru, uint8_t *sensor_list, int sensor_cnt, int num,
   }
 }
 
+static void
+print_history_rollup(const char *label, snr_hist_rollup_t *ring, int cnt,
+    uint32_t head, uint32_t since) {
+
+  uint32_t i;
+  snr_hist_rollup_t *r;
+
+  printf("%s:\n", label);
+  i = (head > cnt) ? head - cnt : 0;
+  for (; i < head; i++) {
+    r = &ring[i % cnt];
+    if (r->count == 0 || r->ts < since)
+      continue;
+    printf("  %u : min %.2f | max %.2f | avg %.2f | (%u samples)\n",
+        r->ts, r->min, r->max, r->sum / r->count, r->count);
+  }
+}
+
+static int
+get_sensor_history(uint8_t fru, uint8_t snr_num, uint32_t since) {
+
+  uint32_t i;
+  uint32_t now;
+  snr_hist_sample_t *sample;
+  snr_hist_track_t *track;
+  thresh_sensor_t thresh;
+
+  /* A track is over 9KB, keep it off the stack */
+  track = malloc(sizeof(snr_hist_track_t));
+  if (track == NULL)
+    return -1;
+
+  if (sensor_history_get(fru, snr_num, track) < 0) {
+    printf("No history for sensor 0x%X\n", snr_num);
+    free(track);
+    return -1;
+  }
+
+  memset(&thresh, 0, sizeof(thresh));
+  sdr_get_snr_thresh(fru, snr_num, &thresh);
+
+  now = (uint32_t) time(NULL);
+  since = (since && since < now) ? now - since : 0;
+
+  printf("%-18s (0x%X) %s\n", thresh.name, snr_num, thresh.units);
+
+  printf("raw samples:\n");
+  i = (track->raw_head > SNR_HIST_RAW_CNT) ?
+      track->raw_head - SNR_HIST_RAW_CNT : 0;
+  for (; i < track->raw_head; i++) {
+    sample = &track->raw[i % SNR_HIST_RAW_CNT];
+    if (sample->ts < since)
+      continue;
+    printf("  %u : %.2f\n", sample->ts, sample->value);
+  }
+
+  print_history_rollup("1-minute rollups", track->min, SNR_HIST_MIN_CNT,
+      track->min_head, since);
+  print_history_rollup("1-hour rollups", track->hour, SNR_HIST_HOUR_CNT,
+      track->hour_head, since);
+
+  free(track);
+  return 0;
+}
+
+static void
+print_stats_cnt(snr_stats_cnt_t *cnt) {
+
+  printf("reads: %u | fails: %u | retries: %u | hits: %u | shared: %u"
+      " | read avg: %u ms p50: <%u ms p99: <%u ms max: %u ms"
+      " | cached age p50: <%u ms p99: <%u ms",
+      cnt->reads, cnt->fails, cnt->retries, cnt->hits, cnt->shared,
+      cnt->reads ? cnt->read_total_ms / cnt->reads : 0,
+      sensor_stats_percentile(cnt->read_hist, 50),
+      sensor_stats_percentile(cnt->read_hist, 99), cnt->read_max_ms,
+      sensor_stats_percentile(cnt->age_hist, 50),
+      sensor_stats_percentile(cnt->age_hist, 99));
+}
+
+static void
+get_sensor_stats(snr_stats_t *stats, uint8_t fru) {
+
+  int num;
+  struct timespec ts;
+  uint64_t now;
+  char name[32];
+  snr_stats_cnt_t *cnt;
+  snr_cache_entry_t entry;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  now = (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+
+  for (num = 0; num <= MAX_SENSOR_NUM; num++) {
+    cnt = &stats->snr[fru][num];
+    if (cnt->reads == 0 && cnt->hits == 0 && cnt->shared == 0)
+      continue;
+
+    memset(name, 0, sizeof(name));
+    pal_get_sensor_name(fru, num, name);
+
+    printf("%-18s (0x%X) : ", name, num);
+    if (stats->xport[fru][num])
+      printf("bus 0x%X | ", stats->xport[fru][num] - 1);
+    print_stats_cnt(cnt);
+    if (!sensor_cache_get(fru, num, &entry) && (entry.status & SNR_CACHE_VALID))
+      printf(" | age: %llu ms\n", (unsigned long long) (now - entry.mono_ms));
+    else
+      printf(" | age: NA\n");
+  }
+}
+
+static int
+get_pipeline_stats(uint8_t fru) {
+
+  int bus;
+  snr_stats_t *stats;
+
+  stats = sensor_stats_map();
+  if (stats == NULL) {
+    printf("No sensor stats available\n");
+    return -1;
+  }
+
+  if (fru) {
+    get_sensor_stats(stats, fru);
+    return 0;
+  }
+
+  for (bus = 0; bus < SNR_STATS_MAX_XPORT; bus++) {
+    if (stats->bus[bus].reads == 0 && stats->bus[bus].hits == 0 &&
+        stats->bus[bus].shared == 0)
+      continue;
+    printf("bus 0x%-2X : ", bus);
+    print_stats_cnt(&stats->bus[bus]);
+    printf("\n");
+  }
+
+  for (fru = 1; fru <= MAX_NUM_FRUS; fru++) {
+    printf("\n");
+    get_sensor_stats(stats, fru);
+  }
+
+  return 0;
+}
+
 int
 main(int argc, char **argv) {
 
@@ -139,23 +290,36 @@ main(int argc, char **argv) {
   uint8_t fru;
   uint8_t num = 0;
   bool threshold = false;
+  bool history = false;
+  bool stats = false;
+  uint32_t since = 0;
 
-  if (argc < 2 || argc > 4) {
+  if (argc < 2 || argc > 6) {
     print_usage();
     exit(-1);
   }
 
+  if (!strcmp(argv[1], "--stats"))
+    return get_pipeline_stats(0);
+
   i = 3; /* Starting at argument 3*/
   while (argc > 2 && i <= argc) {
+    errno = 0;
     if (!(strcmp(argv[i-1], "--threshold"))) {
       threshold = true;
+    } else if (!(strcmp(argv[i-1], "--history")) && i < argc) {
+      history = true;
+      num = (uint8_t) strtol(argv[i++], NULL, 0);
+    } else if (!(strcmp(argv[i-1], "--stats"))) {
+      stats = true;
+    } else if (!(strcmp(argv[i-1], "--since")) && i < argc) {
+      since = (uint32_t) strtoul(argv[i++], NULL, 0);
     } else {
-      errno = 0;
       num = (uint8_t) strtol(argv[i-1], NULL, 0);
-      if (errno) {
-        print_usage();
-        exit(-1);
-      }
+    }
+    if (errno) {
+      print_usage();
+      exit(-1);
     }
     i++;
   }
@@ -167,6 +331,17 @@ main(int argc, char **argv) {
     return ret;
   }
 
+  if (stats)
+    return get_pipeline_stats(fru);
+
+  if (history) {
+    if (fru == 0 || threshold) {
+      print_usage();
+      exit(-1);
+    }
+    return get_sensor_history(fru, num, since);
+  }
+
   if (fru == 0) {
     fru = 1;
     while (fru <= MAX_NUM_FRUS) {
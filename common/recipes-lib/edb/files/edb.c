@@ -19,141 +19,712 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <syslog.h>
 #include <string.h>
+#include <pthread.h>
 #include <sys/file.h>
+#include <sys/inotify.h>
 #include "unqlite.h"
 #include "edb.h"
 
 #define MAX_BUF 80
 
+#define EDB_BUSY_WARN 1000   /* retries 1 ms apart before logging it */
+
+/*
+ * Per-process handle of a database. Writers of all processes serialize on
+ * flock() of the lock file, which stays open for the life of the process;
+ * the threads of a process share that flock() and take the mutex first.
+ *
+ * A batch holds the flock() from begin to commit and reads and writes
+ * through one unqlite connection. The connection is not kept past the
+ * batch: unqlite holds a shared lock on the file from open to close, and
+ * no other process could commit meanwhile.
+ *
+ * The sets of a batch are also kept in memory. unqlite can not retry a
+ * commit that found readers in the way (UNQLITE_BUSY), so the whole
+ * transaction is replayed instead, as edb_set() always did.
+ */
+typedef struct {
+  char *key;
+  char value[MAX_BUF];
+} edb_pending_t;
+
+typedef struct {
+  const char *path;
+  const char *lock_path;
+  int lock_fd;
+  unqlite *db;              /* connection of the batch in progress */
+  edb_pending_t *pending;   /* sets of the batch in progress */
+  int npending;
+  int max_pending;
+  int depth;                /* nesting of edb_*_begin() */
+  pthread_t owner;          /* thread running the batch */
+  pthread_mutex_t mutex;    /* held by the owner for the whole batch */
+} edb_handle_t;
+
+static edb_handle_t g_cache = {
+  EDB_CACHE_PATH, CACHE_LOCK_PATH, -1, NULL, NULL, 0, 0, 0, 0,
+  PTHREAD_MUTEX_INITIALIZER
+};
+static edb_handle_t g_flash = {
+  EDB_FLASH_PATH, FLASH_LOCK_PATH, -1, NULL, NULL, 0, 0, 0, 0,
+  PTHREAD_MUTEX_INITIALIZER
+};
+
+static int
+edb_in_batch(edb_handle_t *h) {
+  return h->depth && pthread_equal(h->owner, pthread_self());
+}
+
+static void
+edb_pending_clear(edb_handle_t *h) {
+  int i;
+
+  for (i = 0; i < h->npending; i++) {
+    free(h->pending[i].key);
+  }
+  h->npending = 0;
+}
+
+/*
+ * Fork with the mutexes held, so the child gets the handles unchanged. A
+ * thread forking in its own batch already holds that mutex.
+ */
+static void
+edb_atfork_prepare(void) {
+  if (!edb_in_batch(&g_cache)) {
+    pthread_mutex_lock(&g_cache.mutex);
+  }
+  if (!edb_in_batch(&g_flash)) {
+    pthread_mutex_lock(&g_flash.mutex);
+  }
+}
+
+static void
+edb_atfork_parent(void) {
+  if (!edb_in_batch(&g_flash)) {
+    pthread_mutex_unlock(&g_flash.mutex);
+  }
+  if (!edb_in_batch(&g_cache)) {
+    pthread_mutex_unlock(&g_cache.mutex);
+  }
+}
+
+/*
+ * A forked child must neither share the parent's flock() nor its batch.
+ * The connection of a batch is left alone: closing it would roll back the
+ * parent's transaction.
+ */
+static void
+edb_atfork_child(void) {
+  edb_handle_t *h[] = { &g_cache, &g_flash };
+  int i;
+
+  for (i = 0; i < sizeof(h) / sizeof(h[0]); i++) {
+    if (h[i]->lock_fd >= 0) {
+      close(h[i]->lock_fd);
+      h[i]->lock_fd = -1;
+    }
+    h[i]->db = NULL;
+    edb_pending_clear(h[i]);
+    h[i]->depth = 0;
+    pthread_mutex_init(&h[i]->mutex, NULL);
+  }
+}
+
+static void
+edb_atfork_init(void) {
+  pthread_atfork(edb_atfork_prepare, edb_atfork_parent, edb_atfork_child);
+}
+
+static edb_pending_t *
+edb_pending_find(edb_handle_t *h, char *key) {
+  int i;
+
+  for (i = 0; i < h->npending; i++) {
+    if (!strcmp(h->pending[i].key, key)) {
+      return &h->pending[i];
+    }
+  }
+
+  return NULL;
+}
+
 static int
-edb_set(char *path, char *key, char *value) {
-  unqlite *pDb;               /* Database handle */
+edb_pending_add(edb_handle_t *h, char *key, char *value) {
+  edb_pending_t *p;
+
+  p = edb_pending_find(h, key);
+  if (p == NULL) {
+    if (h->npending == h->max_pending) {
+      p = realloc(h->pending, (h->max_pending + 16) * sizeof(edb_pending_t));
+      if (p == NULL) {
+        return -1;
+      }
+      h->pending = p;
+      h->max_pending += 16;
+    }
+
+    p = &h->pending[h->npending];
+    p->key = strdup(key);
+    if (p->key == NULL) {
+      return -1;
+    }
+    h->npending++;
+  }
+
+  memset(p->value, 0, MAX_BUF);
+  strncpy(p->value, value, MAX_BUF);
+
+  return 0;
+}
+
+static int
+edb_lock(edb_handle_t *h) {
+  if (h->lock_fd < 0) {
+    h->lock_fd = open(h->lock_path, O_RDWR | O_CREAT, 0666);
+    if (h->lock_fd < 0) {
+#ifdef DEBUG
+      syslog(LOG_WARNING, "edb_lock: failed to open %s", h->lock_path);
+#endif
+      return -1;
+    }
+  }
+
+  while (flock(h->lock_fd, LOCK_EX) < 0) {
+    if (errno != EINTR) {
+#ifdef DEBUG
+      syslog(LOG_WARNING, "edb_lock: failed to flock %s, err %d",
+             h->lock_path, errno);
+#endif
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static void
+edb_unlock(edb_handle_t *h) {
+  if (flock(h->lock_fd, LOCK_UN) < 0) {
+#ifdef DEBUG
+    syslog(LOG_WARNING, "edb_unlock: failed to unlock %s", h->lock_path);
+#endif
+  }
+}
+
+// The connection of the batch, opened on first use
+static unqlite *
+edb_db(edb_handle_t *h) {
   int rc;
 
-  /* Open our database */
-  while (1) {
-    rc = unqlite_open(&pDb, path, UNQLITE_OPEN_CREATE);
-    if( rc != UNQLITE_OK ){
+  if (h->db == NULL) {
+    rc = unqlite_open(&h->db, h->path, UNQLITE_OPEN_CREATE);
+    if (rc != UNQLITE_OK) {
       syslog(LOG_WARNING, "db_set: unqlite_open failed with rc: %d\n", rc);
-      rc = -1;
+      h->db = NULL;
+    }
+  }
+
+  return h->db;
+}
+
+// Store the sets of the batch in one transaction
+static int
+edb_store(edb_handle_t *h) {
+  int rc = UNQLITE_OK;
+  int retry, i;
+
+  if (h->npending == 0) {
+    return 0;
+  }
+
+  // Readers are in the way only briefly: retry until they are done, as
+  // edb_set() always did, rather than drop the write
+  for (retry = 0; ; retry++) {
+    if (edb_db(h) == NULL) {
+      return -1;
+    }
+
+    for (i = 0; i < h->npending && rc == UNQLITE_OK; i++) {
+      rc = unqlite_kv_store(h->db, h->pending[i].key, -1, h->pending[i].value,
+                            MAX_BUF);
+    }
+    if (rc == UNQLITE_OK) {
+      rc = unqlite_commit(h->db);
+    }
+    if (rc != UNQLITE_OK) {
+      unqlite_rollback(h->db);
+    }
+
+    if (rc != UNQLITE_BUSY) {
       break;
     }
-    rc = unqlite_kv_store(pDb, key, -1, value, MAX_BUF);
-    if( rc != UNQLITE_OK ){
-      if( rc != UNQLITE_BUSY ){
+    unqlite_close(h->db);
+    h->db = NULL;
+    rc = UNQLITE_OK;
+    if (retry == EDB_BUSY_WARN) {
+      syslog(LOG_WARNING, "db_set: %s still busy, retrying", h->path);
+    }
+    usleep(1000);
+  }
+
+  if (rc != UNQLITE_OK) {
 #ifdef DEBUG
-        syslog(LOG_WARNING, "db_set: unqlite_kv_store failed with rc: %d\n", rc);
+    syslog(LOG_WARNING, "db_set: unqlite_kv_store failed with rc: %d\n", rc);
 #endif
-        rc = -1;
-        break;
-      } else {
-        unqlite_close(pDb);
-        continue;
-      }
-   } else {
-   /* Auto-commit the transaction and close our database */
-    rc = 0;
-    break;
-   }
- }
-  unqlite_close(pDb);
+    return -1;
+  }
+
+  // Wake the subscribers through an inotify event on the lock file
+  if (pwrite(h->lock_fd, "", 1, 0) != 1) {
+#ifdef DEBUG
+    syslog(LOG_WARNING, "db_set: failed to notify %s", h->lock_path);
+#endif
+  }
+
+  return 0;
+}
+
+// Start a batch of the calling thread; batches nest
+static int
+edb_begin(edb_handle_t *h) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+  if (edb_in_batch(h)) {
+    h->depth++;
+    return 0;
+  }
+
+  pthread_once(&once, edb_atfork_init);
+
+  pthread_mutex_lock(&h->mutex);
+  if (edb_lock(h)) {
+    pthread_mutex_unlock(&h->mutex);
+    return -1;
+  }
+  h->owner = pthread_self();
+  h->depth = 1;
+
+  return 0;
+}
+
+// End a batch, publishing all of its sets at once
+static int
+edb_commit(edb_handle_t *h) {
+  int rc;
+
+  if (!edb_in_batch(h)) {
+    return -1;
+  }
+
+  if (--h->depth) {
+    return 0;
+  }
+
+  rc = edb_store(h);
+  if (h->db != NULL) {
+    unqlite_close(h->db);
+    h->db = NULL;
+  }
+  edb_pending_clear(h);
+  edb_unlock(h);
+  pthread_mutex_unlock(&h->mutex);
+
   return rc;
 }
 
 static int
-edb_get(char *path, char *key, char *value) {
+edb_set(edb_handle_t *h, char *key, char *value) {
   int rc;
+
+  if (edb_begin(h)) {
+    return -1;
+  }
+  rc = edb_pending_add(h, key, value);
+  if (edb_commit(h)) {
+    rc = -1;
+  }
+
+  return rc;
+}
+
+// Get inside a batch: its own sets first, then its connection
+static int
+edb_batch_get(edb_handle_t *h, char *key, char *value) {
+  edb_pending_t *p;
+  unqlite_int64 nBytes;
+  int rc;
+
+  p = edb_pending_find(h, key);
+  if (p != NULL) {
+    memcpy(value, p->value, MAX_BUF);
+    return 0;
+  }
+
+  if (edb_db(h) == NULL) {
+    return -1;
+  }
+
+  nBytes = MAX_BUF;
+  rc = unqlite_kv_fetch(h->db, key, -1, value, &nBytes);
+  if (rc != UNQLITE_OK) {
+#ifdef DEBUG
+    syslog(LOG_WARNING, "db_get: unqlite_key_fetch returns %d\n", rc);
+#endif
+    return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Sets of count keys in one transaction. status[i] is 0 or -1 for
+ * keys[i]; returns -1 if any of them failed.
+ */
+static int
+edb_set_many(edb_handle_t *h, char **keys, char **values, int *status,
+             int count) {
+  int i, rc = 0;
+
+  if (edb_begin(h)) {
+    for (i = 0; i < count; i++) {
+      status[i] = -1;
+    }
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    status[i] = edb_pending_add(h, keys[i], values[i]);
+    if (status[i]) {
+      rc = -1;
+    }
+  }
+
+  if (edb_commit(h)) {
+    for (i = 0; i < count; i++) {
+      status[i] = -1;
+    }
+    rc = -1;
+  }
+
+  return rc;
+}
+
+/*
+ * Gets of count keys with one open of the database, which also makes them
+ * one snapshot. Each value needs MAX_BUF bytes; status[i] is 0, or -1 if
+ * keys[i] is not found. Returns -1 if any of them failed.
+ */
+static int
+edb_get_many(edb_handle_t *h, char **keys, char **values, int *status,
+             int count) {
+  int rc, i, ret;
   unqlite *pDb;
-  size_t nBytes;      //Data length
-  char zBuf[MAX_BUF] = {0};
+  unqlite_int64 nBytes;      //Data length
+
+  if (edb_in_batch(h)) {
+    ret = 0;
+    for (i = 0; i < count; i++) {
+      status[i] = edb_batch_get(h, keys[i], values[i]);
+      if (status[i]) {
+        ret = -1;
+      }
+    }
+    return ret;
+  }
 
   while (1) {
-    // Open our database;
-    rc = unqlite_open(&pDb, path, UNQLITE_OPEN_READONLY|UNQLITE_OPEN_MMAP);
+    // Open our database. Not UNQLITE_OPEN_MMAP: mapping the file closes
+    // an fd of it, which drops our shared lock and lets a commit change
+    // the pages under the read.
+    rc = unqlite_open(&pDb, h->path, UNQLITE_OPEN_READONLY);
     if( rc != UNQLITE_OK ) {
       syslog(LOG_WARNING, "db_get: unqlite_open fails with rc: %d\n", rc);
       unqlite_close(pDb);
+      for (i = 0; i < count; i++) {
+        status[i] = -1;
+      }
       return -1;
     }
 
-    //Extract record content
-    nBytes = MAX_BUF;
-    memset(zBuf, 0, MAX_BUF);
-    rc = unqlite_kv_fetch(pDb, key, -1, value, &nBytes);
-    if( rc != UNQLITE_OK ){
-      if (rc == UNQLITE_NOTFOUND) {
+    ret = 0;
+    for (i = 0; i < count; i++) {
+      //Extract record content
+      nBytes = MAX_BUF;
+      rc = unqlite_kv_fetch(pDb, keys[i], -1, values[i], &nBytes);
+      if (rc == UNQLITE_OK) {
+        status[i] = 0;
+      } else if (rc == UNQLITE_NOTFOUND) {
 #ifdef DEBUG
         syslog(LOG_WARNING, "db_get: can not find the key\n");
 #endif
-        unqlite_close(pDb);
-        return -1;
+        status[i] = -1;
+        ret = -1;
       } else {
-#ifdef DEBUG
-        syslog(LOG_WARNING, "db_get: unqlite_key_fetch returns %d\n", rc);
-#endif
-        /* Auto-commit the transaction and close our database */
-        unqlite_close(pDb);
-        continue;
+        break;
       }
-    } else {
-      /* Auto-commit the transaction and close our database */
-      unqlite_close(pDb);
-      return 0;
     }
+
+    /* Auto-commit the transaction and close our database */
+    unqlite_close(pDb);
+
+    if (i == count) {
+      return ret;
+    }
+
+#ifdef DEBUG
+    syslog(LOG_WARNING, "db_get: unqlite_key_fetch returns %d\n", rc);
+#endif
   }
 
   return 0;
 }
 
-int
-edb_cache_set(char *key, char *value) {
-  int rc;
-  FILE *fp;
+static int
+edb_get(edb_handle_t *h, char *key, char *value) {
+  int status;
 
-  fp = fopen(CACHE_LOCK_PATH, "w");
-  if (!fp) {
-#ifdef DEBUG
-     syslog(LOG_WARNING, "edb_set: failed to open lock file");
-#endif
-     return -1;
+  return edb_get_many(h, &key, &value, &status, 1);
+}
+
+/*
+ * Subscription of this process to some keys of a database. Every commit
+ * touches the lock file, and edb_changed() compares the keys' values with
+ * the ones seen last.
+ */
+typedef struct edb_sub {
+  struct edb_sub *next;
+  int fd;
+  edb_handle_t *h;
+  int count;
+  char **keys;
+  char **values;
+  int *status;
+} edb_sub_t;
+
+static edb_sub_t *g_subs = NULL;
+static pthread_mutex_t m_subs = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+edb_sub_free(edb_sub_t *sub) {
+  int i;
+
+  for (i = 0; i < sub->count; i++) {
+    free(sub->keys[i]);
   }
+  free(sub->keys);
+  free(sub->values);
+  free(sub->status);
+  free(sub);
+}
 
-  rc = flock(fileno(fp), LOCK_EX);
-  if (rc < 0) {
-#ifdef DEBUG
-    syslog(LOG_WARNING, "edb_cache_set: failed to flock on lock file, err %d",rc);
-#endif
-    fclose(fp);
-    return rc;
+static int
+edb_subscribe(edb_handle_t *h, char **keys, int count) {
+  edb_sub_t *sub;
+  int fd, i;
+
+  sub = calloc(1, sizeof(edb_sub_t));
+  if (sub == NULL) {
+    return -1;
+  }
+  sub->h = h;
+  sub->keys = calloc(count, sizeof(char *));
+  sub->values = calloc(count, sizeof(char *) + MAX_BUF);
+  sub->status = calloc(count, sizeof(int));
+  if (sub->keys == NULL || sub->values == NULL || sub->status == NULL) {
+    edb_sub_free(sub);
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    sub->values[i] = (char *) (sub->values + count) + i * MAX_BUF;
+    sub->keys[i] = strdup(keys[i]);
+    if (sub->keys[i] == NULL) {
+      edb_sub_free(sub);
+      return -1;
+    }
+    sub->count++;
   }
 
-  rc = edb_set(EDB_CACHE_PATH, key, value);
+  // The lock file may not exist before the first set
+  fd = open(h->lock_path, O_RDWR | O_CREAT, 0666);
+  if (fd >= 0) {
+    close(fd);
+  }
 
-  if ( flock(fileno(fp), LOCK_UN) < 0 ) {
+  sub->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (sub->fd < 0 || inotify_add_watch(sub->fd, h->lock_path, IN_MODIFY) < 0) {
 #ifdef DEBUG
-     syslog(LOG_WARNING, "edb_cache_set: failed to unlock flock on lock file");
+    syslog(LOG_WARNING, "edb_subscribe: failed to watch %s", h->lock_path);
 #endif
-     fclose(fp);
-     return -1;
+    if (sub->fd >= 0) {
+      close(sub->fd);
+    }
+    edb_sub_free(sub);
+    return -1;
   }
-  fclose(fp);
+
+  // Values are read after the watch is set, so no change is missed
+  edb_get_many(h, sub->keys, sub->values, sub->status, count);
+
+  pthread_mutex_lock(&m_subs);
+  sub->next = g_subs;
+  g_subs = sub;
+  pthread_mutex_unlock(&m_subs);
+
+  return sub->fd;
+}
+
+/*
+ * 1 if a key of the subscription changed since edb_*_subscribe() or the
+ * last call, 0 if not, -1 if fd is not a subscription. Drains the fd.
+ */
+int
+edb_changed(int fd) {
+  char buf[256];
+  char *values, **pvalues;
+  int *status;
+  edb_sub_t *sub;
+  int i, rc = -1;
+
+  while (read(fd, buf, sizeof(buf)) > 0);
+
+  pthread_mutex_lock(&m_subs);
+  for (sub = g_subs; sub != NULL; sub = sub->next) {
+    if (sub->fd == fd) {
+      break;
+    }
+  }
+
+  if (sub != NULL) {
+    values = calloc(sub->count, MAX_BUF);
+    pvalues = calloc(sub->count, sizeof(char *));
+    status = calloc(sub->count, sizeof(int));
+    if (values != NULL && pvalues != NULL && status != NULL) {
+      // One snapshot of all the keys
+      for (i = 0; i < sub->count; i++) {
+        pvalues[i] = values + i * MAX_BUF;
+      }
+      edb_get_many(sub->h, sub->keys, pvalues, status, sub->count);
+
+      rc = 0;
+      for (i = 0; i < sub->count; i++) {
+        if (status[i] != sub->status[i] ||
+            (status[i] == 0 && memcmp(pvalues[i], sub->values[i], MAX_BUF))) {
+          sub->status[i] = status[i];
+          memcpy(sub->values[i], pvalues[i], MAX_BUF);
+          rc = 1;
+        }
+      }
+    }
+    free(values);
+    free(pvalues);
+    free(status);
+  }
+  pthread_mutex_unlock(&m_subs);
+
   return rc;
 }
 
+int
+edb_unsubscribe(int fd) {
+  edb_sub_t **p;
+  edb_sub_t *sub;
+
+  pthread_mutex_lock(&m_subs);
+  for (p = &g_subs; *p != NULL; p = &(*p)->next) {
+    if ((*p)->fd == fd) {
+      break;
+    }
+  }
+
+  sub = *p;
+  if (sub != NULL) {
+    *p = sub->next;
+  }
+  pthread_mutex_unlock(&m_subs);
+
+  if (sub == NULL) {
+    return -1;
+  }
+
+  close(sub->fd);
+  edb_sub_free(sub);
+
+  return 0;
+}
+
+int
+edb_cache_set(char *key, char *value) {
+  return edb_set(&g_cache, key, value);
+}
+
 int
 edb_cache_get(char *key, char *value) {
-  return edb_get(EDB_CACHE_PATH, key, value);
+  return edb_get(&g_cache, key, value);
 }
 
 int
 edb_flash_set(char *key, char *value) {
-  return edb_set(EDB_FLASH_PATH, key, value);
+  return edb_set(&g_flash, key, value);
 }
+
 int
 edb_flash_get(char *key, char *value) {
-  return edb_get(EDB_FLASH_PATH, key, value);
+  return edb_get(&g_flash, key, value);
+}
+
+int
+edb_cache_set_many(char **keys, char **values, int *status, int count) {
+  return edb_set_many(&g_cache, keys, values, status, count);
+}
+
+int
+edb_cache_get_many(char **keys, char **values, int *status, int count) {
+  return edb_get_many(&g_cache, keys, values, status, count);
+}
+
+int
+edb_cache_subscribe(char **keys, int count) {
+  return edb_subscribe(&g_cache, keys, count);
+}
+
+int
+edb_flash_set_many(char **keys, char **values, int *status, int count) {
+  return edb_set_many(&g_flash, keys, values, status, count);
+}
+
+int
+edb_flash_get_many(char **keys, char **values, int *status, int count) {
+  return edb_get_many(&g_flash, keys, values, status, count);
+}
+
+int
+edb_flash_subscribe(char **keys, int count) {
+  return edb_subscribe(&g_flash, keys, count);
+}
+
+int
+edb_cache_begin(void) {
+  return edb_begin(&g_cache);
+}
+
+int
+edb_cache_commit(void) {
+  return edb_commit(&g_cache);
+}
+
+int
+edb_flash_begin(void) {
+  return edb_begin(&g_flash);
+}
+
+int
+edb_flash_commit(void) {
+  return edb_commit(&g_flash);
 }
@@ -33,6 +33,33 @@ int edb_cache_set(char* key, char *value);
 int edb_flash_get(char* key, char *value);
 int edb_flash_set(char* key, char *value);
 
+// Get or set count keys at once, with the result of each in status[]
+int edb_cache_get_many(char **keys, char **values, int *status, int count);
+int edb_cache_set_many(char **keys, char **values, int *status, int count);
+int edb_flash_get_many(char **keys, char **values, int *status, int count);
+int edb_flash_set_many(char **keys, char **values, int *status, int count);
+
+/*
+ * Change notification: edb_*_subscribe() returns an fd to poll() for
+ * POLLIN, then edb_changed() is 1 if one of the keys changed since the
+ * last call.
+ */
+int edb_cache_subscribe(char **keys, int count);
+int edb_flash_subscribe(char **keys, int count);
+int edb_changed(int fd);
+int edb_unsubscribe(int fd);
+
+/*
+ * Batch the gets and sets of this thread until the matching commit: one
+ * lock, one open of the database and one transaction. Other writers wait
+ * for the commit, so the gets of a batch see one snapshot, and readers see
+ * all of its sets or none. Batches nest.
+ */
+int edb_cache_begin(void);
+int edb_cache_commit(void);
+int edb_flash_begin(void);
+int edb_flash_commit(void);
+
 #ifdef __cplusplus
 }
 #endif
@@ -56740,13 +56740,13 @@ static int pager_shared_lock(Pager *pPager)
 				/* Rollback any hot journal */
 				rc = pager_journal_rollback(pPager,1);
 				if( rc != UNQLITE_OK ){
-					return rc;
+					goto fail;
 				}
 			}
 			/* Read the database header */
 			rc = pager_read_db_header(pPager);
 			if( rc != UNQLITE_OK ){
-				return rc;
+				goto fail;
 			}
 			if(pPager->dbSize > 0 ){
 				if( pPager->iOpenFlags & UNQLITE_OPEN_MMAP ){
@@ -56778,16 +56778,26 @@ static int pager_shared_lock(Pager *pPager)
 						"xOpen() method of the underlying KV engine '%z' failed",
 						&pPager->sKv
 						);
-					pager_unlock_db(pPager,NO_LOCK);
 					pPager->iState = PAGER_OPEN;
-					return rc;
+					goto fail;
 				}
 			}
-		}else if( rc == UNQLITE_BUSY ){
-			unqliteGenError(pPager->pDb,"Another process or thread have a reserved or exclusive lock on this database");
-		}		
+		}else{
+			if( rc == UNQLITE_BUSY ){
+				unqliteGenError(pPager->pDb,"Another process or thread have a reserved or exclusive lock on this database");
+			}
+			goto fail;
+		}
 	}
 	return rc;
+fail:
+	/* Still in PAGER_OPEN state: release the file and its lock, or every
+	 * failed attempt would leak them since the next one opens it again.
+	 */
+	pager_unlock_db(pPager,NO_LOCK);
+	unqliteOsCloseFree(pPager->pAllocator,pPager->pfd);
+	pPager->pfd = 0;
+	return rc;
 }
 /*
 ** Begin a write-transaction on the specified pager object. If a 
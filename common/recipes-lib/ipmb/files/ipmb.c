@@ -23,77 +23,353 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdint.h>
+#include <stdbool.h>
 #include <errno.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <time.h>
+#include <poll.h>
+#include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include "ipmb.h"
 
+#define MAX_IPMB_BUS 256
+
+// Caller of lib_ipmb_handle() waiting for the response with its tag
+typedef struct _ipmb_waiter_t {
+  struct _ipmb_waiter_t *next;
+  uint32_t tag;
+  bool done;
+  unsigned char *res;
+  unsigned char res_len;
+} ipmb_waiter_t;
+
+// Connection of this process to the ipmbd of one bus
+typedef struct _ipmb_conn_t {
+  int sock;
+  uint32_t next_tag;
+  bool reading;       // one waiter at a time reads the socket for all
+  ipmb_waiter_t *waiters;
+  pthread_cond_t cond;
+} ipmb_conn_t;
+
+static ipmb_conn_t *g_conn[MAX_IPMB_BUS] = {0};
+static pthread_mutex_t m_conn = PTHREAD_MUTEX_INITIALIZER;
+static pthread_once_t conn_once = PTHREAD_ONCE_INIT;
+
+static uint64_t
+ipmb_mono_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static void
+conn_cond_init(pthread_cond_t *cond) {
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+// Keep the connections consistent across fork()
+static void
+conn_atfork_prepare(void) {
+  pthread_mutex_lock(&m_conn);
+}
+
+static void
+conn_atfork_parent(void) {
+  pthread_mutex_unlock(&m_conn);
+}
+
 /*
- * Function to handle IPMB messages
+ * The sockets belong to the parent's sessions and the waiters to the
+ * parent's threads: the child starts over with no connection.
  */
-void
-lib_ipmb_handle(unsigned char bus_id,
-            unsigned char *request, unsigned char req_len,
-            unsigned char *response, unsigned char *res_len) {
+static void
+conn_atfork_child(void) {
+  ipmb_conn_t *conn;
+  int i;
+
+  for (i = 0; i < MAX_IPMB_BUS; i++) {
+    conn = g_conn[i];
+    if (conn == NULL)
+      continue;
+    if (conn->sock >= 0)
+      close(conn->sock);
+    conn->sock = -1;
+    conn->reading = false;
+    conn->waiters = NULL;
+    conn_cond_init(&conn->cond);
+  }
+
+  pthread_mutex_unlock(&m_conn);
+}
+
+static void
+conn_atfork_init(void) {
+  pthread_atfork(conn_atfork_prepare, conn_atfork_parent, conn_atfork_child);
+}
 
-  int s, t, len;
+static ipmb_conn_t *
+conn_get(unsigned char bus_id) {
+  ipmb_conn_t *conn = g_conn[bus_id];
+
+  if (conn)
+    return conn;
+
+  conn = (ipmb_conn_t *) calloc(1, sizeof(ipmb_conn_t));
+  if (conn == NULL)
+    return NULL;
+
+  conn->sock = -1;
+  conn_cond_init(&conn->cond);
+
+  g_conn[bus_id] = conn;
+  return conn;
+}
+
+/*
+ * Drop the connection and fail every request still waiting on it. While
+ * a waiter is reading the socket, only shut it down: the reader wakes up
+ * and closes it, so the fd can't be reused under its recv().
+ */
+static void
+conn_close(ipmb_conn_t *conn) {
+  ipmb_waiter_t *w;
+
+  if (conn->sock >= 0) {
+    if (conn->reading)
+      shutdown(conn->sock, SHUT_RDWR);
+    else
+      close(conn->sock);
+  }
+  conn->sock = -1;
+
+  for (w = conn->waiters; w; w = w->next)
+    w->done = true;
+
+  pthread_cond_broadcast(&conn->cond);
+}
+
+static int
+conn_open(ipmb_conn_t *conn, unsigned char bus_id) {
+  int s, len;
   struct sockaddr_un remote;
-  char sock_path[64] = {0};
-  struct timeval tv;
 
-  sprintf(sock_path, "%s_%d", SOCK_PATH_IPMB, bus_id);
+  if (conn->sock >= 0)
+    return 0;
 
-  // TODO: Need to update to reuse the socket instead of creating new
   if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
 #ifdef DEBUG
     syslog(LOG_WARNING, "lib_ipmb_handle: socket() failed\n");
 #endif
-    return;
+    return -1;
   }
 
-  // setup timeout for receving on socket
-  tv.tv_sec = TIMEOUT_IPMB + 1;
-  tv.tv_usec = 0;
-
-  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv,sizeof(struct timeval));
-
   remote.sun_family = AF_UNIX;
-  strcpy(remote.sun_path, sock_path);
+  sprintf(remote.sun_path, "%s_%d", SOCK_PATH_IPMB, bus_id);
   len = strlen(remote.sun_path) + sizeof(remote.sun_family);
 
   if (connect(s, (struct sockaddr *)&remote, len) == -1) {
 #ifdef DEBUG
     syslog(LOG_WARNING, "ipmb_handle: connect() failed\n");
 #endif
-    goto clean_exit;
+    close(s);
+    return -1;
   }
 
-  if (send(s, request, req_len, 0) == -1) {
+  conn->sock = s;
+  return 0;
+}
+
+static int
+conn_send(ipmb_conn_t *conn, uint32_t tag, unsigned char prio,
+          unsigned char *request, unsigned char req_len) {
+  unsigned char buf[sizeof(ipmb_sess_hdr_t) + MAX_IPMB_RES_LEN];
+  ipmb_sess_hdr_t *hdr = (ipmb_sess_hdr_t *) buf;
+
+  memset(hdr, 0, sizeof(ipmb_sess_hdr_t));
+  hdr->tag = tag;
+  hdr->len = req_len;
+  hdr->flags = prio & IPMB_SESS_PRIO_MASK;
+  memcpy(&buf[sizeof(ipmb_sess_hdr_t)], request, req_len);
+
+  if (send(conn->sock, buf, sizeof(ipmb_sess_hdr_t) + req_len,
+           MSG_NOSIGNAL) != sizeof(ipmb_sess_hdr_t) + req_len) {
 #ifdef DEBUG
     syslog(LOG_WARNING, "ipmb_handle: send() failed\n");
 #endif
-    goto clean_exit;
+    return -1;
   }
 
-  if ((t=recv(s, response, MAX_IPMB_RES_LEN, 0)) > 0) {
-    *res_len = t;
-  } else {
-    if (t < 0) {
+  return 0;
+}
+
+/*
+ * Read one response off the connection and hand it to its waiter.
+ * Called without m_conn held by the single reading waiter.
+ * Returns 0 on timeout, 1 when a response was read and -1 if the
+ * connection is broken.
+ */
+static int
+conn_recv(int sock, int timeout_ms, ipmb_sess_hdr_t *hdr, unsigned char *buf) {
+  struct pollfd pfd;
+  int n;
+
+  pfd.fd = sock;
+  pfd.events = POLLIN;
+  n = poll(&pfd, 1, timeout_ms);
+  if (n == 0)
+    return 0;
+  if (n < 0)
+    return (errno == EINTR) ? 0 : -1;
+
+  n = recv(sock, hdr, sizeof(ipmb_sess_hdr_t), MSG_WAITALL);
+  if (n != sizeof(ipmb_sess_hdr_t) || hdr->len > MAX_IPMB_RES_LEN) {
 #ifdef DEBUG
-      syslog(LOG_WARNING, "lib_ipmb_handle: recv() failed\n");
+    syslog(LOG_DEBUG, "Server closed connection\n");
 #endif
-    } else {
+    return -1;
+  }
+
+  if (hdr->len &&
+      recv(sock, buf, hdr->len, MSG_WAITALL) != hdr->len) {
 #ifdef DEBUG
-      syslog(LOG_DEBUG, "Server closed connection\n");
+    syslog(LOG_WARNING, "lib_ipmb_handle: recv() failed\n");
 #endif
+    return -1;
+  }
+
+  return 1;
+}
+
+/*
+ * Function to handle IPMB messages of the given priority class
+ *
+ * Requests go over a connection to ipmbd kept open per bus for the life of
+ * the process, so concurrent callers share it with their requests in flight
+ * at the same time. Whichever caller is waiting reads the responses for all
+ * of them and passes each one on by its tag.
+ */
+void
+lib_ipmb_handle_prio(unsigned char bus_id, unsigned char prio,
+            unsigned char *request, unsigned char req_len,
+            unsigned char *response, unsigned char *res_len) {
+
+  ipmb_conn_t *conn;
+  ipmb_waiter_t self, *w, **pw;
+  ipmb_sess_hdr_t hdr;
+  unsigned char buf[MAX_IPMB_RES_LEN];
+  uint64_t deadline, now;
+  struct timespec ts;
+  int sock, ret, retry;
+
+  pthread_once(&conn_once, conn_atfork_init);
+
+  pthread_mutex_lock(&m_conn);
+
+  conn = conn_get(bus_id);
+  if (conn == NULL) {
+    pthread_mutex_unlock(&m_conn);
+    return;
+  }
+
+  memset(&self, 0, sizeof(self));
+  self.res = response;
+
+  // Retry once on a fresh connection, in case ipmbd was restarted
+  for (retry = 0; retry < 2; retry++) {
+    if (conn_open(conn, bus_id) < 0) {
+      pthread_mutex_unlock(&m_conn);
+      return;
+    }
+    self.tag = ++conn->next_tag;
+    if (conn_send(conn, self.tag, prio, request, req_len) == 0)
+      break;
+    conn_close(conn);
+  }
+  if (retry == 2) {
+    pthread_mutex_unlock(&m_conn);
+    return;
+  }
+
+  self.next = conn->waiters;
+  conn->waiters = &self;
+
+  deadline = ipmb_mono_ms() + (TIMEOUT_IPMB + 1) * 1000;
+
+  while (!self.done) {
+    now = ipmb_mono_ms();
+    if (now >= deadline)
+      break;
+
+    if (conn->reading) {
+      ts.tv_sec = deadline / 1000;
+      ts.tv_nsec = (deadline % 1000) * 1000000;
+      pthread_cond_timedwait(&conn->cond, &m_conn, &ts);
+      continue;
     }
+
+    conn->reading = true;
+    sock = conn->sock;
+    pthread_mutex_unlock(&m_conn);
+
+    ret = conn_recv(sock, (int) (deadline - now), &hdr, buf);
+
+    pthread_mutex_lock(&m_conn);
+    conn->reading = false;
+
+    if (sock != conn->sock) {
+      // Dropped while we were reading, maybe reopened already
+      close(sock);
+    } else if (ret < 0) {
+      conn_close(conn);
+    } else if (ret > 0) {
+      for (w = conn->waiters; w; w = w->next) {
+        if (w->tag == hdr.tag) {
+          memcpy(w->res, buf, hdr.len);
+          w->res_len = hdr.len;
+          w->done = true;
+          break;
+        }
+      }
+    }
+
+    // Let another waiter take over reading, or collect its response
+    pthread_cond_broadcast(&conn->cond);
   }
 
-clean_exit:
-  close(s);
+  for (pw = &conn->waiters; *pw; pw = &(*pw)->next) {
+    if (*pw == &self) {
+      *pw = self.next;
+      break;
+    }
+  }
+
+  if (self.res_len > 0)
+    *res_len = self.res_len;
+
+  pthread_mutex_unlock(&m_conn);
 
   return;
 }
+
+/*
+ * Function to handle IPMB messages
+ */
+void
+lib_ipmb_handle(unsigned char bus_id,
+            unsigned char *request, unsigned char req_len,
+            unsigned char *response, unsigned char *res_len) {
+
+  lib_ipmb_handle_prio(bus_id, IPMB_PRIO_DEFAULT, request, req_len,
+                       response, res_len);
+}
@@ -46,6 +46,36 @@ extern "C" {
 #define TIMEOUT_IPMB 8
 #define MAX_IPMB_RES_LEN 255
 
+/*
+ * Clients keep one connection per bus open to ipmbd and may have several
+ * requests in flight on it. Every message on the connection, in either
+ * direction, is this header followed by len bytes of IPMB packet; the
+ * response carries the tag of its request. An empty response means the
+ * request failed or timed out.
+ */
+typedef struct _ipmb_sess_hdr_t {
+  uint32_t tag;
+  uint16_t len;
+  uint8_t flags;
+  uint8_t rsvd;
+} ipmb_sess_hdr_t;
+
+#define IPMB_SESS_PRIO_MASK 0x03 // priority class in ipmb_sess_hdr_t.flags
+
+/*
+ * Priority classes of IPMB requests. ipmbd starts queued requests of a
+ * higher class first and bounds the requests each class has in flight,
+ * so bulk transfers can't starve sensor reads or power control.
+ */
+enum {
+  IPMB_PRIO_CTRL = 0,   // interactive and power control
+  IPMB_PRIO_SENSOR,     // sensor telemetry
+  IPMB_PRIO_BULK,       // firmware update, FRU/SDR/SEL dumps
+  IPMB_PRIO_CNT,
+};
+
+#define IPMB_PRIO_DEFAULT IPMB_PRIO_SENSOR
+
 typedef struct _ipmb_req_t {
   uint8_t res_slave_addr;
   uint8_t netfn_lun;
@@ -70,6 +100,9 @@ typedef struct _ipmb_res_t {
 void lib_ipmb_handle(unsigned char bus_id,
                   unsigned char *request, unsigned char req_len,
                   unsigned char *response, unsigned char *res_len);
+void lib_ipmb_handle_prio(unsigned char bus_id, unsigned char prio,
+                  unsigned char *request, unsigned char req_len,
+                  unsigned char *response, unsigned char *res_len);
 
 #ifdef __cplusplus
 } // extern "C"
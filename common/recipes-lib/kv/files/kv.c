@@ -19,122 +19,1413 @@
 #include <stdio.h>
 #include <stdint.h>
 #include <stdlib.h>
+#include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
 #include <syslog.h>
 #include <string.h>
+#include <stdbool.h>
+#include <dirent.h>
+#include <sched.h>
+#include <time.h>
+#include <pthread.h>
+#include <stddef.h>
 #include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
 #include "kv.h"
 
-int
-kv_set(char *key, char *value) {
+/*
+ * Every kv_set() appends a CRC-checked record to KV_LOG_PATH and the
+ * latest record of a key wins. Each process maps the log read-only and
+ * keeps a hash index of it, so kv_get() is a memory lookup.
+ *
+ * KV_SHM_PATH, on tmpfs, publishes the end of the committed records and
+ * its flock() serializes writers. After a reboot the first user rebuilds
+ * it from the log, dropping a record torn by a power loss. When the log is
+ * full, the writer replaces it with the latest record of each key.
+ *
+ * A set that would not change the value is dropped before touching flash.
+ * kv_set_wb() values wait in a dirty table in KV_SHM_PATH, guarded by a
+ * seqlock, and the first writer or flusher thread past shm->flush_at
+ * appends them to the log.
+ *
+ * A set that changes a value bumps the generation of the key's bucket in
+ * shm->kgen[] and write()s shm->notify, which wakes the inotify fds of the
+ * subscribers; stores through the mapping raise no event. Keys share the
+ * buckets, so kv_changed() compares the values of the keys whose bucket
+ * moved with the ones it saw last.
+ */
 
-  FILE *fp;
-  int rc;
-  char kpath[MAX_KEY_PATH_LEN] = {0};
+#define KV_LOG_MAGIC      0x4B564C47  /* "KVLG" */
+#define KV_SHM_MAGIC      0x4B565348  /* "KVSH" */
+#define KV_VERSION        1
+#define KV_SHM_VERSION    3
+
+#define KV_LOG_SIZE       (128 * 1024)
+#define KV_LOG_TMP        KV_LOG_PATH ".tmp"
+#define KV_LOG_CORRUPT    KV_LOG_PATH ".corrupt"
+
+#define KV_INDEX_SIZE     1024  /* power of 2 */
+#define KV_MAX_KEYS       (KV_INDEX_SIZE * 3 / 4)
+
+#define KV_SPIN_MAX       1000
+
+#define KV_DIRTY_MAX      32
+#define KV_NOTIFY_SIZE    256   /* power of 2 */
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+} kv_log_hdr_t;
+
+typedef struct {
+  uint32_t crc;       /* CRC32 of the rest of the record */
+  uint16_t len;       /* KV_REC_LEN(klen, vlen) */
+  uint8_t klen;
+  uint8_t vlen;
+  char data[];        /* key then value, without NUL */
+} kv_log_rec_t;
+
+#define KV_REC_LEN(klen, vlen) \
+  ((sizeof(kv_log_rec_t) + (klen) + (vlen) + 3) & ~3)
+#define KV_REC_MAX        KV_REC_LEN(MAX_KEY_LEN, MAX_VALUE_LEN)
+
+typedef struct {
+  uint8_t klen;
+  uint8_t vlen;
+  char key[MAX_KEY_LEN];
+  char value[MAX_VALUE_LEN];
+} kv_dirty_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  volatile uint32_t gen;    /* odd while a writer replaces the log */
+  volatile uint32_t tail;   /* end of the committed records */
+  volatile uint32_t dseq;   /* odd while a writer updates dirty[] */
+  volatile uint32_t ndirty;
+  uint32_t flush_at;        /* CLOCK_MONOTONIC s to flush dirty[] by */
+  kv_stats_t stats;
+  kv_dirty_t dirty[KV_DIRTY_MAX];
+  volatile uint32_t kgen[KV_NOTIFY_SIZE];  /* changes of each key bucket */
+  uint8_t notify;           /* written to wake the subscribers */
+} kv_shm_t;
+
+typedef struct {
+  uint16_t bucket;
+  uint32_t gen;
+  int klen;
+  int vlen;                   /* -1 if the key was not set */
+  char key[MAX_KEY_LEN];
+  char value[MAX_VALUE_LEN];
+} kv_sub_key_t;
+
+// Subscription of this process, one per inotify fd
+typedef struct kv_sub {
+  struct kv_sub *next;
+  int fd;
+  int count;
+  kv_sub_key_t key[];
+} kv_sub_t;
+
+typedef struct {
+  int shm_fd;
+  kv_shm_t *shm;
+  int fd;
+  char *map;        /* KV_LOG_SIZE read-only mapping of the log */
+  uint32_t gen;     /* shm->gen the mapping belongs to */
+  uint32_t end;     /* log offset indexed so far */
+  uint32_t live;    /* bytes of the latest record of every key */
+  int nkeys;
+  uint32_t index[KV_INDEX_SIZE];  /* record offset, 0 if unused */
+  bool flusher;     /* flusher thread running */
+  bool notify;      /* a set under the flock changed a value */
+  kv_sub_t *subs;
+} kv_t;
+
+static kv_t g_kv = { .shm_fd = -1, .fd = -1 };
+static pthread_mutex_t m_kv = PTHREAD_MUTEX_INITIALIZER;
+
+static int kv_sync(bool locked);
+
+static uint32_t
+kv_crc32(const void *buf, size_t len) {
+  const uint8_t *p = buf;
+  uint32_t crc = 0xFFFFFFFF;
+  int i;
+
+  while (len--) {
+    crc ^= *p++;
+    for (i = 0; i < 8; i++) {
+      crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    }
+  }
+
+  return ~crc;
+}
+
+static uint32_t
+kv_hash(const char *key, int klen) {
+  uint32_t h = 2166136261u;
+
+  while (klen--) {
+    h = (h ^ (uint8_t) *key++) * 16777619u;
+  }
+
+  return h;
+}
+
+static bool
+kv_rec_valid(kv_log_rec_t *rec, uint32_t room) {
+  if (room < sizeof(kv_log_rec_t)) {
+    return false;
+  }
+
+  if (rec->klen == 0 || rec->klen >= MAX_KEY_LEN ||
+      rec->vlen > MAX_VALUE_LEN ||
+      rec->len != KV_REC_LEN(rec->klen, rec->vlen) || rec->len > room) {
+    return false;
+  }
+
+  return rec->crc == kv_crc32(&rec->len, rec->len - sizeof(rec->crc));
+}
+
+static void
+kv_lock(void) {
+  while (flock(g_kv.shm_fd, LOCK_EX) < 0 && errno == EINTR);
+}
+
+static void
+kv_unlock(void) {
+  flock(g_kv.shm_fd, LOCK_UN);
+}
+
+// Index entry of a key, or the free entry it would take
+static uint32_t *
+kv_index_slot(const char *key, int klen) {
+  uint32_t h = kv_hash(key, klen);
+  uint32_t *slot;
+  kv_log_rec_t *rec;
+  int i;
+
+  for (i = 0; i < KV_INDEX_SIZE; i++) {
+    slot = &g_kv.index[(h + i) & (KV_INDEX_SIZE - 1)];
+    if (*slot == 0) {
+      break;
+    }
+
+    rec = (kv_log_rec_t *) (g_kv.map + *slot);
+    if (rec->klen == klen && !memcmp(rec->data, key, klen)) {
+      break;
+    }
+  }
+
+  return slot;
+}
+
+// Latest record of a key, NULL if none
+static kv_log_rec_t *
+kv_log_find(const char *key, int klen) {
+  uint32_t offset = *kv_index_slot(key, klen);
+
+  return offset ? (kv_log_rec_t *) (g_kv.map + offset) : NULL;
+}
 
-  sprintf(kpath, KV_STORE, key);
+static bool
+kv_log_same(const char *key, int klen, const char *value, int vlen) {
+  kv_log_rec_t *rec = kv_log_find(key, klen);
 
-  if (access(KV_STORE_PATH, F_OK) == -1) {
-    mkdir(KV_STORE_PATH, 0777);
+  return rec && rec->vlen == vlen && !memcmp(rec->data + klen, value, vlen);
+}
+
+#define kv_stat_inc(name) __sync_fetch_and_add(&g_kv.shm->stats.name, 1)
+
+static int
+kv_bucket(const char *key, int klen) {
+  return kv_hash(key, klen) & (KV_NOTIFY_SIZE - 1);
+}
+
+// Record a change of a key for its subscribers; flock held
+static void
+kv_notify(const char *key, int klen) {
+  __sync_fetch_and_add(&g_kv.shm->kgen[kv_bucket(key, klen)], 1);
+  g_kv.notify = true;
+}
+
+static void
+kv_index_add(uint32_t offset) {
+  kv_log_rec_t *rec = (kv_log_rec_t *) (g_kv.map + offset);
+  uint32_t *slot;
+
+  slot = kv_index_slot(rec->data, rec->klen);
+  if (*slot) {
+    g_kv.live -= ((kv_log_rec_t *) (g_kv.map + *slot))->len;
+  } else if (g_kv.nkeys >= KV_MAX_KEYS) {
+    syslog(LOG_WARNING, "kv_index_add: too many keys");
+    return;
+  } else {
+    g_kv.nkeys++;
+  }
+
+  *slot = offset;
+  g_kv.live += rec->len;
+}
+
+// Index the records up to tail, -1 if a bad one stops the scan
+static int
+kv_index_scan(uint32_t tail) {
+  kv_log_rec_t *rec;
+
+  while (g_kv.end < tail) {
+    rec = (kv_log_rec_t *) (g_kv.map + g_kv.end);
+    if (!kv_rec_valid(rec, tail - g_kv.end)) {
+      return -1;
+    }
+
+    kv_index_add(g_kv.end);
+    g_kv.end += rec->len;
   }
 
-  fp = fopen(kpath, "w");
-  if (!fp) {
-    int err = errno;
+  return 0;
+}
+
+/*
+ * (Re)open the log at KV_LOG_PATH with an empty index. The mapping comes
+ * from a read-only fd of its own: JFFS2 only supports read-only mmap and
+ * refuses a MAP_SHARED one from a writable fd, which stays for appends.
+ */
+static int
+kv_log_map(void) {
+  int fd;
+
+  if (g_kv.map) {
+    munmap(g_kv.map, KV_LOG_SIZE);
+    g_kv.map = NULL;
+  }
+
+  if (g_kv.fd >= 0) {
+    close(g_kv.fd);
+  }
+
+  g_kv.fd = open(KV_LOG_PATH, O_RDWR);
+  if (g_kv.fd < 0) {
 #ifdef DEBUG
-    syslog(LOG_WARNING, "kv_set: failed to open %s", kpath);
+    syslog(LOG_WARNING, "kv_log_map: failed to open %s, err %d", KV_LOG_PATH,
+           errno);
 #endif
-    return err;
+    return -1;
+  }
+
+  fd = open(KV_LOG_PATH, O_RDONLY);
+  if (fd < 0) {
+    close(g_kv.fd);
+    g_kv.fd = -1;
+    return -1;
+  }
+
+  g_kv.map = mmap(NULL, KV_LOG_SIZE, PROT_READ, MAP_SHARED, fd, 0);
+  if (g_kv.map == MAP_FAILED) {
+    syslog(LOG_WARNING, "kv_log_map: mmap failed for %s, err %d", KV_LOG_PATH,
+           errno);
+    close(fd);
+    g_kv.map = NULL;
+    close(g_kv.fd);
+    g_kv.fd = -1;
+    return -1;
+  }
+  close(fd);
+
+  memset(g_kv.index, 0, sizeof(g_kv.index));
+  g_kv.nkeys = 0;
+  g_kv.live = 0;
+  g_kv.end = sizeof(kv_log_hdr_t);
+
+  return 0;
+}
+
+// Index the whole log file and drop a torn or corrupt tail; flock held
+static int
+kv_log_load(void) {
+  struct stat st;
+  uint32_t size;
+
+  if (kv_log_map() || fstat(g_kv.fd, &st)) {
+    return -1;
+  }
+
+  size = st.st_size < KV_LOG_SIZE ? st.st_size : KV_LOG_SIZE;
+  kv_index_scan(size);
+
+  if (st.st_size > g_kv.end) {
+    syslog(LOG_WARNING, "kv_log_load: dropped %u bytes at offset %u",
+           (uint32_t) st.st_size - g_kv.end, g_kv.end);
+    if (ftruncate(g_kv.fd, g_kv.end)) {
+      return -1;
+    }
+  }
+
+  g_kv.shm->tail = g_kv.end;
+
+  return 0;
+}
+
+/*
+ * Rewrite the log with only the latest record of each key, then switch
+ * every process over to it through shm->gen; flock held
+ */
+static int
+kv_compact(void) {
+  kv_log_hdr_t *hdr;
+  kv_log_rec_t *rec;
+  kv_shm_t *shm = g_kv.shm;
+  uint32_t size;
+  char *buf;
+  int i, fd;
+
+  buf = malloc(sizeof(kv_log_hdr_t) + g_kv.live);
+  if (buf == NULL) {
+    return -1;
   }
 
-  rc = flock(fileno(fp), LOCK_EX);
-  if (rc < 0) {
-    int err = errno;
+  hdr = (kv_log_hdr_t *) buf;
+  hdr->magic = KV_LOG_MAGIC;
+  hdr->version = KV_VERSION;
+  size = sizeof(kv_log_hdr_t);
+
+  for (i = 0; i < KV_INDEX_SIZE; i++) {
+    if (g_kv.index[i]) {
+      rec = (kv_log_rec_t *) (g_kv.map + g_kv.index[i]);
+      memcpy(buf + size, rec, rec->len);
+      size += rec->len;
+    }
+  }
+
+  fd = open(KV_LOG_TMP, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0 || write(fd, buf, size) != size || fsync(fd)) {
+    syslog(LOG_WARNING, "kv_compact: failed to write %s", KV_LOG_TMP);
+    if (fd >= 0) {
+      close(fd);
+    }
+    unlink(KV_LOG_TMP);
+    free(buf);
+    return -1;
+  }
+  close(fd);
+  free(buf);
+
+  shm->gen++;
+  __sync_synchronize();
+  if (rename(KV_LOG_TMP, KV_LOG_PATH)) {
+    syslog(LOG_WARNING, "kv_compact: failed to rename %s", KV_LOG_TMP);
+    unlink(KV_LOG_TMP);
+    shm->gen++;
+    return -1;
+  }
+  shm->tail = size;
+  __sync_synchronize();
+  shm->gen++;
+
+  return kv_sync(true);
+}
+
+// Append a record and publish it to all processes; flock held, index synced
+static int
+kv_append(const char *key, int klen, const char *value, int vlen) {
+  uint32_t buf[KV_REC_MAX / sizeof(uint32_t)];
+  kv_log_rec_t *rec = (kv_log_rec_t *) buf;
+  int len = KV_REC_LEN(klen, vlen);
+  uint32_t tail;
+
+  if (*kv_index_slot(key, klen) == 0 && g_kv.nkeys >= KV_MAX_KEYS) {
+    syslog(LOG_WARNING, "kv_append: too many keys");
+    return -1;
+  }
+
+  if (g_kv.shm->tail + len > KV_LOG_SIZE) {
+    if (kv_compact() || g_kv.shm->tail + len > KV_LOG_SIZE) {
+      syslog(LOG_WARNING, "kv_append: %s is full", KV_LOG_PATH);
+      return -1;
+    }
+  }
+
+  memset(buf, 0, len);
+  rec->len = len;
+  rec->klen = klen;
+  rec->vlen = vlen;
+  memcpy(rec->data, key, klen);
+  memcpy(rec->data + klen, value, vlen);
+  rec->crc = kv_crc32(&rec->len, len - sizeof(rec->crc));
+
+  tail = g_kv.shm->tail;
+  if (pwrite(g_kv.fd, rec, len, tail) != len) {
 #ifdef DEBUG
-    syslog(LOG_WARNING, "kv_set: failed to flock on %s, err %d", kpath, err);
+    syslog(LOG_WARNING, "kv_append: failed to write %s, err %d", KV_LOG_PATH,
+           errno);
 #endif
-    fclose(fp);
     return -1;
   }
 
-  rc = fwrite(value, 1, strlen(value), fp);
-  if (rc < 0) {
+  __sync_synchronize();
+  g_kv.shm->tail = tail + len;
+  kv_stat_inc(committed);
+
+  return kv_sync(true);
+}
+
+/*
+ * Bring the index up to date with the committed records, following the
+ * log to a new file if a writer replaced it
+ */
+static int
+kv_sync(bool locked) {
+  kv_shm_t *shm = g_kv.shm;
+  uint32_t gen, tail;
+  int spin = 0;
+  int rc;
+
+  while (1) {
+    gen = shm->gen;
+    if (gen & 1) {
+      if (!locked) {
+        if (++spin < KV_SPIN_MAX) {
+          sched_yield();
+          continue;
+        }
+        // Taking the lock waits for the writer, or outlives a dead one
+        kv_lock();
+        rc = kv_sync(true);
+        kv_unlock();
+        return rc;
+      }
+
+      // The writer died while replacing the log: index whichever is there
+      if (kv_log_load()) {
+        return -1;
+      }
+      __sync_synchronize();
+      shm->gen = g_kv.gen = gen + 1;
+      return 0;
+    }
+
+    __sync_synchronize();
+    tail = shm->tail;
+    __sync_synchronize();
+    if (shm->gen != gen) {
+      continue;
+    }
+
+    if (gen != g_kv.gen || g_kv.map == NULL) {
+      if (kv_log_map()) {
+        return -1;
+      }
+      g_kv.gen = gen;
+      __sync_synchronize();
+      if (shm->gen != gen) {
+        continue;
+      }
+    }
+
+    break;
+  }
+
+  if (tail > KV_LOG_SIZE) {
+    return -1;
+  }
+
+  if (tail > g_kv.end && kv_index_scan(tail)) {
+    syslog(LOG_WARNING, "kv_sync: bad record at offset %u", g_kv.end);
+    g_kv.end = tail;
+  }
+
+  return 0;
+}
+
+// Move the per-key files of the old backend into the log; flock held
+static void
+kv_import_old(void) {
+  DIR *dir;
+  struct dirent *ent;
+  char kpath[MAX_KEY_PATH_LEN] = {0};
+  char value[MAX_VALUE_LEN] = {0};
+  int fd, klen, n;
+
+  dir = opendir(KV_STORE_PATH);
+  if (dir == NULL) {
+    return;
+  }
+
+  while ((ent = readdir(dir)) != NULL) {
+    klen = strlen(ent->d_name);
+    if (ent->d_name[0] == '.' || klen >= MAX_KEY_LEN) {
+      continue;
+    }
+
+    snprintf(kpath, sizeof(kpath), KV_STORE, ent->d_name);
+    fd = open(kpath, O_RDONLY);
+    if (fd < 0) {
+      continue;
+    }
+    n = read(fd, value, sizeof(value));
+    close(fd);
+    if (n < 0) {
+      continue;
+    }
+
+    if (!kv_append(ent->d_name, klen, value, strnlen(value, n))) {
+      unlink(kpath);
+    }
+  }
+
+  closedir(dir);
+  rmdir(KV_STORE_PATH);
+}
+
+// Rebuild the shared state after a reboot; flock held
+static int
+kv_recover(void) {
+  kv_log_hdr_t hdr;
+  struct stat st;
+  bool fresh = false;
+  int fd;
+
+  fd = open(KV_LOG_PATH, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) {
+    syslog(LOG_WARNING, "kv_recover: failed to open %s", KV_LOG_PATH);
+    return -1;
+  }
+
+  if (pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr) ||
+      hdr.magic != KV_LOG_MAGIC || hdr.version != KV_VERSION) {
+    // Keep what is there for a post mortem rather than dropping every key
+    if (!fstat(fd, &st) && st.st_size > 0) {
+      syslog(LOG_CRIT, "kv_recover: %s is corrupted, moved to %s",
+             KV_LOG_PATH, KV_LOG_CORRUPT);
+      close(fd);
+      if (rename(KV_LOG_PATH, KV_LOG_CORRUPT)) {
+        syslog(LOG_WARNING, "kv_recover: failed to rename %s, err %d",
+               KV_LOG_PATH, errno);
+        return -1;
+      }
+      fd = open(KV_LOG_PATH, O_RDWR | O_CREAT, 0666);
+      if (fd < 0) {
+        syslog(LOG_WARNING, "kv_recover: failed to open %s", KV_LOG_PATH);
+        return -1;
+      }
+    }
+
+    hdr.magic = KV_LOG_MAGIC;
+    hdr.version = KV_VERSION;
+    if (ftruncate(fd, 0) || pwrite(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)) {
+      syslog(LOG_WARNING, "kv_recover: failed to init %s", KV_LOG_PATH);
+      close(fd);
+      return -1;
+    }
+    fresh = true;
+  }
+  close(fd);
+
+  // Left behind by a writer that died before switching to it
+  unlink(KV_LOG_TMP);
+
+  g_kv.shm->gen = g_kv.gen = 0;
+  if (kv_log_load()) {
+    return -1;
+  }
+
+  if (fresh) {
+    kv_import_old();
+  }
+
+  g_kv.shm->dseq = 0;
+  g_kv.shm->ndirty = 0;
+  memset(&g_kv.shm->stats, 0, sizeof(g_kv.shm->stats));
+
+  __sync_synchronize();
+  g_kv.shm->version = KV_SHM_VERSION;
+  __sync_synchronize();
+  g_kv.shm->magic = KV_SHM_MAGIC;
+
+  return 0;
+}
+
+static uint32_t
+kv_now(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec;
+}
+
+// Write-behind entry of a key, NULL if none; flock held
+static kv_dirty_t *
+kv_dirty_find(const char *key, int klen) {
+  kv_dirty_t *d;
+  int i;
+
+  for (i = 0; i < g_kv.shm->ndirty && i < KV_DIRTY_MAX; i++) {
+    d = &g_kv.shm->dirty[i];
+    if (d->klen == klen && !memcmp(d->key, key, klen)) {
+      return d;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+kv_dirty_begin(void) {
+  g_kv.shm->dseq++;
+  __sync_synchronize();
+}
+
+static void
+kv_dirty_end(void) {
+  __sync_synchronize();
+  g_kv.shm->dseq++;
+}
+
+static void
+kv_dirty_del(kv_dirty_t *d) {
+  kv_shm_t *shm = g_kv.shm;
+
+  kv_dirty_begin();
+  *d = shm->dirty[shm->ndirty - 1];
+  shm->ndirty--;
+  kv_dirty_end();
+}
+
+/*
+ * Copy the write-behind value of a key, without the flock unless a writer
+ * died halfway. Returns its length, -1 if the key has none.
+ */
+static int
+kv_dirty_get(const char *key, int klen, char *value) {
+  kv_shm_t *shm = g_kv.shm;
+  kv_dirty_t *d;
+  uint32_t seq;
+  int spin, vlen;
+
+  for (spin = 0; ; spin++) {
+    seq = shm->dseq;
+    if (seq & 1) {
+      if (spin < KV_SPIN_MAX) {
+        sched_yield();
+        continue;
+      }
+
+      kv_lock();
+      if (shm->dseq == seq) {
+        shm->dseq++;
+      }
+      kv_unlock();
+      continue;
+    }
+    __sync_synchronize();
+
+    vlen = -1;
+    if (shm->ndirty) {
+      d = kv_dirty_find(key, klen);
+      if (d != NULL && d->vlen <= MAX_VALUE_LEN) {
+        vlen = d->vlen;
+        memcpy(value, d->value, vlen);
+      }
+    }
+
+    __sync_synchronize();
+    if (shm->dseq == seq) {
+      return vlen;
+    }
+  }
+}
+
+/*
+ * Current value of a key, write-behind first; returns its length or -1.
+ * The index is synced after the dirty table is read, so a value flushed
+ * in between is found in the log.
+ */
+static int
+kv_lookup(const char *key, int klen, char *value) {
+  kv_log_rec_t *rec;
+  int vlen;
+
+  vlen = kv_dirty_get(key, klen, value);
+  if (vlen >= 0) {
+    return vlen;
+  }
+
+  if (kv_sync(false)) {
+    return -1;
+  }
+
+  rec = kv_log_find(key, klen);
+  if (rec == NULL) {
+    return -1;
+  }
+
+  memcpy(value, rec->data + klen, rec->vlen);
+  return rec->vlen;
+}
+
+/*
+ * Append the write-behind values of a key, or of all keys if key is NULL,
+ * to the log; flock held, index synced
+ */
+static int
+kv_dirty_flush(const char *key, int klen) {
+  kv_shm_t *shm = g_kv.shm;
+  kv_dirty_t *d;
+  int i = 0;
+  int rc = 0;
+
+  while (i < shm->ndirty) {
+    d = &shm->dirty[i];
+    if (key && (d->klen != klen || memcmp(d->key, key, klen))) {
+      i++;
+      continue;
+    }
+
+    if (kv_log_same(d->key, d->klen, d->value, d->vlen)) {
+      // Changed and changed back before reaching flash
+      kv_stat_inc(coalesced);
+    } else if (kv_append(d->key, d->klen, d->value, d->vlen)) {
+      rc = -1;
+      i++;
+      continue;
+    }
+
+    kv_dirty_del(d);
+  }
+
+  return rc;
+}
+
+// Flush the dirty table once its oldest entry is due; flock held
+static int
+kv_dirty_expire(void) {
+  kv_shm_t *shm = g_kv.shm;
+
+  if (shm->ndirty && (int32_t) (kv_now() - shm->flush_at) >= 0) {
+    return kv_dirty_flush(NULL, 0);
+  }
+
+  return 0;
+}
+
+static void *
+kv_flusher(void *arg) {
+  int32_t delay;
+
+  while (1) {
+    pthread_mutex_lock(&m_kv);
+    if (g_kv.shm == NULL || g_kv.shm->ndirty == 0) {
+      g_kv.flusher = false;
+      pthread_mutex_unlock(&m_kv);
+      break;
+    }
+
+    delay = g_kv.shm->flush_at - kv_now();
+    if (delay > KV_WB_INTERVAL) {
+      delay = KV_WB_INTERVAL;
+    } else if (delay <= 0) {
+      kv_lock();
+      if (!kv_sync(true)) {
+        kv_dirty_expire();
+      }
+      kv_unlock();
+      delay = KV_WB_INTERVAL;
+    }
+    pthread_mutex_unlock(&m_kv);
+
+    sleep(delay);
+  }
+
+  return NULL;
+}
+
+// Make sure this process flushes the values it left behind; m_kv held
+static void
+kv_flusher_start(void) {
+  pthread_attr_t attr;
+  pthread_t tid;
+
+  if (g_kv.flusher) {
+    return;
+  }
+
+  pthread_attr_init(&attr);
+  pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
+  if (!pthread_create(&tid, &attr, kv_flusher, NULL)) {
+    g_kv.flusher = true;
+  }
+  pthread_attr_destroy(&attr);
+}
+
+// Fork with m_kv held, so the child gets g_kv in a consistent state
+static void
+kv_atfork_prepare(void) {
+  pthread_mutex_lock(&m_kv);
+}
+
+static void
+kv_atfork_parent(void) {
+  pthread_mutex_unlock(&m_kv);
+}
+
+// A forked child must not share the flock() of its parent
+static void
+kv_atfork_child(void) {
+  // Only this thread exists in the child, so re-init rather than unlock
+  pthread_mutex_init(&m_kv, NULL);
+  g_kv.flusher = false;
+
+  if (g_kv.shm == NULL) {
+    return;
+  }
+
+  close(g_kv.shm_fd);
+  g_kv.shm_fd = open(KV_SHM_PATH, O_RDWR);
+  if (g_kv.shm_fd < 0) {
+    munmap(g_kv.shm, sizeof(kv_shm_t));
+    g_kv.shm = NULL;
+  }
+}
+
+static int
+kv_open(void) {
+  static bool atfork = false;
+  kv_shm_t *shm;
+  int fd;
+  int rc = 0;
+
+  if (g_kv.shm) {
+    return 0;
+  }
+
+  fd = open(KV_SHM_PATH, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) {
 #ifdef DEBUG
-    syslog(LOG_WARNING, "kv_set: failed to write to %s", kpath;
+    syslog(LOG_WARNING, "kv_open: failed to open %s, err %d", KV_SHM_PATH,
+           errno);
 #endif
-    fclose(fp);
-    return ENOENT;
+    return -1;
+  }
+
+  if (ftruncate(fd, sizeof(kv_shm_t)) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  shm = mmap(NULL, sizeof(kv_shm_t), PROT_READ | PROT_WRITE, MAP_SHARED,
+             fd, 0);
+  if (shm == MAP_FAILED) {
+    syslog(LOG_WARNING, "kv_open: mmap failed for %s", KV_SHM_PATH);
+    close(fd);
+    return -1;
+  }
+
+  g_kv.shm_fd = fd;
+  g_kv.shm = shm;
+
+  if (!atfork) {
+    pthread_atfork(kv_atfork_prepare, kv_atfork_parent, kv_atfork_child);
+    atfork = true;
+  }
+
+  if (shm->magic != KV_SHM_MAGIC || shm->version != KV_SHM_VERSION) {
+    kv_lock();
+    if (shm->magic != KV_SHM_MAGIC || shm->version != KV_SHM_VERSION) {
+      rc = kv_recover();
+    }
+    kv_unlock();
+  }
+
+  if (rc) {
+    munmap(shm, sizeof(kv_shm_t));
+    close(fd);
+    g_kv.shm_fd = -1;
+    g_kv.shm = NULL;
   }
 
-  rc = flock(fileno(fp), LOCK_UN);
-  if (rc < 0) {
-    int err = errno;
+  return rc;
+}
+
+// Take the locks for a set, -1 if the store can not be opened
+static int
+kv_set_enter(void) {
+  pthread_mutex_lock(&m_kv);
+  if (kv_open()) {
+    pthread_mutex_unlock(&m_kv);
+    return -1;
+  }
+
+  kv_lock();
+  if (kv_sync(true)) {
+    kv_unlock();
+    pthread_mutex_unlock(&m_kv);
+    return -1;
+  }
+
+  kv_dirty_expire();
+
+  return 0;
+}
+
+static void
+kv_set_exit(void) {
+  uint8_t one = 1;
+
+  // Wake the subscribers once for all the changes made under the lock
+  if (g_kv.notify) {
+    g_kv.notify = false;
+    if (pwrite(g_kv.shm_fd, &one, 1, offsetof(kv_shm_t, notify)) != 1) {
 #ifdef DEBUG
-    syslog(LOG_WARNING, "kv_set: failed to unlock flock on %s, err %d", kpath, err);
+      syslog(LOG_WARNING, "kv_set_exit: failed to notify, err %d", errno);
 #endif
-    fclose(fp);
+    }
+  }
+
+  kv_unlock();
+  pthread_mutex_unlock(&m_kv);
+}
+
+/*
+ * Validate a set; true if it would not change the value. A durable set
+ * only matches what is already on flash.
+ */
+static bool
+kv_set_check(char *key, char *value, int *klen, int *vlen, bool wb) {
+  char cur[MAX_VALUE_LEN];
+  bool same = false;
+
+  *klen = strlen(key);
+  *vlen = strnlen(value, MAX_VALUE_LEN);
+  if (*klen == 0 || *klen >= MAX_KEY_LEN) {
+    *klen = -1;
+    return false;
+  }
+
+  pthread_mutex_lock(&m_kv);
+  if (!kv_open()) {
+    kv_stat_inc(requested);
+    if (wb) {
+      same = kv_lookup(key, *klen, cur) == *vlen &&
+             !memcmp(cur, value, *vlen);
+    } else {
+      same = kv_dirty_get(key, *klen, cur) < 0 && !kv_sync(false) &&
+             kv_log_same(key, *klen, value, *vlen);
+    }
+    if (same) {
+      kv_stat_inc(skipped);
+    }
+  }
+  pthread_mutex_unlock(&m_kv);
+
+  return same;
+}
+
+// Durable set; flock held, index synced
+static int
+kv_set_locked(const char *key, int klen, const char *value, int vlen) {
+  kv_dirty_t *d;
+
+  // A durable set supersedes a pending write-behind value
+  d = kv_dirty_find(key, klen);
+  if (d != NULL) {
+    kv_dirty_del(d);
+    kv_stat_inc(coalesced);
+  }
+
+  if (kv_log_same(key, klen, value, vlen)) {
+    kv_stat_inc(skipped);
+    if (d != NULL) {
+      kv_notify(key, klen);
+    }
+    return 0;
+  }
+
+  if (kv_append(key, klen, value, vlen)) {
+    return -1;
+  }
+  kv_notify(key, klen);
+
+  return 0;
+}
+
+int
+kv_set(char *key, char *value) {
+  int klen, vlen;
+  int rc;
+
+  if (kv_set_check(key, value, &klen, &vlen, false)) {
+    return 0;
+  }
+
+  if (klen < 0 || kv_set_enter()) {
     return -1;
   }
 
-  fclose(fp);
+  rc = kv_set_locked(key, klen, value, vlen);
+  kv_set_exit();
+
+  return rc;
+}
+
+/*
+ * Durable sets of count keys under one lock. status[i] is 0 or -1 for
+ * keys[i]; returns -1 if any of them failed.
+ */
+int
+kv_set_many(char **keys, char **values, int *status, int count) {
+  int klen, vlen;
+  int i, rc = 0;
+
+  if (kv_set_enter()) {
+    for (i = 0; i < count; i++) {
+      status[i] = -1;
+    }
+    return -1;
+  }
+
+  for (i = 0; i < count; i++) {
+    klen = strlen(keys[i]);
+    vlen = strnlen(values[i], MAX_VALUE_LEN);
+    if (klen == 0 || klen >= MAX_KEY_LEN) {
+      status[i] = -1;
+    } else {
+      kv_stat_inc(requested);
+      status[i] = kv_set_locked(keys[i], klen, values[i], vlen);
+    }
+
+    if (status[i]) {
+      rc = -1;
+    }
+  }
+  kv_set_exit();
+
+  return rc;
+}
+
+int
+kv_set_wb(char *key, char *value) {
+  kv_shm_t *shm;
+  kv_dirty_t *d;
+  int klen, vlen;
+
+  if (kv_set_check(key, value, &klen, &vlen, true)) {
+    return 0;
+  }
+
+  if (klen < 0 || kv_set_enter()) {
+    return -1;
+  }
+
+  shm = g_kv.shm;
+  d = kv_dirty_find(key, klen);
+  if (d != NULL) {
+    kv_stat_inc(coalesced);
+  } else {
+    if (shm->ndirty == KV_DIRTY_MAX && kv_dirty_flush(NULL, 0)) {
+      // No room in RAM nor in the log
+      kv_set_exit();
+      return -1;
+    }
+
+    if (shm->ndirty == 0) {
+      shm->flush_at = kv_now() + KV_WB_INTERVAL;
+    }
+    d = &shm->dirty[shm->ndirty];
+  }
+
+  kv_dirty_begin();
+  memcpy(d->key, key, klen);
+  d->klen = klen;
+  memcpy(d->value, value, vlen);
+  d->vlen = vlen;
+  if (d == &shm->dirty[shm->ndirty]) {
+    shm->ndirty++;
+  }
+  kv_dirty_end();
+  kv_notify(key, klen);
+
+  kv_flusher_start();
+  kv_set_exit();
 
   return 0;
 }
 
+int
+kv_flush(char *key) {
+  int klen = key ? strlen(key) : 0;
+  int rc;
+
+  if (key && (klen == 0 || klen >= MAX_KEY_LEN)) {
+    return -1;
+  }
+
+  if (kv_set_enter()) {
+    return -1;
+  }
+
+  rc = kv_dirty_flush(key, klen);
+  if (fdatasync(g_kv.fd)) {
+    rc = -1;
+  }
+  kv_set_exit();
+
+  return rc;
+}
+
+int
+kv_get_stats(kv_stats_t *stats) {
+  int rc = -1;
+
+  pthread_mutex_lock(&m_kv);
+  if (!kv_open()) {
+    *stats = g_kv.shm->stats;
+    rc = 0;
+  }
+  pthread_mutex_unlock(&m_kv);
+
+  return rc;
+}
+
+/*
+ * Gets of count keys with one sync of the index. Each value needs
+ * MAX_VALUE_LEN bytes; status[i] is 0, or -1 if keys[i] is not found.
+ * Returns -1 if any of them failed.
+ */
+int
+kv_get_many(char **keys, char **values, int *status, int count) {
+  char buf[MAX_VALUE_LEN];
+  kv_log_rec_t *rec;
+  int klen, vlen;
+  int i, rc = 0;
+
+  pthread_mutex_lock(&m_kv);
+  if (kv_open()) {
+    pthread_mutex_unlock(&m_kv);
+    for (i = 0; i < count; i++) {
+      status[i] = -1;
+    }
+    return -1;
+  }
+
+  // Write-behind values first, so one sync of the index covers the rest
+  for (i = 0; i < count; i++) {
+    klen = strlen(keys[i]);
+    if (klen == 0 || klen >= MAX_KEY_LEN) {
+      status[i] = -1;
+      continue;
+    }
+
+    vlen = kv_dirty_get(keys[i], klen, buf);
+    if (vlen >= 0) {
+      memcpy(values[i], buf, vlen);
+      if (vlen < MAX_VALUE_LEN) {
+        values[i][vlen] = '\0';
+      }
+      status[i] = 0;
+    } else {
+      status[i] = 1;
+    }
+  }
+
+  if (kv_sync(false)) {
+    for (i = 0; i < count; i++) {
+      if (status[i] > 0) {
+        status[i] = -1;
+      }
+    }
+  }
+
+  for (i = 0; i < count; i++) {
+    if (status[i] > 0) {
+      rec = kv_log_find(keys[i], strlen(keys[i]));
+      if (rec != NULL) {
+        memcpy(values[i], rec->data + rec->klen, rec->vlen);
+        if (rec->vlen < MAX_VALUE_LEN) {
+          values[i][rec->vlen] = '\0';
+        }
+        status[i] = 0;
+      } else {
+        status[i] = -1;
+      }
+    }
+
+    if (status[i]) {
+      rc = -1;
+    }
+  }
+  pthread_mutex_unlock(&m_kv);
+
+  return rc;
+}
 
 int
 kv_get(char *key, char *value) {
+  char buf[MAX_VALUE_LEN];
+  int klen = strlen(key);
+  int vlen = -1;
 
-  FILE *fp;
-  int rc;
-  char kpath[MAX_KEY_PATH_LEN] = {0};
+  if (klen == 0 || klen >= MAX_KEY_LEN) {
+    return -1;
+  }
 
-  sprintf(kpath, KV_STORE, key);
+  pthread_mutex_lock(&m_kv);
+  if (!kv_open()) {
+    vlen = kv_lookup(key, klen, buf);
+  }
+  pthread_mutex_unlock(&m_kv);
 
-  if (access(KV_STORE_PATH, F_OK) == -1) {
-    mkdir(KV_STORE_PATH, 0777);
+  if (vlen < 0) {
+    return -1;
   }
 
-  fp = fopen(kpath, "r");
-  if (!fp) {
-    int err = errno;
-#ifdef DEBUG
-    syslog(LOG_WARNING, "kv_get: failed to open %s, err %d", kpath, err);
-#endif
+  memcpy(value, buf, vlen);
+  if (vlen < MAX_VALUE_LEN) {
+    value[vlen] = '\0';
+  }
+
+  return 0;
+}
+
+/*
+ * Subscribe to changes of count keys. Returns an fd that polls readable
+ * when one of them may have changed; kv_changed() tells whether one did.
+ */
+int
+kv_subscribe(char **keys, int count) {
+  kv_sub_t *sub;
+  kv_sub_key_t *k;
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (strlen(keys[i]) == 0 || strlen(keys[i]) >= MAX_KEY_LEN) {
+      return -1;
+    }
+  }
+
+  sub = malloc(sizeof(kv_sub_t) + count * sizeof(kv_sub_key_t));
+  if (sub == NULL) {
     return -1;
   }
 
-  rc = flock(fileno(fp), LOCK_EX);
-  if (rc < 0) {
-    int err = errno;
-#ifdef DEBUG
-    syslog(LOG_WARNING, "kv_get: failed to flock %s, err %d", kpath, err);
-#endif
-    fclose(fp);
+  pthread_mutex_lock(&m_kv);
+  if (kv_open()) {
+    pthread_mutex_unlock(&m_kv);
+    free(sub);
     return -1;
   }
 
-  rc = (int) fread(value, 1, MAX_VALUE_LEN, fp);
-  if (rc <= 0) {
+  sub->fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+  if (sub->fd < 0 || inotify_add_watch(sub->fd, KV_SHM_PATH, IN_MODIFY) < 0) {
 #ifdef DEBUG
-    syslog(LOG_INFO, "kv_get: failed to read %s", kpath);
+    syslog(LOG_WARNING, "kv_subscribe: failed to watch %s, err %d",
+           KV_SHM_PATH, errno);
 #endif
-    fclose(fp);
-    return ENOENT;
+    if (sub->fd >= 0) {
+      close(sub->fd);
+    }
+    pthread_mutex_unlock(&m_kv);
+    free(sub);
+    return -1;
   }
 
-  rc = flock(fileno(fp), LOCK_UN);
-  if (rc < 0) {
-    int err = errno;
-#ifdef DEBUG
-    syslog(LOG_WARNING, "kv_get: failed to unlock flock on %s, err %d", kpath, err);
-#endif
-    fclose(fp);
+  // Generations and values are read after the watch is set, so no change
+  // is missed
+  sub->count = count;
+  for (i = 0; i < count; i++) {
+    k = &sub->key[i];
+    k->klen = strlen(keys[i]);
+    memcpy(k->key, keys[i], k->klen);
+    k->bucket = kv_bucket(k->key, k->klen);
+    k->gen = g_kv.shm->kgen[k->bucket];
+    k->vlen = kv_lookup(k->key, k->klen, k->value);
+  }
+
+  sub->next = g_kv.subs;
+  g_kv.subs = sub;
+  pthread_mutex_unlock(&m_kv);
+
+  return sub->fd;
+}
+
+/*
+ * 1 if the value of a key of the subscription changed since kv_subscribe()
+ * or the last call, 0 if not, -1 if fd is not a subscription or the store
+ * is gone. Drains the fd.
+ */
+int
+kv_changed(int fd) {
+  char buf[256];
+  char value[MAX_VALUE_LEN];
+  kv_sub_t *sub;
+  kv_sub_key_t *k;
+  uint32_t gen;
+  int i, vlen, rc = -1;
+
+  while (read(fd, buf, sizeof(buf)) > 0);
+
+  pthread_mutex_lock(&m_kv);
+  for (sub = g_kv.subs; sub != NULL; sub = sub->next) {
+    if (sub->fd == fd) {
+      break;
+    }
+  }
+
+  if (sub != NULL && g_kv.shm != NULL) {
+    rc = 0;
+    for (i = 0; i < sub->count; i++) {
+      k = &sub->key[i];
+      gen = g_kv.shm->kgen[k->bucket];
+      if (gen == k->gen) {
+        continue;
+      }
+      k->gen = gen;
+
+      // Another key of the bucket, or changed and changed back
+      vlen = kv_lookup(k->key, k->klen, value);
+      if (vlen == k->vlen && (vlen < 0 || !memcmp(value, k->value, vlen))) {
+        continue;
+      }
+      k->vlen = vlen;
+      if (vlen > 0) {
+        memcpy(k->value, value, vlen);
+      }
+      rc = 1;
+    }
+  }
+  pthread_mutex_unlock(&m_kv);
+
+  return rc;
+}
+
+int
+kv_unsubscribe(int fd) {
+  kv_sub_t **p;
+  kv_sub_t *sub;
+
+  pthread_mutex_lock(&m_kv);
+  for (p = &g_kv.subs; *p != NULL; p = &(*p)->next) {
+    if ((*p)->fd == fd) {
+      break;
+    }
+  }
+
+  sub = *p;
+  if (sub != NULL) {
+    *p = sub->next;
+  }
+  pthread_mutex_unlock(&m_kv);
+
+  if (sub == NULL) {
     return -1;
   }
 
-  fclose(fp);
+  close(sub->fd);
+  free(sub);
 
   return 0;
 }
@@ -30,12 +30,51 @@ extern "C" {
 #define MAX_KEY_LEN       64
 #define MAX_VALUE_LEN     64
 
+// Per-key files of the old backend, imported into the log once
 #define KV_STORE "/mnt/data/kv_store/%s"
 #define KV_STORE_PATH "/mnt/data/kv_store"
 
+// Append-only log holding every key, and its shared state on tmpfs
+#define KV_LOG_PATH "/mnt/data/kv_store.log"
+#define KV_SHM_PATH "/tmp/kv_store.shm"
+
+// Write counters since boot, shared by all processes
+typedef struct {
+  uint32_t requested;   /* kv_set() and kv_set_wb() calls */
+  uint32_t skipped;     /* ... that found the value already stored */
+  uint32_t coalesced;   /* write-behind values replaced before reaching flash */
+  uint32_t committed;   /* records written to flash */
+} kv_stats_t;
+
 int kv_get(char* key, char *value);
 int kv_set(char* key, char *value);
 
+// Get or set count keys at once, with the result of each in status[]
+int kv_get_many(char **keys, char **values, int *status, int count);
+int kv_set_many(char **keys, char **values, int *status, int count);
+
+/*
+ * Write-behind set for keys rewritten often and cheap to lose on a power
+ * loss: the value is visible to every kv_get() at once but only reaches
+ * flash within KV_WB_INTERVAL seconds, after any number of updates.
+ */
+#define KV_WB_INTERVAL    30
+
+int kv_set_wb(char* key, char *value);
+
+// Write the pending value of key, or of all keys if NULL, to flash now
+int kv_flush(char* key);
+int kv_get_stats(kv_stats_t *stats);
+
+/*
+ * Change notification: kv_subscribe() returns an fd to poll() for POLLIN,
+ * which may also wake up for other keys; kv_changed() is then 1 if the
+ * value of one of the subscribed keys changed since the last call.
+ */
+int kv_subscribe(char **keys, int count);
+int kv_changed(int fd);
+int kv_unsubscribe(int fd);
+
 #ifdef __cplusplus
 }
 #endif
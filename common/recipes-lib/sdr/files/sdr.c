@@ -28,6 +28,9 @@
 #include <errno.h>
 #include <syslog.h>
 #include <string.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "sdr.h"
 
 #define FIELD_RATE_UNIT(x)  ((x & (0x07 << 3)) >> 3)
@@ -39,6 +42,32 @@
 
 #define MAX_NAME_LEN        16
 
+/* Pre-decoded SDR information for one sensor */
+typedef struct {
+  int name_ret;
+  int units_ret;
+  int thresh_ret;
+  thresh_sensor_t snr;
+} sdr_index_entry_t;
+
+/*
+ * Per-FRU index of all the sensors in the SDR dump. It is built once from
+ * the SDR file and rebuilt only when the file is replaced or rewritten.
+ */
+typedef struct {
+  bool built;
+  ino_t ino;
+  off_t size;
+  time_t mtime;
+  sdr_index_entry_t entry[MAX_SENSOR_NUM + 1];
+} sdr_index_t;
+
+static sdr_index_t *g_sdr_index[MAX_NUM_FRUS] = {0};
+static pthread_mutex_t m_sdr_index = PTHREAD_MUTEX_INITIALIZER;
+
+static int sdr_index_get(uint8_t fru, uint8_t snr_num,
+    sdr_index_entry_t *entry);
+
 /* Array for BCD Plus definition. */
 const char bcd_plus_array[] = "0123456789 -.XXX";
 
@@ -96,25 +125,17 @@ int
 sdr_get_sensor_units(uint8_t fru, uint8_t snr_num, char *units) {
 
   int ret = 0;
-  uint8_t op;
-  uint8_t modifier;
-  sdr_full_t *sdr;
-
-  sensor_info_t sinfo[MAX_SENSOR_NUM] = {0};
+  sdr_index_entry_t entry;
 
-  if (pal_sensor_sdr_init(fru, sinfo) < 0) {
-    sdr = NULL;
-  } else {
-    sdr = &sinfo[snr_num].sdr;
-  }
-
-  if (sdr != NULL) {
-    ret = _sdr_get_sensor_units(sdr, &op, &modifier, units);
+  if (sdr_index_get(fru, snr_num, &entry) == 0) {
+    ret = entry.units_ret;
     if (ret < 0) {
 #ifdef DEBUG
       syslog(LOG_ERR, "_sdr_get_sensor_units failed for FRU: %d snr_num: %d",
           fru, snr_num);
 #endif
+    } else {
+      strcpy(units, entry.snr.units);
     }
   } else {
     ret = pal_get_sensor_units(fru, snr_num, units);
@@ -218,23 +239,17 @@ int
 sdr_get_sensor_name(uint8_t fru, uint8_t snr_num, char *name) {
 
   int ret = 0;
-  sdr_full_t *sdr;
-
-  sensor_info_t sinfo[MAX_SENSOR_NUM] = {0};
-
-  if (pal_sensor_sdr_init(fru, sinfo) < 0) {
-    sdr = NULL;
-  } else {
-    sdr = &sinfo[snr_num].sdr;
-  }
+  sdr_index_entry_t entry;
 
-  if (sdr != NULL) {
-    ret = _sdr_get_sensor_name(sdr, name);
+  if (sdr_index_get(fru, snr_num, &entry) == 0) {
+    ret = entry.name_ret;
     if (ret < 0) {
 #ifdef DEBUG
       syslog(LOG_ERR, "_sdr_get_sensor_name failed for FRU: %d snr_num: %d",
           fru, snr_num);
 #endif
+    } else {
+      strcpy(name, entry.snr.name);
     }
   } else {
     ret = pal_get_sensor_name(fru, snr_num, name);
@@ -457,19 +472,115 @@ _sdr_get_snr_thresh(uint8_t fru, sdr_full_t *sdr, uint8_t snr_num,
   return 0;
 }
 
+/* Decode every sensor of the FRU's SDR dump into the index */
+static int
+sdr_index_build(uint8_t fru, sdr_index_t *idx) {
+
+  int ret;
+  int num;
+  uint8_t op, modifier;
+  sdr_index_entry_t *entry;
+  sensor_info_t *sinfo;
+
+  sinfo = calloc(MAX_SENSOR_NUM + 1, sizeof(sensor_info_t));
+  if (sinfo == NULL) {
+    syslog(LOG_WARNING, "sdr_index_build: calloc failed for FRU: %d", fru);
+    return -1;
+  }
+
+  ret = pal_sensor_sdr_init(fru, sinfo);
+  if (ret < 0) {
+    free(sinfo);
+    return ret;
+  }
+
+  for (num = 0; num <= MAX_SENSOR_NUM; num++) {
+    entry = &idx->entry[num];
+    memset(entry, 0, sizeof(sdr_index_entry_t));
+
+    entry->name_ret = _sdr_get_sensor_name(&sinfo[num].sdr, entry->snr.name);
+    /* Units don't depend on the name, which _sdr_get_snr_thresh needs */
+    entry->units_ret = _sdr_get_sensor_units(&sinfo[num].sdr, &op, &modifier,
+        entry->snr.units);
+
+    entry->snr.flag = GETMASK(SENSOR_VALID) | GETMASK(UCR_THRESH) |
+      GETMASK(UNC_THRESH) | GETMASK(UNR_THRESH) | GETMASK(LCR_THRESH) |
+      GETMASK(LNC_THRESH) | GETMASK(LNR_THRESH);
+    entry->thresh_ret = _sdr_get_snr_thresh(fru, &sinfo[num].sdr, num,
+        &entry->snr);
+  }
+
+  free(sinfo);
+  return 0;
+}
+
+/*
+ * Look up the pre-decoded SDR information of a sensor. The SDR file is
+ * only parsed again when its inode, size or mtime changed since the
+ * index was built. Returns pal_sensor_sdr_init()'s error when the FRU
+ * has no usable SDR.
+ */
+static int
+sdr_index_get(uint8_t fru, uint8_t snr_num, sdr_index_entry_t *entry) {
+
+  int ret;
+  bool have_stat;
+  char path[64] = {0};
+  struct stat st;
+  sdr_index_t *idx;
+
+  if (fru < 1 || fru > MAX_NUM_FRUS) {
+    return -1;
+  }
+
+  have_stat = (pal_get_fru_sdr_path(fru, path) == 0) && (stat(path, &st) == 0);
+
+  pthread_mutex_lock(&m_sdr_index);
+
+  idx = g_sdr_index[fru-1];
+  if (idx == NULL) {
+    idx = calloc(1, sizeof(sdr_index_t));
+    if (idx == NULL) {
+      pthread_mutex_unlock(&m_sdr_index);
+      return -1;
+    }
+    g_sdr_index[fru-1] = idx;
+  }
+
+  if (!have_stat || !idx->built || idx->ino != st.st_ino ||
+      idx->size != st.st_size || idx->mtime != st.st_mtime) {
+    idx->built = false;
+    ret = sdr_index_build(fru, idx);
+    if (ret < 0) {
+      pthread_mutex_unlock(&m_sdr_index);
+      return ret;
+    }
+    if (have_stat) {
+      idx->ino = st.st_ino;
+      idx->size = st.st_size;
+      idx->mtime = st.st_mtime;
+      idx->built = true;
+    }
+  }
+
+  memcpy(entry, &idx->entry[snr_num], sizeof(sdr_index_entry_t));
+
+  pthread_mutex_unlock(&m_sdr_index);
+
+  return 0;
+}
+
 int
 sdr_get_snr_thresh(uint8_t fru, uint8_t snr_num, thresh_sensor_t *snr) {
 
   int ret = 0;
-  sdr_full_t *sdr;
+  sdr_index_entry_t entry;
 #ifdef DEBUG
   int cnt = 0;
 #endif /* DEBUG */
   int retry = 0;
 
-  sensor_info_t sinfo[MAX_SENSOR_NUM] = {0};
-
-  ret = pal_sensor_sdr_init(fru, sinfo);
+  ret = sdr_index_get(fru, snr_num, &entry);
 
   while (ret == ERR_NOT_READY) {
 
@@ -481,22 +592,12 @@ sdr_get_snr_thresh(uint8_t fru, uint8_t snr_num, thresh_sensor_t *snr) {
     syslog(LOG_INFO, "sdr_get_snr_thresh: fru: %d, ret: %d cnt: %d", fru, ret, cnt++);
 #endif /* DEBUG */
     sleep(1);
-    ret = pal_sensor_sdr_init(fru, sinfo);
-  }
-
-  if (ret < 0) {
-    sdr = NULL;
-  } else {
-    sdr = &sinfo[snr_num].sdr;
+    ret = sdr_index_get(fru, snr_num, &entry);
   }
 
-  /* Set all the threshold options set in the flag */
-  snr->flag = GETMASK(SENSOR_VALID) | GETMASK(UCR_THRESH) |
-    GETMASK(UNC_THRESH) | GETMASK(UNR_THRESH) | GETMASK(LCR_THRESH) |
-    GETMASK(LNC_THRESH) | GETMASK(LNR_THRESH);
-
-  if (sdr != NULL) {
-    ret = _sdr_get_snr_thresh(fru, sdr, snr_num, snr);
+  if (ret == 0) {
+    memcpy(snr, &entry.snr, sizeof(thresh_sensor_t));
+    ret = entry.thresh_ret;
     if (ret < 0) {
 #ifdef DEBUG
       syslog(LOG_ERR, "_sdr_get_snr_thresh failed for FRU: %d snr_num: %d",
@@ -505,6 +606,11 @@ sdr_get_snr_thresh(uint8_t fru, uint8_t snr_num, thresh_sensor_t *snr) {
     }
   } else {
 
+    /* Set all the threshold options set in the flag */
+    snr->flag = GETMASK(SENSOR_VALID) | GETMASK(UCR_THRESH) |
+      GETMASK(UNC_THRESH) | GETMASK(UNR_THRESH) | GETMASK(LCR_THRESH) |
+      GETMASK(LNC_THRESH) | GETMASK(LNR_THRESH);
+
     ret = pal_get_sensor_name(fru, snr_num, snr->name);
     ret = pal_get_sensor_units(fru, snr_num, snr->units);
     ret = pal_get_sensor_threshold(fru, snr_num, UCR_THRESH, &(snr->ucr_thresh));
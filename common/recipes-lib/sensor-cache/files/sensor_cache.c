@@ -0,0 +1,313 @@
+/*
+ * Copyright 2016-present Facebook. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "sensor_cache.h"
+#include "sensor_stats.h"
+#include "sensor_shm.h"
+
+static snr_cache_t *g_cache = NULL;
+static pthread_mutex_t m_cache = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+ * Map one of the sensor stores into this process. The backing files live
+ * on tmpfs, so after the first call every access is a plain memory access.
+ * A new file, or one with a layout from a different version, is zeroed and
+ * stamped with the magic and version found at the start of every store.
+ */
+void *
+snr_shm_map(const char *path, size_t size, uint32_t magic, uint32_t version) {
+  int fd;
+  struct stat st;
+  uint32_t *hdr;
+
+  fd = open(path, O_RDWR | O_CREAT, 0666);
+  if (fd < 0) {
+#ifdef DEBUG
+    syslog(LOG_WARNING, "snr_shm_map: failed to open %s, err %d", path, errno);
+#endif
+    return NULL;
+  }
+
+  if (flock(fd, LOCK_EX) < 0) {
+#ifdef DEBUG
+    syslog(LOG_WARNING, "snr_shm_map: failed to flock %s, err %d", path, errno);
+#endif
+    close(fd);
+    return NULL;
+  }
+
+  if (fstat(fd, &st) < 0 ||
+      (st.st_size != size && ftruncate(fd, size) < 0)) {
+    syslog(LOG_WARNING, "snr_shm_map: failed to size %s", path);
+    flock(fd, LOCK_UN);
+    close(fd);
+    return NULL;
+  }
+
+  hdr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (hdr == MAP_FAILED) {
+    syslog(LOG_WARNING, "snr_shm_map: mmap failed for %s", path);
+    flock(fd, LOCK_UN);
+    close(fd);
+    return NULL;
+  }
+
+  if (hdr[0] != magic || hdr[1] != version) {
+    memset(hdr, 0, size);
+    hdr[1] = version;
+    __sync_synchronize();
+    hdr[0] = magic;
+  }
+
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  return hdr;
+}
+
+static snr_cache_t *
+cache_map(void) {
+  snr_cache_t *cache;
+
+  if (g_cache)
+    return g_cache;
+
+  pthread_mutex_lock(&m_cache);
+  if (g_cache == NULL) {
+    cache = snr_shm_map(SNR_CACHE_PATH, sizeof(snr_cache_t), SNR_CACHE_MAGIC,
+        SNR_CACHE_VERSION);
+    if (cache != NULL) {
+      cache->max_fru = SNR_CACHE_MAX_FRU;
+      cache->max_snr = SNR_CACHE_MAX_SNR;
+      g_cache = cache;
+    }
+  }
+  pthread_mutex_unlock(&m_cache);
+
+  return g_cache;
+}
+
+static snr_cache_slot_t *
+cache_slot(uint8_t fru, uint8_t snr_num) {
+  snr_cache_t *cache;
+
+  if (fru >= SNR_CACHE_MAX_FRU) {
+#ifdef DEBUG
+    syslog(LOG_WARNING, "cache_slot: Wrong FRU ID %d", fru);
+#endif
+    return NULL;
+  }
+
+  cache = cache_map();
+  if (cache == NULL)
+    return NULL;
+
+  return &cache->slot[fru][snr_num];
+}
+
+static uint64_t
+cache_mono_ms(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Publish a reading, lock-free for the common single-writer case */
+int
+sensor_cache_set(uint8_t fru, uint8_t snr_num, float value, uint32_t status) {
+  snr_cache_slot_t *slot;
+  uint64_t mono_ms;
+  uint32_t seq;
+
+  slot = cache_slot(fru, snr_num);
+  if (slot == NULL)
+    return -1;
+
+  mono_ms = cache_mono_ms();
+
+  seq = snr_seq_write_begin(&slot->seq);
+
+  slot->value = value;
+  slot->status = status | SNR_CACHE_VALID;
+  slot->ts = (uint32_t) time(NULL);
+  slot->mono_ms = mono_ms;
+
+  snr_seq_write_end(&slot->seq, seq);
+
+  return 0;
+}
+
+/* Take a consistent snapshot of a slot without any syscall */
+int
+sensor_cache_get(uint8_t fru, uint8_t snr_num, snr_cache_entry_t *entry) {
+  snr_cache_slot_t *slot;
+  uint32_t seq;
+  int spin;
+
+  slot = cache_slot(fru, snr_num);
+  if (slot == NULL)
+    return -1;
+
+  for (spin = 0; spin < MAX_SEQ_SPIN; spin++) {
+    seq = slot->seq;
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    __sync_synchronize();
+
+    entry->status = slot->status;
+    entry->value = slot->value;
+    entry->ts = slot->ts;
+    entry->mono_ms = slot->mono_ms;
+
+    __sync_synchronize();
+    if (slot->seq == seq)
+      return 0;
+  }
+
+#ifdef DEBUG
+  syslog(LOG_WARNING, "sensor_cache_get: FRU %d num 0x%X busy", fru, snr_num);
+#endif
+  return -1;
+}
+
+/* Latest valid reading of a sensor, -1 if none or Not Available */
+int
+sensor_cache_read(uint8_t fru, uint8_t snr_num, float *value) {
+  snr_cache_entry_t entry;
+
+  if (sensor_cache_get(fru, snr_num, &entry) < 0)
+    return -1;
+
+  if (!(entry.status & SNR_CACHE_VALID) || (entry.status & SNR_CACHE_NA))
+    return -1;
+
+  *value = entry.value;
+  return 0;
+}
+
+/* How long a published reading of the sensor may be served to readers */
+int
+sensor_cache_set_ttl(uint8_t fru, uint8_t snr_num, uint32_t ttl_ms) {
+  snr_cache_slot_t *slot;
+
+  slot = cache_slot(fru, snr_num);
+  if (slot == NULL)
+    return -1;
+
+  slot->ttl_ms = ttl_ms;
+  return 0;
+}
+
+/*
+ * Read a sensor through the cache, shared by all processes:
+ *  - a reading younger than the slot's ttl_ms is returned without any I/O
+ *  - otherwise one caller takes the slot's lease and runs read_fn, while
+ *    concurrent callers wait for its result instead of issuing the same
+ *    transaction; a lease left behind by a dead reader expires after
+ *    SNR_CACHE_LEASE_MS
+ * A cached "Not Available" reading is returned as -1 like a failed read.
+ * A failed read_fn is published as "Not Available" too, so the callers
+ * waiting on it fail with it rather than retry one after another; callers
+ * coming later read the sensor again.
+ */
+int
+sensor_cache_read_through(uint8_t fru, uint8_t snr_num,
+    snr_cache_read_fn read_fn, void *value) {
+  snr_cache_slot_t *slot;
+  snr_cache_entry_t entry;
+  uint64_t start, now;
+  uint32_t lease, mine = 0;
+  uint32_t wait_us = SNR_CACHE_WAIT_MIN_US;
+  bool waited = false;
+  int ret;
+
+  slot = cache_slot(fru, snr_num);
+  if (slot == NULL)
+    return read_fn(fru, snr_num, value);
+
+  start = cache_mono_ms();
+
+  while (1) {
+    now = cache_mono_ms();
+
+    /* Fresh enough, or published by a reader we have been waiting on */
+    if (!sensor_cache_get(fru, snr_num, &entry) &&
+        (entry.status & SNR_CACHE_VALID) &&
+        ((now - entry.mono_ms < slot->ttl_ms &&
+          !(entry.status & SNR_CACHE_FAILED)) || entry.mono_ms >= start)) {
+      sensor_stats_hit(fru, snr_num, (uint32_t) (now - entry.mono_ms),
+          waited && entry.mono_ms >= start);
+      if (entry.status & SNR_CACHE_NA)
+        return -1;
+      *(float *) value = entry.value;
+      return 0;
+    }
+
+    lease = slot->lease;
+    if (lease == 0 || (int32_t) ((uint32_t) now - lease) >= 0) {
+      mine = ((uint32_t) now + SNR_CACHE_LEASE_MS) | 1;
+      if (__sync_bool_compare_and_swap(&slot->lease, lease, mine))
+        break;
+      mine = 0;
+      continue;
+    }
+
+    /* Don't wait on a reader longer than it may hold the lease */
+    if (now - start > SNR_CACHE_LEASE_MS)
+      break;
+
+    /* Most reads finish within a few ms; slow ones needn't cost a
+     * wakeup per ms for every waiter */
+    waited = true;
+    usleep(wait_us);
+    if (wait_us < SNR_CACHE_WAIT_MAX_US)
+      wait_us = (wait_us * 2 < SNR_CACHE_WAIT_MAX_US) ?
+                wait_us * 2 : SNR_CACHE_WAIT_MAX_US;
+  }
+
+  start = cache_mono_ms();
+  ret = read_fn(fru, snr_num, value);
+  sensor_stats_read(fru, snr_num, (uint32_t) (cache_mono_ms() - start), ret,
+      waited);
+  if (ret == 0)
+    sensor_cache_set(fru, snr_num, *(float *) value, 0);
+  else
+    sensor_cache_set(fru, snr_num, 0, SNR_CACHE_NA | SNR_CACHE_FAILED);
+
+  if (mine)
+    __sync_bool_compare_and_swap(&slot->lease, mine, 0);
+
+  return ret;
+}
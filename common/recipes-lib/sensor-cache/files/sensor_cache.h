@@ -0,0 +1,93 @@
+/*
+ * Copyright 2016-present Facebook. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __SENSOR_CACHE_H__
+#define __SENSOR_CACHE_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+
+#define SNR_CACHE_PATH      "/tmp/sensor_cache.bin"
+#define SNR_CACHE_MAGIC     0x534E5243  /* "SNRC" */
+#define SNR_CACHE_VERSION   2
+
+#define SNR_CACHE_MAX_FRU   8
+#define SNR_CACHE_MAX_SNR   256
+
+/* Status bits of a cached sensor reading */
+#define SNR_CACHE_VALID     0x01  /* slot holds a reading */
+#define SNR_CACHE_NA        0x02  /* last read reported "Not Available" */
+#define SNR_CACHE_FAILED    0x04  /* last read_fn failed, only for its waiters */
+
+/* Longest a reader may hold a slot's read lease before others take over */
+#define SNR_CACHE_LEASE_MS  10000
+
+/* Waiters on a lease check back after 1 ms, backing off up to 50 ms */
+#define SNR_CACHE_WAIT_MIN_US  1000
+#define SNR_CACHE_WAIT_MAX_US  50000
+
+/*
+ * One slot per (fru, sensor_num). The slot is guarded by a seqlock:
+ * the writer makes seq odd while updating and even when done, readers
+ * retry until they see the same even seq before and after the copy.
+ */
+typedef struct {
+  volatile uint32_t seq;
+  uint32_t status;
+  float value;
+  uint32_t ts;          /* wall-clock seconds of the last update */
+  uint64_t mono_ms;     /* CLOCK_MONOTONIC ms of the last update */
+  uint32_t ttl_ms;      /* freshness window of sensor_cache_read_through() */
+  volatile uint32_t lease;  /* CLOCK_MONOTONIC ms deadline of the reader */
+} snr_cache_slot_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t max_fru;
+  uint32_t max_snr;
+  snr_cache_slot_t slot[SNR_CACHE_MAX_FRU][SNR_CACHE_MAX_SNR];
+} snr_cache_t;
+
+/* Consistent copy of a slot handed back to readers */
+typedef struct {
+  uint32_t status;
+  float value;
+  uint32_t ts;
+  uint64_t mono_ms;
+} snr_cache_entry_t;
+
+int sensor_cache_set(uint8_t fru, uint8_t snr_num, float value, uint32_t status);
+int sensor_cache_get(uint8_t fru, uint8_t snr_num, snr_cache_entry_t *entry);
+int sensor_cache_read(uint8_t fru, uint8_t snr_num, float *value);
+
+/* Hardware read hook of sensor_cache_read_through() */
+typedef int (*snr_cache_read_fn)(uint8_t fru, uint8_t snr_num, void *value);
+
+int sensor_cache_set_ttl(uint8_t fru, uint8_t snr_num, uint32_t ttl_ms);
+int sensor_cache_read_through(uint8_t fru, uint8_t snr_num,
+    snr_cache_read_fn read_fn, void *value);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SENSOR_CACHE_H__ */
@@ -0,0 +1,206 @@
+/*
+ * Copyright 2016-present Facebook. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syslog.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/file.h>
+#include "sensor_history.h"
+#include "sensor_shm.h"
+
+static snr_hist_t *g_hist = NULL;
+static pthread_mutex_t m_hist = PTHREAD_MUTEX_INITIALIZER;
+
+static snr_hist_t *
+hist_map(void) {
+
+  if (g_hist)
+    return g_hist;
+
+  pthread_mutex_lock(&m_hist);
+  if (g_hist == NULL) {
+    g_hist = snr_shm_map(SNR_HIST_PATH, sizeof(snr_hist_t), SNR_HIST_MAGIC,
+        SNR_HIST_VERSION);
+  }
+  pthread_mutex_unlock(&m_hist);
+
+  return g_hist;
+}
+
+/*
+ * Hand out the next free track to a sensor. This happens once per sensor
+ * for the lifetime of the store, under the file lock so that concurrent
+ * processes never claim the same track.
+ */
+static int
+hist_track_alloc(snr_hist_t *hist, uint8_t fru, uint8_t snr_num) {
+  int fd;
+  int idx;
+
+  fd = open(SNR_HIST_PATH, O_RDWR);
+  if (fd < 0) {
+    return -1;
+  }
+
+  if (flock(fd, LOCK_EX) < 0) {
+    close(fd);
+    return -1;
+  }
+
+  idx = hist->track_idx[fru][snr_num];
+  if (idx == 0 && hist->track_cnt < SNR_HIST_MAX_TRACK) {
+    idx = ++hist->track_cnt;
+    hist->track[idx - 1].fru = fru;
+    hist->track[idx - 1].snr_num = snr_num;
+    __sync_synchronize();
+    hist->track_idx[fru][snr_num] = idx;
+  }
+
+  flock(fd, LOCK_UN);
+  close(fd);
+
+  if (idx == 0) {
+#ifdef DEBUG
+    syslog(LOG_WARNING, "hist_track_alloc: no free track for FRU %d num 0x%X",
+        fru, snr_num);
+#endif
+    return -1;
+  }
+
+  return idx;
+}
+
+static snr_hist_track_t *
+hist_track(uint8_t fru, uint8_t snr_num, bool create) {
+  snr_hist_t *hist;
+  int idx;
+
+  if (fru >= SNR_CACHE_MAX_FRU)
+    return NULL;
+
+  hist = hist_map();
+  if (hist == NULL)
+    return NULL;
+
+  idx = hist->track_idx[fru][snr_num];
+  if (idx == 0) {
+    if (!create)
+      return NULL;
+    idx = hist_track_alloc(hist, fru, snr_num);
+    if (idx < 0)
+      return NULL;
+  }
+
+  return &hist->track[idx - 1];
+}
+
+/* Fold a sample into the rollup ring for the given period */
+static void
+hist_rollup(snr_hist_rollup_t *ring, int cnt, uint32_t *head,
+    uint32_t period, uint32_t ts, float value) {
+  snr_hist_rollup_t *r;
+  uint32_t start = ts - (ts % period);
+
+  if (*head > 0) {
+    r = &ring[(*head - 1) % cnt];
+    if (r->ts == start) {
+      if (value < r->min)
+        r->min = value;
+      if (value > r->max)
+        r->max = value;
+      r->sum += value;
+      r->count++;
+      return;
+    }
+  }
+
+  r = &ring[*head % cnt];
+  r->ts = start;
+  r->count = 1;
+  r->min = value;
+  r->max = value;
+  r->sum = value;
+  (*head)++;
+}
+
+/*
+ * Record a sample of a sensor. Only writes into the preallocated rings of
+ * the mapped store, so it never allocates on the sampling path.
+ */
+int
+sensor_history_add(uint8_t fru, uint8_t snr_num, uint32_t ts, float value) {
+  snr_hist_track_t *track;
+  snr_hist_sample_t *sample;
+  uint32_t seq;
+
+  track = hist_track(fru, snr_num, true);
+  if (track == NULL)
+    return -1;
+
+  seq = snr_seq_write_begin(&track->seq);
+
+  sample = &track->raw[track->raw_head % SNR_HIST_RAW_CNT];
+  sample->ts = ts;
+  sample->value = value;
+  track->raw_head++;
+
+  hist_rollup(track->min, SNR_HIST_MIN_CNT, &track->min_head,
+      SNR_HIST_MIN_SEC, ts, value);
+  hist_rollup(track->hour, SNR_HIST_HOUR_CNT, &track->hour_head,
+      SNR_HIST_HOUR_SEC, ts, value);
+
+  snr_seq_write_end(&track->seq, seq);
+
+  return 0;
+}
+
+/* Consistent copy of a sensor's history, -1 if it has none */
+int
+sensor_history_get(uint8_t fru, uint8_t snr_num, snr_hist_track_t *track) {
+  snr_hist_track_t *src;
+  uint32_t seq;
+  int spin;
+
+  src = hist_track(fru, snr_num, false);
+  if (src == NULL)
+    return -1;
+
+  for (spin = 0; spin < MAX_SEQ_SPIN; spin++) {
+    seq = src->seq;
+    if (seq & 1) {
+      sched_yield();
+      continue;
+    }
+    __sync_synchronize();
+
+    memcpy(track, (void *) src, sizeof(snr_hist_track_t));
+
+    __sync_synchronize();
+    if (src->seq == seq)
+      return 0;
+  }
+
+  return -1;
+}
@@ -0,0 +1,93 @@
+/*
+ * Copyright 2016-present Facebook. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __SENSOR_HISTORY_H__
+#define __SENSOR_HISTORY_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include "sensor_cache.h"
+
+#define SNR_HIST_PATH       "/tmp/sensor_history.bin"
+#define SNR_HIST_MAGIC      0x534E5248  /* "SNRH" */
+#define SNR_HIST_VERSION    1
+
+/*
+ * Fixed memory budget: every monitored sensor gets one track, holding the
+ * last SNR_HIST_RAW_CNT raw samples (10 minutes at the default 2 s poll),
+ * 3 hours of 1-minute rollups and 7 days of 1-hour rollups.
+ */
+#define SNR_HIST_MAX_TRACK  256
+#define SNR_HIST_RAW_CNT    300
+#define SNR_HIST_MIN_CNT    180
+#define SNR_HIST_HOUR_CNT   168
+
+#define SNR_HIST_MIN_SEC    60
+#define SNR_HIST_HOUR_SEC   3600
+
+typedef struct {
+  uint32_t ts;
+  float value;
+} snr_hist_sample_t;
+
+/* min/max/avg of the samples in [ts, ts + period) */
+typedef struct {
+  uint32_t ts;
+  uint32_t count;
+  float min;
+  float max;
+  float sum;
+} snr_hist_rollup_t;
+
+/*
+ * Ring buffers of one sensor. The *_head counters only grow: entry i of a
+ * ring lives at index (i % ring size), the newest one is (head - 1).
+ */
+typedef struct {
+  volatile uint32_t seq;
+  uint8_t fru;
+  uint8_t snr_num;
+  uint16_t rsvd;
+  uint32_t raw_head;
+  uint32_t min_head;
+  uint32_t hour_head;
+  snr_hist_sample_t raw[SNR_HIST_RAW_CNT];
+  snr_hist_rollup_t min[SNR_HIST_MIN_CNT];
+  snr_hist_rollup_t hour[SNR_HIST_HOUR_CNT];
+} snr_hist_track_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  uint32_t track_cnt;
+  /* track number + 1 of each (fru, sensor_num), 0 when not tracked */
+  uint16_t track_idx[SNR_CACHE_MAX_FRU][SNR_CACHE_MAX_SNR];
+  snr_hist_track_t track[SNR_HIST_MAX_TRACK];
+} snr_hist_t;
+
+int sensor_history_add(uint8_t fru, uint8_t snr_num, uint32_t ts, float value);
+int sensor_history_get(uint8_t fru, uint8_t snr_num, snr_hist_track_t *track);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SENSOR_HISTORY_H__ */
@@ -0,0 +1,64 @@
+/*
+ * Copyright 2016-present Facebook. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __SENSOR_SHM_H__
+#define __SENSOR_SHM_H__
+
+#include <stddef.h>
+#include <stdint.h>
+#include <sched.h>
+
+#define MAX_SEQ_SPIN 1000
+
+/* Internal to libsensor_cache: maps a store that starts with magic, version */
+void *snr_shm_map(const char *path, size_t size, uint32_t magic,
+    uint32_t version);
+
+/*
+ * Enter the write side of a seqlock. Lock-free for the common single-writer
+ * case; if a writer died with the sequence odd, the next writer takes it
+ * over after MAX_SEQ_SPIN attempts. Returns the even sequence to pass to
+ * snr_seq_write_end().
+ */
+static inline uint32_t
+snr_seq_write_begin(volatile uint32_t *seq) {
+  uint32_t val;
+  int spin = 0;
+
+  while (1) {
+    val = *seq;
+    if (!(val & 1)) {
+      if (__sync_bool_compare_and_swap(seq, val, val + 1))
+        return val;
+    } else if (++spin > MAX_SEQ_SPIN) {
+      *seq = val;
+      __sync_synchronize();
+      return val - 1;
+    } else {
+      sched_yield();
+    }
+  }
+}
+
+static inline void
+snr_seq_write_end(volatile uint32_t *seq, uint32_t val) {
+  __sync_synchronize();
+  *seq = val + 2;
+}
+
+#endif /* __SENSOR_SHM_H__ */
@@ -0,0 +1,166 @@
+/*
+ * Copyright 2016-present Facebook. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "sensor_stats.h"
+#include "sensor_shm.h"
+
+static snr_stats_t *g_stats = NULL;
+static pthread_mutex_t m_stats = PTHREAD_MUTEX_INITIALIZER;
+
+/* Shared stats segment, NULL if it can't be mapped */
+snr_stats_t *
+sensor_stats_map(void) {
+
+  if (g_stats)
+    return g_stats;
+
+  pthread_mutex_lock(&m_stats);
+  if (g_stats == NULL) {
+    g_stats = snr_shm_map(SNR_STATS_PATH, sizeof(snr_stats_t),
+        SNR_STATS_MAGIC, SNR_STATS_VERSION);
+  }
+  pthread_mutex_unlock(&m_stats);
+
+  return g_stats;
+}
+
+static int
+stats_bucket(uint32_t ms) {
+  int i = 0;
+
+  while (ms && i < SNR_STATS_BUCKETS - 1) {
+    ms >>= 1;
+    i++;
+  }
+
+  return i;
+}
+
+/* Upper bound in ms of the bucket holding the pct-th percentile */
+uint32_t
+sensor_stats_percentile(const uint32_t *hist, int pct) {
+  uint64_t total = 0, seen = 0;
+  int i;
+
+  for (i = 0; i < SNR_STATS_BUCKETS; i++)
+    total += hist[i];
+
+  if (total == 0)
+    return 0;
+
+  for (i = 0; i < SNR_STATS_BUCKETS; i++) {
+    seen += hist[i];
+    if (seen * 100 >= total * pct)
+      break;
+  }
+
+  return (i >= SNR_STATS_BUCKETS - 1) ? UINT32_MAX : (1U << i);
+}
+
+static snr_stats_cnt_t *
+stats_xport(snr_stats_t *stats, uint8_t fru, uint8_t snr_num) {
+  uint16_t xport = stats->xport[fru][snr_num];
+
+  return xport ? &stats->bus[xport - 1] : NULL;
+}
+
+/* Record the transport a sensor is read over, for the per-bus counters */
+int
+sensor_stats_set_xport(uint8_t fru, uint8_t snr_num, uint8_t bus) {
+  snr_stats_t *stats;
+
+  if (fru >= SNR_CACHE_MAX_FRU)
+    return -1;
+
+  stats = sensor_stats_map();
+  if (stats == NULL)
+    return -1;
+
+  stats->xport[fru][snr_num] = (uint16_t) bus + 1;
+  return 0;
+}
+
+static void
+stats_add_read(snr_stats_cnt_t *cnt, uint32_t ms, int ret, bool retry) {
+
+  __sync_fetch_and_add(&cnt->reads, 1);
+  if (ret)
+    __sync_fetch_and_add(&cnt->fails, 1);
+  if (retry)
+    __sync_fetch_and_add(&cnt->retries, 1);
+  __sync_fetch_and_add(&cnt->read_total_ms, ms);
+  __sync_fetch_and_add(&cnt->read_hist[stats_bucket(ms)], 1);
+  if (ms > cnt->read_max_ms)
+    cnt->read_max_ms = ms;
+}
+
+static void
+stats_add_hit(snr_stats_cnt_t *cnt, uint32_t age_ms, bool shared) {
+
+  if (shared)
+    __sync_fetch_and_add(&cnt->shared, 1);
+  else
+    __sync_fetch_and_add(&cnt->hits, 1);
+  __sync_fetch_and_add(&cnt->age_hist[stats_bucket(age_ms)], 1);
+}
+
+/* Account for one hardware read of ms duration that returned ret */
+void
+sensor_stats_read(uint8_t fru, uint8_t snr_num, uint32_t ms, int ret,
+    bool retry) {
+  snr_stats_t *stats;
+  snr_stats_cnt_t *xport;
+
+  if (fru >= SNR_CACHE_MAX_FRU)
+    return;
+
+  stats = sensor_stats_map();
+  if (stats == NULL)
+    return;
+
+  stats_add_read(&stats->snr[fru][snr_num], ms, ret, retry);
+
+  xport = stats_xport(stats, fru, snr_num);
+  if (xport)
+    stats_add_read(xport, ms, ret, retry);
+}
+
+/* Account for one reading served from the cache at the given age */
+void
+sensor_stats_hit(uint8_t fru, uint8_t snr_num, uint32_t age_ms,
+    bool shared) {
+  snr_stats_t *stats;
+  snr_stats_cnt_t *xport;
+
+  if (fru >= SNR_CACHE_MAX_FRU)
+    return;
+
+  stats = sensor_stats_map();
+  if (stats == NULL)
+    return;
+
+  stats_add_hit(&stats->snr[fru][snr_num], age_ms, shared);
+
+  xport = stats_xport(stats, fru, snr_num);
+  if (xport)
+    stats_add_hit(xport, age_ms, shared);
+}
@@ -0,0 +1,79 @@
+/*
+ * Copyright 2016-present Facebook. All Rights Reserved.
+ *
+ * This program is free software; you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation; either version 2 of the License, or
+ * (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 675 Mass Ave, Cambridge, MA 02139, USA.
+ */
+
+#ifndef __SENSOR_STATS_H__
+#define __SENSOR_STATS_H__
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "sensor_cache.h"
+
+#define SNR_STATS_PATH      "/tmp/sensor_stats.bin"
+#define SNR_STATS_MAGIC     0x534E5253  /* "SNRS" */
+#define SNR_STATS_VERSION   1
+
+#define SNR_STATS_MAX_XPORT 256
+
+/*
+ * Log-scale histogram buckets in ms: bucket 0 counts [0, 1), bucket i
+ * counts [2^(i-1), 2^i) and the last bucket everything from 4096 ms on.
+ */
+#define SNR_STATS_BUCKETS   14
+
+/*
+ * Counters of one sensor or one transport. All of them are updated with
+ * single atomic adds and wrap around like any other counter.
+ */
+typedef struct {
+  uint32_t reads;         /* hardware reads */
+  uint32_t fails;         /* hardware reads that failed */
+  uint32_t retries;       /* hardware reads after waiting on another reader */
+  uint32_t hits;          /* served from the cache within the ttl */
+  uint32_t shared;        /* served from a concurrent reader's result */
+  uint32_t read_max_ms;
+  uint32_t read_total_ms;
+  uint32_t read_hist[SNR_STATS_BUCKETS];  /* hardware read duration */
+  uint32_t age_hist[SNR_STATS_BUCKETS];   /* age of values served cached */
+} snr_stats_cnt_t;
+
+typedef struct {
+  uint32_t magic;
+  uint32_t version;
+  /* transport (bus) + 1 of each sensor, 0 when not known */
+  uint16_t xport[SNR_CACHE_MAX_FRU][SNR_CACHE_MAX_SNR];
+  snr_stats_cnt_t snr[SNR_CACHE_MAX_FRU][SNR_CACHE_MAX_SNR];
+  snr_stats_cnt_t bus[SNR_STATS_MAX_XPORT];
+} snr_stats_t;
+
+int sensor_stats_set_xport(uint8_t fru, uint8_t snr_num, uint8_t bus);
+void sensor_stats_read(uint8_t fru, uint8_t snr_num, uint32_t ms, int ret,
+    bool retry);
+void sensor_stats_hit(uint8_t fru, uint8_t snr_num, uint32_t age_ms,
+    bool shared);
+snr_stats_t *sensor_stats_map(void);
+uint32_t sensor_stats_percentile(const uint32_t *hist, int pct);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* __SENSOR_STATS_H__ */
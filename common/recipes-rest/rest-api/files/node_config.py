@@ -35,26 +35,27 @@ class configNode(node):
 
     def getInformation(self):
         result = {}
-        cmd = '/usr/local/bin/cfg-util dump-all'
-        data = Popen(cmd, shell=True, stdout=PIPE).stdout.read()
-        sdata = data.split('\n');
-        for line in sdata:
-            # skip lines that does not start with name
-            if line.startswith(self.name):
-                kv = line.split(':')
-                result[kv[0].strip()] = kv[1].strip()
+        # only the keys that start with name, all read in one go
+        keys = [key for key in pal_get_key_list() if key.startswith(self.name)]
+        values = pal_get_key_values(keys)
+        for key in keys:
+            if values[key] is None:
+                result[key] = ''
+            else:
+                result[key] = values[key]
         return result
 
     def doAction(self, data):
         res = "success"
         # Get the list of parameters to be updated
         params = data["update"]
+        # update only the keys that start with the name, all in one go
+        update = {}
         for key in params.keys():
-            # update only if the key starts with the name
             if key.startswith(self.name):
-                ret = pal_set_key_value(key, params[key])
-                if ret:
-                    res = "failure"
+                update[str(key)] = str(params[key])
+        if pal_set_key_values(update):
+            res = "failure"
 
         result = {"result": res}
 
@@ -23,6 +23,9 @@ from subprocess import *
 
 lpal_hndl = CDLL("libpal.so")
 
+# Size of a value buffer, as MAX_VALUE_LEN in pal.h
+MAX_VALUE_LEN = 128
+
 def pal_get_platform_name():
     name = create_string_buffer(16)
     ret = lpal_hndl.pal_get_platform_name(name)
@@ -111,3 +114,48 @@ def pal_set_key_value(key, value):
         return -1;
     else:
         return 0;
+
+# Keys of the platform's key-value store, in the order of key_list in libpal
+def pal_get_key_list():
+    keys = []
+    klist = cast(addressof(c_char_p.in_dll(lpal_hndl, "key_list")),
+                 POINTER(c_char_p))
+    i = 0
+    while klist[i] != "last_key":
+        keys.append(klist[i])
+        i += 1
+    return keys
+
+# Read many keys with one call into libpal; value is None for a failed key
+def pal_get_key_values(keys):
+    n = len(keys)
+    if n == 0:
+        return {}
+    pkeys = (c_char_p * n)(*keys)
+    bufs = [create_string_buffer(MAX_VALUE_LEN) for key in keys]
+    pvalues = (POINTER(c_char) * n)(*[cast(buf, POINTER(c_char)) for buf in bufs])
+    status = (c_int * n)()
+
+    lpal_hndl.pal_get_key_value_many(pkeys, pvalues, status, n)
+
+    result = {}
+    for i in range(n):
+        if status[i]:
+            result[keys[i]] = None
+        else:
+            result[keys[i]] = bufs[i].value
+    return result
+
+# Write many keys with one call into libpal; returns the keys that failed
+def pal_set_key_values(params):
+    keys = list(params.keys())
+    n = len(keys)
+    if n == 0:
+        return []
+    pkeys = (c_char_p * n)(*keys)
+    pvalues = (c_char_p * n)(*[params[key] for key in keys])
+    status = (c_int * n)()
+
+    lpal_hndl.pal_set_key_value_many(pkeys, pvalues, status, n)
+
+    return [keys[i] for i in range(n) if status[i]]
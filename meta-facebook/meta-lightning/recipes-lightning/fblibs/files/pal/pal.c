@@ -704,6 +704,18 @@ pal_sensor_threshold_flag(uint8_t fru, uint8_t snr_num, uint16_t *flag) {
   return 0;
 }
 
+int
+pal_get_sensor_poll_interval(uint8_t fru, uint8_t snr_num, uint32_t *value) {
+
+  return 0;
+}
+
+int
+pal_get_sensor_bus(uint8_t fru, uint8_t snr_num, uint8_t *bus) {
+
+  return -1;
+}
+
 int
 pal_get_fan_name(uint8_t num, char *name) {
 
@@ -143,6 +143,8 @@ int pal_get_fru_discrete_list(uint8_t fru, uint8_t **sensor_list, int *cnt);
 int pal_sensor_sdr_init(uint8_t fru, sensor_info_t *sinfo);
 int pal_sensor_read(uint8_t fru, uint8_t sensor_num, void *value);
 int pal_sensor_threshold_flag(uint8_t fru, uint8_t snr_num, uint16_t *flag);
+int pal_get_sensor_poll_interval(uint8_t fru, uint8_t snr_num, uint32_t *value);
+int pal_get_sensor_bus(uint8_t fru, uint8_t snr_num, uint8_t *bus);
 int pal_get_sensor_name(uint8_t fru, uint8_t sensor_num, char *name);
 int pal_get_sensor_threshold(uint8_t fru, uint8_t sensor_num, uint8_t thresh,
     void *value);
@@ -20,6 +20,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <errno.h>
 #include <syslog.h>
 #include "alert_control.h"
@@ -80,6 +81,51 @@ alert_control(e_fbid_t id, e_flag_t cflag) {
   return 0;
 }
 
+// Alert bit of a given Function Block in the alert status
+static bool
+alert_status_bit(unsigned char *buf, e_fbid_t id) {
+  switch(id) {
+  case FBID_SMS_KCS:
+    if (buf[2] & (0x01 << FBID_SMS_KCS))
+      return true;
+    else
+      return false;
+    //TODO: Add logic for other Function Blocks here
+  default:
+    return false;
+  }
+}
+
+/*
+ * Function to open the alert status for is_alert_present_fd(), for callers
+ * checking it often. The fd can also be polled for POLLPRI.
+ */
+int
+alert_status_open(void) {
+  return open(PATH_ALERT_STATUS, O_RDONLY | O_NONBLOCK);
+}
+
+/*
+ * Function to check if the alert for a given Function Block is asserted or
+ * not, reading the status from the start of fd. A FIFO, which can't seek,
+ * is read as it comes.
+ */
+bool
+is_alert_present_fd(int fd, e_fbid_t id) {
+  unsigned char buf[5] = {0};
+  int count;
+
+  count = pread(fd, buf, sizeof(buf), 0);
+  if (count < 0 && errno == ESPIPE) {
+    count = read(fd, buf, sizeof(buf));
+  }
+  if (count <= 0) {
+    return false;
+  }
+
+  return alert_status_bit(buf, id);
+}
+
 /*
  * Function to check if the alert for a given Function Block is asserted or not
  */
@@ -104,14 +150,5 @@ is_alert_present(e_fbid_t id) {
 
   fclose(fp);
 
-  switch(id) {
-  case FBID_SMS_KCS:
-    if (buf[2] & (0x01 << FBID_SMS_KCS))
-      return true;
-    else
-      return false;
-    //TODO: Add logic for other Function Blocks here
-  default:
-    return false;
-  }
+  return alert_status_bit(buf, id);
 }
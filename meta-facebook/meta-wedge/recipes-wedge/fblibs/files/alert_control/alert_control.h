@@ -56,6 +56,8 @@ typedef enum {
 
 int alert_control(e_fbid_t id, e_flag_t cflag);
 bool is_alert_present(e_fbid_t id);
+int alert_status_open(void);
+bool is_alert_present_fd(int fd, e_fbid_t id);
 
 #ifdef __cplusplus
 } // extern "C"
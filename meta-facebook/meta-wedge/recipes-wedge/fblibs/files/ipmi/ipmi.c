@@ -26,12 +26,15 @@
 #include <errno.h>
 #include <string.h>
 #include <syslog.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/time.h>
 #include <sys/un.h>
 
 #define SOCK_PATH "/tmp/ipmi_socket"
 #define MAX_IPMI_RES_LEN 100
+#define IPMI_SESSION_TIMEOUT 5   /* seconds */
 
 /*
  * Function to handle IPMI messages
@@ -79,3 +82,79 @@ ipmi_handle(unsigned char *request, unsigned char req_len,
 
   return;
 }
+
+/*
+ * Function to open a session to ipmid, kept open across requests by
+ * callers that handle a stream of messages
+ */
+int
+ipmi_session_open(void) {
+  int s, len;
+  struct sockaddr_un remote;
+  struct timeval tv;
+
+  if ((s = socket(AF_UNIX, SOCK_STREAM, 0)) == -1) {
+    syslog(LOG_ALERT, "ipmi_session_open: socket() failed\n");
+    return -1;
+  }
+
+  remote.sun_family = AF_UNIX;
+  strcpy(remote.sun_path, SOCK_PATH);
+  len = strlen(remote.sun_path) + sizeof(remote.sun_family);
+
+  if (connect(s, (struct sockaddr *)&remote, len) == -1) {
+    syslog(LOG_ALERT, "ipmi_session_open: connect() failed\n");
+    close(s);
+    return -1;
+  }
+
+  // Don't wait forever on an ipmid that is stuck
+  tv.tv_sec = IPMI_SESSION_TIMEOUT;
+  tv.tv_usec = 0;
+  setsockopt(s, SOL_SOCKET, SO_RCVTIMEO, (char *)&tv, sizeof(struct timeval));
+  setsockopt(s, SOL_SOCKET, SO_SNDTIMEO, (char *)&tv, sizeof(struct timeval));
+
+  return s;
+}
+
+void
+ipmi_session_close(int s) {
+  if (s >= 0) {
+    close(s);
+  }
+}
+
+/*
+ * Function to handle an IPMI message on a session, one request at a time.
+ * On any error the session has to be reopened. Returns IPMI_SESSION_STALE
+ * if ipmid never got the request, because it closed the session (e.g. it
+ * restarted): the request can be sent again on a new session. Returns -1
+ * if ipmid may have got it, e.g. it did not answer within
+ * IPMI_SESSION_TIMEOUT: a late response would be taken for the one of the
+ * next request.
+ */
+int
+ipmi_session_handle(int s, unsigned char *request, unsigned char req_len,
+                    unsigned char *response, unsigned char *res_len) {
+  int t;
+
+  if (send(s, request, req_len, MSG_NOSIGNAL) == -1) {
+    syslog(LOG_ALERT, "ipmi_session_handle: send() failed\n");
+    return IPMI_SESSION_STALE;
+  }
+
+  if ((t = recv(s, response, MAX_IPMI_RES_LEN, 0)) <= 0) {
+    if (t < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+      syslog(LOG_ALERT, "ipmi_session_handle: no response from ipmid\n");
+    } else if (t < 0) {
+      syslog(LOG_ALERT, "ipmi_session_handle: recv() failed\n");
+    } else {
+      return IPMI_SESSION_STALE;
+    }
+    return -1;
+  }
+
+  *res_len = t;
+
+  return 0;
+}
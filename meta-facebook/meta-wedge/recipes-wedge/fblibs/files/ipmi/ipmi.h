@@ -28,6 +28,14 @@ extern "C" {
 void ipmi_handle(unsigned char *request, unsigned char req_len,
                  unsigned char *response, unsigned char *res_len);
 
+/* ipmi_session_handle() failed before ipmid got the request */
+#define IPMI_SESSION_STALE -2
+
+int ipmi_session_open(void);
+void ipmi_session_close(int s);
+int ipmi_session_handle(int s, unsigned char *request, unsigned char req_len,
+                        unsigned char *response, unsigned char *res_len);
+
 #ifdef __cplusplus
 } // extern "C"
 #endif
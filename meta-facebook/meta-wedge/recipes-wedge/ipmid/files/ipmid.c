@@ -29,6 +29,7 @@
 #include <errno.h>
 #include <syslog.h>
 #include <string.h>
+#include <stdint.h>
 #include <pthread.h>
 #include <sys/types.h>
 #include <sys/socket.h>
@@ -1386,27 +1387,36 @@ ipmi_handle (unsigned char *request, unsigned char req_len,
   return;
 }
 
+/*
+ * Serve the requests of a client until it closes the connection: one-shot
+ * clients send a single request, sessions like sms-kcsd keep it open
+ */
 void
 *conn_handler(void *socket_desc) {
-  int sock = *(int*)socket_desc;
+  int sock = (int)(intptr_t) socket_desc;
   int n;
   unsigned char req_buf[MAX_IPMI_MSG_SIZE];
   unsigned char res_buf[MAX_IPMI_MSG_SIZE];
   unsigned char res_len = 0;
 
-  n = recv (sock, req_buf, sizeof(req_buf), 0);
-  if (n <= 0) {
-      syslog(LOG_ALERT, "ipmid: recv() failed with %d\n", n);
-      goto conn_cleanup;
-  }
+  while (1) {
+    n = recv (sock, req_buf, sizeof(req_buf), 0);
+    if (n <= 0) {
+      if (n < 0) {
+        syslog(LOG_ALERT, "ipmid: recv() failed with %d\n", n);
+      }
+      break;
+    }
 
-  ipmi_handle(req_buf, n, res_buf, &res_len);
+    res_len = 0;
+    ipmi_handle(req_buf, n, res_buf, &res_len);
 
-  if (send (sock, res_buf, res_len, 0) < 0) {
-    syslog(LOG_ALERT, "ipmid: send() failed\n");
+    if (send (sock, res_buf, res_len, 0) < 0) {
+      syslog(LOG_ALERT, "ipmid: send() failed\n");
+      break;
+    }
   }
 
-conn_cleanup:
   close(sock);
 
   pthread_exit(NULL);
@@ -1469,7 +1479,7 @@ main (void)
     // TODO: Need to monitor the server performance with higher load and
     // see if we need to create pre-defined number of workers and schedule
     // the requests among them.
-    if (pthread_create(&tid, NULL, conn_handler, (void*) &s2) < 0) {
+    if (pthread_create(&tid, NULL, conn_handler, (void*)(intptr_t) s2) < 0) {
         syslog(LOG_ALERT, "ipmid: pthread_create failed\n");
         close(s2);
         continue;
@@ -7,7 +7,7 @@
  * and respond to the command using IPMI stack
  *
  * TODO:  Determine if the daemon is already started.
- * TODO:  Cache the file descriptors instead of fopen/fclose everytime
+ * The KCS and alert status files are kept open for the daemon's life.
  *
  * This program is free software; you can redistribute it and/or modify
  * it under the terms of the GNU General Public License as published by
@@ -27,8 +27,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
+#include <string.h>
+#include <fcntl.h>
 #include <errno.h>
+#include <poll.h>
 #include <syslog.h>
+#include <sys/stat.h>
 #include <facebook/alert_control.h>
 #include <facebook/ipmi.h>
 
@@ -36,19 +40,116 @@
 #define PATH_SMS_KCS "/sys/bus/i2c/drivers/panther_plus/4-0040/sms_kcs"
 #define MAX_ALERT_CONTROL_RETRIES 3
 
+/*
+ * The FPGA does not interrupt the BMC, so the alert status is polled:
+ * right after a message, when the host is likely to send the next one,
+ * every KCS_POLL_MIN_MS, backing off to KCS_POLL_MAX_MS once idle
+ */
+#define KCS_POLL_MIN_MS 10
+#define KCS_POLL_MAX_MS 1000
+
 typedef struct {
   unsigned char fbid;
   unsigned char length;
   unsigned char buf[];
 } kcs_msg_t;
 
+// Kept open for the life of the daemon
+static const char *g_kcs_path = PATH_SMS_KCS;
+static const char *g_alert_path = NULL;
+static int g_kcs_fd = -1;
+static int g_alert_fd = -1;
+static short g_alert_events = POLLPRI | POLLERR;
+static int g_ipmi_sess = -1;
+
+/*
+ * The sysfs files are read and written from the start every time. A test
+ * setup may pass FIFOs instead (see usage()), which can't seek.
+ */
+static int
+kcs_read(int fd, unsigned char *buf, int len) {
+  int n;
+
+  n = pread(fd, buf, len, 0);
+  if (n < 0 && errno == ESPIPE) {
+    n = read(fd, buf, len);
+  }
+
+  return n;
+}
+
+static int
+kcs_write(int fd, unsigned char *buf, int len) {
+  int n;
+
+  n = pwrite(fd, buf, len, 0);
+  if (n < 0 && errno == ESPIPE) {
+    n = write(fd, buf, len);
+  }
+
+  return n;
+}
+
 /*
- * Function to check if there is any new KCS message available
- * TODO: Will be replaced by interrupt-driven approach
+ * Function to check if there is any new KCS message available, reading
+ * the alert status through the cached file descriptor
  */
 static bool
 is_new_kcs_msg(void) {
-  return is_alert_present(FBID_SMS_KCS);
+  return is_alert_present_fd(g_alert_fd, FBID_SMS_KCS);
+}
+
+/*
+ * Wait for up to timeout ms for a new KCS message. The alert status file
+ * also wakes up poll() if the driver ever notifies it.
+ */
+static bool
+wait_kcs_msg(int timeout) {
+  struct pollfd pfd;
+
+  pfd.fd = g_alert_fd;
+  pfd.events = g_alert_events;
+  if (poll(&pfd, 1, timeout) < 0 && errno != EINTR) {
+    syslog(LOG_ALERT, "poll failed, errno %d\n", errno);
+    sleep(1);
+  }
+
+  return is_new_kcs_msg();
+}
+
+/*
+ * Forward a request to ipmid on the persistent session. If ipmid has
+ * restarted since the last message, the request never reached it and is
+ * sent once more on a new session. Any other error fails the request:
+ * ipmid may have run it already.
+ */
+static void
+kcs_ipmi_handle(unsigned char *request, unsigned char req_len,
+                unsigned char *response, unsigned char *res_len) {
+  int retry;
+  int ret;
+
+  for (retry = 0; retry < 2; retry++) {
+    if (g_ipmi_sess < 0) {
+      g_ipmi_sess = ipmi_session_open();
+      if (g_ipmi_sess < 0) {
+        return;
+      }
+    }
+
+    ret = ipmi_session_handle(g_ipmi_sess, request, req_len, response,
+                              res_len);
+    if (!ret) {
+      return;
+    }
+
+    ipmi_session_close(g_ipmi_sess);
+    g_ipmi_sess = -1;
+
+    if (ret != IPMI_SESSION_STALE) {
+      return;
+    }
+  }
 }
 
 /*
@@ -59,68 +160,73 @@ is_new_kcs_msg(void) {
  */
 static int
 handle_kcs_msg(void) {
-  FILE *fp;
   kcs_msg_t *msg;
   unsigned char rbuf[256] = {0};
   unsigned char tbuf[256] = {0};
   unsigned char tlen = 0;
   int count = 0;
-  int i = 0;
 
   // Reads incoming request
-  fp = fopen(PATH_SMS_KCS, "r");
-  if (!fp) {
-    syslog(LOG_ALERT, "failed to open file %s\n", PATH_SMS_KCS);
-    return -1;
-  }
-
-  count = fread(rbuf, sizeof(unsigned char), sizeof(rbuf), fp);
-  if (count == 0) {
-    syslog(LOG_INFO, "fread returns zero bytes\n");
-    fclose(fp);
+  count = kcs_read(g_kcs_fd, rbuf, sizeof(rbuf));
+  if (count <= 0) {
+    syslog(LOG_INFO, "read returns %d\n", count);
     return -1;
   }
 
-  fclose(fp);
-
   msg = (kcs_msg_t*)rbuf;
 
   // Invoke IPMI handler
-  ipmi_handle(msg->buf, msg->length, &tbuf[1], &tlen);
+  kcs_ipmi_handle(msg->buf, msg->length, &tbuf[1], &tlen);
 
   // Fill the length as returned by IPMI stack
   tbuf[0] = tlen;
 
   //Write Reply back to KCS channel
-  fp = fopen(PATH_SMS_KCS, "w");
-  if (!fp) {
-    syslog(LOG_ALERT, "failed to open file %s\n", PATH_SMS_KCS);
-    return -1;
-  }
-
-  count = fwrite(tbuf, sizeof(unsigned char), tlen+1, fp);
+  count = kcs_write(g_kcs_fd, tbuf, tlen+1);
   if (count != tlen+1) {
-    syslog(LOG_ALERT, "fwrite returns: %d, expected: %d\n", count, tlen+1);
-    fclose(fp);
+    syslog(LOG_ALERT, "write returns: %d, expected: %d\n", count, tlen+1);
     return -1;
   }
 
-  fclose(fp);
-
   return 0;
 }
 
+static void
+usage(const char *prog) {
+  printf("Usage: %s [--kcs <path>] [--alert <path>]\n", prog);
+  printf("  --kcs    KCS channel to serve instead of %s\n", PATH_SMS_KCS);
+  printf("  --alert  alert status to poll instead of the FPGA's;\n");
+  printf("           the alert is then not enabled in the FPGA\n");
+  printf("Regular files and FIFOs work too, to test without the hardware.\n");
+}
+
 /*
  * Daemon Main loop
  */
 int main(int argc, char **argv) {
   int i;
-  int ret;
+  int ret = 0;
+  int timeout = KCS_POLL_MAX_MS;
+  bool fake_alert = false;
+  struct stat st;
+
+  for (i = 1; i < argc; i++) {
+    if (!strcmp(argv[i], "--kcs") && i + 1 < argc) {
+      g_kcs_path = argv[++i];
+    } else if (!strcmp(argv[i], "--alert") && i + 1 < argc) {
+      g_alert_path = argv[++i];
+      fake_alert = true;
+    } else {
+      usage(argv[0]);
+      exit(-1);
+    }
+  }
+
   daemon(1, 0);
   openlog("sms-kcs", LOG_CONS, LOG_DAEMON);
 
   // Enable alert for SMS KCS Function Block
-  for (i = 0; i < MAX_ALERT_CONTROL_RETRIES; i++) {
+  for (i = 0; !fake_alert && i < MAX_ALERT_CONTROL_RETRIES; i++) {
     ret = alert_control(FBID_SMS_KCS, FLAG_ENABLE);
     if (!ret) {
       break;
@@ -134,11 +240,40 @@ int main(int argc, char **argv) {
     exit(-1);
   }
 
-  // Forever loop to poll and process KCS messages
+  // O_RDWR also keeps a FIFO from blocking the open or reading EOF
+  g_kcs_fd = open(g_kcs_path, O_RDWR | O_NONBLOCK);
+  if (fake_alert) {
+    g_alert_fd = open(g_alert_path, O_RDWR | O_NONBLOCK);
+  } else {
+    g_alert_fd = alert_status_open();
+  }
+  if (g_kcs_fd < 0 || g_alert_fd < 0) {
+    syslog(LOG_ALERT, "failed to open %s or the alert status\n", g_kcs_path);
+    exit(-1);
+  }
+
+  // A FIFO wakes poll() when the test writes an alert
+  if (!fstat(g_alert_fd, &st) && S_ISFIFO(st.st_mode)) {
+    g_alert_events |= POLLIN;
+  }
+
+  g_ipmi_sess = ipmi_session_open();
+
+  // Forever loop to wait for and process KCS messages
   while (1) {
-    if (is_new_kcs_msg()) {
-      handle_kcs_msg();
+    if (wait_kcs_msg(timeout)) {
+      // Serve back-to-back requests without waiting in between
+      do {
+        if (handle_kcs_msg()) {
+          break;
+        }
+      } while (is_new_kcs_msg());
+      timeout = KCS_POLL_MIN_MS;
+    } else if (timeout < KCS_POLL_MAX_MS) {
+      timeout *= 2;
+      if (timeout > KCS_POLL_MAX_MS) {
+        timeout = KCS_POLL_MAX_MS;
+      }
     }
-    sleep(1);
   }
 }
@@ -221,6 +221,37 @@ get_ipmb_bus_id(uint8_t slot_id) {
   return bus_id;
 }
 
+// Priority class of a request to the BIC, see lib_ipmb_handle_prio()
+static uint8_t
+bic_ipmb_prio(uint8_t netfn, uint8_t cmd) {
+
+  switch (netfn) {
+    case NETFN_SENSOR_REQ:
+      return IPMB_PRIO_SENSOR;
+
+    case NETFN_STORAGE_REQ:
+      switch (cmd) {
+        case CMD_STORAGE_READ_FRUID_DATA:
+        case CMD_STORAGE_WRITE_FRUID_DATA:
+        case CMD_STORAGE_GET_SDR:
+        case CMD_STORAGE_GET_SEL:
+          return IPMB_PRIO_BULK;
+      }
+      return IPMB_PRIO_SENSOR;
+
+    case NETFN_OEM_1S_REQ:
+      switch (cmd) {
+        case CMD_OEM_1S_UPDATE_FW:
+        case CMD_OEM_1S_GET_FW_CKSUM:
+        case CMD_OEM_1S_ENABLE_BIC_UPDATE:
+          return IPMB_PRIO_BULK;
+      }
+      return IPMB_PRIO_CTRL;
+  }
+
+  return IPMB_PRIO_CTRL;
+}
+
 static int
 bic_ipmb_wrapper(uint8_t slot_id, uint8_t netfn, uint8_t cmd,
                   uint8_t *txbuf, uint8_t txlen,
@@ -266,7 +297,8 @@ bic_ipmb_wrapper(uint8_t slot_id, uint8_t netfn, uint8_t cmd,
   tlen = IPMB_HDR_SIZE + IPMI_REQ_HDR_SIZE + txlen;
 
   // Invoke IPMB library handler
-  lib_ipmb_handle(bus_id, tbuf, tlen, &rbuf, &rlen);
+  lib_ipmb_handle_prio(bus_id, bic_ipmb_prio(netfn, cmd), tbuf, tlen,
+                       rbuf, &rlen);
 
   if (rlen == 0) {
 #ifdef DEBUG
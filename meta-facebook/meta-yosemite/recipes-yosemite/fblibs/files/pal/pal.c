@@ -28,6 +28,7 @@
 #include <sys/mman.h>
 #include <string.h>
 #include <pthread.h>
+#include <openbmc/sensor_cache.h>
 #include "pal.h"
 
 #define BIT(value, index) ((value >> index) & 1)
@@ -94,12 +95,15 @@
 #define PWM_DIR "/sys/devices/platform/ast_pwm_tacho.0"
 #define PWM_UNIT_MAX 96
 
+#define SENSOR_BUS_LOCAL 0xFF
+
 const static uint8_t gpio_rst_btn[] = { 0, 57, 56, 59, 58 };
 const static uint8_t gpio_led[] = { 0, 97, 96, 99, 98 };
 const static uint8_t gpio_id_led[] = { 0, 41, 40, 43, 42 };
 const static uint8_t gpio_prsnt[] = { 0, 61, 60, 63, 62 };
 const static uint8_t gpio_power[] = { 0, 27, 25, 31, 29 };
 const static uint8_t gpio_12v[] = { 0, 117, 116, 119, 118 };
+const static uint8_t ipmb_bus[] = { 0, 3, 1, 7, 5 };
 const char pal_fru_list[] = "all, slot1, slot2, slot3, slot4, spb, nic";
 const char pal_server_list[] = "slot1, slot2, slot3, slot4";
 
@@ -174,6 +178,8 @@ char * def_val_list[] = {
   LAST_KEY /* Same as last entry of the key_list */
 };
 
+#define KEY_CNT (sizeof(key_list) / sizeof(key_list[0]) - 1)
+
 // Helper Functions
 static int
 read_device(const char *device, int *value) {
@@ -269,6 +275,76 @@ pal_set_key_value(char *key, char *value) {
   return kv_set(key, value);
 }
 
+// Copy of keys with the invalid ones blanked, for kv to report as failed
+static char **
+pal_key_filter(char **keys, int count) {
+  char **vkeys;
+  int i;
+
+  vkeys = malloc(count * sizeof(char *));
+  if (vkeys == NULL)
+    return NULL;
+
+  for (i = 0; i < count; i++)
+    vkeys[i] = pal_key_check(keys[i]) ? "" : keys[i];
+
+  return vkeys;
+}
+
+int
+pal_get_key_value_many(char **keys, char **values, int *status, int count) {
+  char **vkeys;
+  int ret;
+
+  vkeys = pal_key_filter(keys, count);
+  if (vkeys == NULL)
+    return -1;
+
+  ret = kv_get_many(vkeys, values, status, count);
+  free(vkeys);
+
+  return ret;
+}
+
+int
+pal_set_key_value_many(char **keys, char **values, int *status, int count) {
+  char **vkeys;
+  int ret;
+
+  vkeys = pal_key_filter(keys, count);
+  if (vkeys == NULL)
+    return -1;
+
+  ret = kv_set_many(vkeys, values, status, count);
+  free(vkeys);
+
+  return ret;
+}
+
+// fd to poll() for changes of the keys, see kv_subscribe()
+int
+pal_subscribe_key_value(char **keys, int count) {
+  int i;
+
+  // Check all the keys are defined and valid
+  for (i = 0; i < count; i++) {
+    if (pal_key_check(keys[i]))
+      return -1;
+  }
+
+  return kv_subscribe(keys, count);
+}
+
+int
+pal_key_value_changed(int fd) {
+  return kv_changed(fd);
+}
+
+int
+pal_unsubscribe_key_value(int fd) {
+  return kv_unsubscribe(fd);
+}
+
 // Power On the server in a given slot
 static int
 server_power_on(uint8_t slot_id) {
@@ -1362,43 +1438,23 @@ pal_sensor_sdr_init(uint8_t fru, sensor_info_t *sinfo) {
 int
 pal_sensor_read(uint8_t fru, uint8_t sensor_num, void *value) {
 
-  char key[MAX_KEY_LEN] = {0};
-  char str[MAX_VALUE_LEN] = {0};
   int ret;
 
-  switch(fru) {
-    case FRU_SLOT1:
-    case FRU_SLOT2:
-    case FRU_SLOT3:
-    case FRU_SLOT4:
-      sprintf(key, "slot%d_sensor%d", fru, sensor_num);
-      break;
-    case FRU_SPB:
-      sprintf(key, "spb_sensor%d", sensor_num);
-      break;
-    case FRU_NIC:
-      sprintf(key, "nic_sensor%d", sensor_num);
-      break;
-  }
-
-  ret = edb_cache_get(key, str);
+  ret = sensor_cache_read(fru, sensor_num, (float *) value);
   if(ret < 0) {
 #ifdef DEBUG
-    syslog(LOG_WARNING, "pal_sensor_read: cache_get %s failed.", key);
+    syslog(LOG_WARNING, "pal_sensor_read: cache read for fru %d num 0x%X failed.",
+        fru, sensor_num);
 #endif
     return ret;
   }
-  if(strcmp(str, "NA") == 0)
-    return -1;
-  *((float*)value) = atof(str);
-  return ret;
+  return 0;
 }
+
 int
 pal_sensor_read_raw(uint8_t fru, uint8_t sensor_num, void *value) {
 
   uint8_t status;
-  char key[MAX_KEY_LEN] = {0};
-  char str[MAX_VALUE_LEN] = {0};
   int ret;
 
   switch(fru) {
@@ -1406,7 +1462,6 @@ pal_sensor_read_raw(uint8_t fru, uint8_t sensor_num, void *value) {
     case FRU_SLOT2:
     case FRU_SLOT3:
     case FRU_SLOT4:
-      sprintf(key, "slot%d_sensor%d", fru, sensor_num);
       if(pal_is_fru_prsnt(fru, &status) < 0)
          return -1;
       if (!status) {
@@ -1414,34 +1469,33 @@ pal_sensor_read_raw(uint8_t fru, uint8_t sensor_num, void *value) {
       }
       break;
     case FRU_SPB:
-      sprintf(key, "spb_sensor%d", sensor_num);
-      break;
     case FRU_NIC:
-      sprintf(key, "nic_sensor%d", sensor_num);
       break;
+    default:
+      return -1;
   }
 
+  /* A successful read is published to the sensor cache by the broker */
   ret = yosemite_sensor_read(fru, sensor_num, value);
-  if(ret < 0) {
-    if(fru == FRU_SPB || fru == FRU_NIC)
-      return -1;
-    if(pal_get_server_power(fru, &status) < 0)
-      return -1;
-    if(status == SERVER_POWER_ON)
-      return -1;
-    strcpy(str, "NA");
-  }
-  else
-    sprintf(str, "%.2f",*((float*)value));
-  if(edb_cache_set(key, str) < 0) {
+  if(ret == 0)
+    return 0;
+
+  if(fru == FRU_SPB || fru == FRU_NIC)
+    return -1;
+  if(pal_get_server_power(fru, &status) < 0)
+    return -1;
+  if(status == SERVER_POWER_ON)
+    return -1;
+
+  if(sensor_cache_set(fru, sensor_num, 0, SNR_CACHE_NA) < 0) {
 #ifdef DEBUG
-     syslog(LOG_WARNING, "pal_sensor_read_raw: cache_set key = %s, str = %s failed.", key, str);
+     syslog(LOG_WARNING, "pal_sensor_read_raw: cache set for fru %d num 0x%X failed.",
+         fru, sensor_num);
 #endif
     return -1;
   }
-  else {
-    return 0;
-  }
+
+  return 0;
 }
 
 int
@@ -1467,6 +1521,105 @@ pal_sensor_threshold_flag(uint8_t fru, uint8_t snr_num, uint16_t *flag) {
   return 0;
 }
 
+/*
+ * Poll period in ms for a sensor. Hot swap readings change fast and get
+ * sampled tightly, static DIMM/battery/TjMax readings are polled slowly
+ * to save I2C and IPMB bandwidth.
+ */
+int
+pal_get_sensor_poll_interval(uint8_t fru, uint8_t snr_num, uint32_t *value) {
+
+  switch(fru) {
+    case FRU_SLOT1:
+    case FRU_SLOT2:
+    case FRU_SLOT3:
+    case FRU_SLOT4:
+      switch(snr_num) {
+        case BIC_SENSOR_SOC_THERM_MARGIN:
+        case BIC_SENSOR_SOC_TEMP:
+          *value = 1000;
+          break;
+        case BIC_SENSOR_SOC_TJMAX:
+        case BIC_SENSOR_PV_BAT:
+        case BIC_SENSOR_SOC_DIMMA0_TEMP:
+        case BIC_SENSOR_SOC_DIMMA1_TEMP:
+        case BIC_SENSOR_SOC_DIMMB0_TEMP:
+        case BIC_SENSOR_SOC_DIMMB1_TEMP:
+          *value = 10000;
+          break;
+        default:
+          *value = 2000;
+          break;
+      }
+      break;
+    case FRU_SPB:
+      switch(snr_num) {
+        case SP_SENSOR_HSC_IN_VOLT:
+        case SP_SENSOR_HSC_OUT_CURR:
+        case SP_SENSOR_HSC_IN_POWER:
+          *value = 500;
+          break;
+        case SP_SENSOR_FAN0_TACH:
+        case SP_SENSOR_FAN1_TACH:
+          *value = 1000;
+          break;
+        default:
+          *value = 2000;
+          break;
+      }
+      break;
+    case FRU_NIC:
+      *value = 5000;
+      break;
+    default:
+      return -1;
+  }
+
+  return 0;
+}
+
+/*
+ * Bus (or transport) a sensor is read through: the IPMB bus to the slot's
+ * BIC, the I2C bus of the SPB/NIC device, or SENSOR_BUS_LOCAL for the
+ * ADC and tach readings from the local sysfs.
+ */
+int
+pal_get_sensor_bus(uint8_t fru, uint8_t snr_num, uint8_t *bus) {
+
+  switch(fru) {
+    case FRU_SLOT1:
+    case FRU_SLOT2:
+    case FRU_SLOT3:
+    case FRU_SLOT4:
+      *bus = ipmb_bus[fru];
+      break;
+    case FRU_SPB:
+      switch(snr_num) {
+        case SP_SENSOR_INLET_TEMP:
+        case SP_SENSOR_OUTLET_TEMP:
+          *bus = 9;
+          break;
+        case SP_SENSOR_HSC_IN_VOLT:
+        case SP_SENSOR_HSC_OUT_CURR:
+        case SP_SENSOR_HSC_TEMP:
+        case SP_SENSOR_HSC_IN_POWER:
+          *bus = 10;
+          break;
+        default:
+          *bus = SENSOR_BUS_LOCAL;
+          break;
+      }
+      break;
+    case FRU_NIC:
+      *bus = 11;
+      break;
+    default:
+      return -1;
+  }
+
+  return 0;
+}
+
 int
 pal_get_sensor_threshold(uint8_t fru, uint8_t sensor_num, uint8_t thresh, void *value) {
   return yosemite_sensor_threshold(fru, sensor_num, thresh, value);
@@ -1501,29 +1654,34 @@ int
 pal_set_def_key_value() {
 
   int ret;
-  int i;
+  int i, n;
   int fru;
   char key[MAX_KEY_LEN] = {0};
-  char kpath[MAX_KEY_PATH_LEN] = {0};
-
-  i = 0;
-  while(strcmp(key_list[i], LAST_KEY)) {
-
-    memset(key, 0, MAX_KEY_LEN);
-    memset(kpath, 0, MAX_KEY_PATH_LEN);
-
-    sprintf(kpath, KV_STORE, key_list[i]);
-
-    if (access(kpath, F_OK) == -1) {
+  char value[KEY_CNT][MAX_VALUE_LEN];
+  char *values[KEY_CNT];
+  char *def_keys[KEY_CNT];
+  char *def_vals[KEY_CNT];
+  int status[KEY_CNT];
+
+  for (i = 0; i < KEY_CNT; i++)
+    values[i] = value[i];
+
+  // Read all the keys at once, then write the missing ones at once
+  kv_get_many(key_list, values, status, KEY_CNT);
+
+  n = 0;
+  for (i = 0; i < KEY_CNT; i++) {
+    if (status[i] < 0) {
+      def_keys[n] = key_list[i];
+      def_vals[n] = def_val_list[i];
+      n++;
+    }
+  }
 
-      if ((ret = kv_set(key_list[i], def_val_list[i])) < 0) {
+  if (n && (ret = kv_set_many(def_keys, def_vals, status, n)) < 0) {
 #ifdef DEBUG
-          syslog(LOG_WARNING, "pal_set_def_key_value: kv_set failed. %d", ret);
+    syslog(LOG_WARNING, "pal_set_def_key_value: kv_set_many failed. %d", ret);
 #endif
-      }
-    }
-
-    i++;
   }
 
   /* Actions to be taken on Power On Reset */
@@ -1612,19 +1770,24 @@ pal_get_fru_devtty(uint8_t fru, char *devtty) {
 void
 pal_dump_key_value(void) {
   int i;
-  int ret;
 
-  char value[MAX_VALUE_LEN] = {0x0};
+  // kv_get_many() only terminates values shorter than MAX_VALUE_LEN
+  char value[KEY_CNT][MAX_VALUE_LEN + 1] = {{0x0}};
+  char *values[KEY_CNT];
+  int status[KEY_CNT];
+
+  for (i = 0; i < KEY_CNT; i++)
+    values[i] = value[i];
 
-  while (strcmp(key_list[i], LAST_KEY)) {
+  kv_get_many(key_list, values, status, KEY_CNT);
+
+  for (i = 0; i < KEY_CNT; i++) {
     printf("%s:", key_list[i]);
-    if (ret = kv_get(key_list[i], value) < 0) {
+    if (status[i] < 0) {
       printf("\n");
     } else {
-      printf("%s\n",  value);
+      printf("%s\n",  value[i]);
     }
-    i++;
-    memset(value, 0, MAX_VALUE_LEN);
   }
 }
 
@@ -2180,7 +2343,8 @@ pal_set_sensor_health(uint8_t fru, uint8_t value) {
 
   sprintf(cvalue, (value > 0) ? "1": "0");
 
-  return pal_set_key_value(key, cvalue);
+  // sensord recomputes it after a reboot, so it need not wait for flash
+  return kv_set_wb(key, cvalue);
 }
 
 int
@@ -149,11 +149,18 @@ int pal_sensor_sdr_init(uint8_t fru, sensor_info_t *sinfo);
 int pal_sensor_read(uint8_t fru, uint8_t sensor_num, void *value);
 int pal_sensor_read_raw(uint8_t fru, uint8_t sensor_num, void *value);
 int pal_sensor_threshold_flag(uint8_t fru, uint8_t snr_num, uint16_t *flag);
+int pal_get_sensor_poll_interval(uint8_t fru, uint8_t snr_num, uint32_t *value);
+int pal_get_sensor_bus(uint8_t fru, uint8_t snr_num, uint8_t *bus);
 int pal_get_sensor_name(uint8_t fru, uint8_t sensor_num, char *name);
 int pal_get_sensor_threshold(uint8_t fru, uint8_t sensor_num, uint8_t thresh,
     void *value);
 int pal_get_key_value(char *key, char *value);
 int pal_set_key_value(char *key, char *value);
+int pal_get_key_value_many(char **keys, char **values, int *status, int count);
+int pal_set_key_value_many(char **keys, char **values, int *status, int count);
+int pal_subscribe_key_value(char **keys, int count);
+int pal_key_value_changed(int fd);
+int pal_unsubscribe_key_value(int fd);
 int pal_set_def_key_value();
 void pal_dump_key_value(void);
 int pal_get_fru_devtty(uint8_t fru, char *devtty);
@@ -28,7 +28,10 @@
 #include <fcntl.h>
 #include <errno.h>
 #include <syslog.h>
+#include <unistd.h>
+#include <sys/stat.h>
 #include <facebook/i2c-dev.h>
+#include <openbmc/sensor_cache.h>
 #include "yosemite_sensor.h"
 
 #define LARGEST_DEVICE_NAME 120
@@ -215,6 +218,13 @@ enum {
 
 static sensor_info_t g_sinfo[MAX_NUM_FRUS][MAX_SENSOR_NUM] = {0};
 
+/*
+ * Per-sensor conversion tables for type 1 (linear) SDRs. The BIC reports
+ * an 8-bit raw value, so the 256 possible readings are converted once when
+ * the SDR is loaded and a reading becomes a single table lookup.
+ */
+static float *g_sensor_lut[MAX_NUM_FRUS][MAX_SENSOR_NUM + 1] = {0};
+
 static int
 read_device(const char *device, int *value) {
   FILE *fp;
@@ -360,6 +370,73 @@ read_nic_temp(uint8_t snr_num, float *value) {
   return 0;
 }
 
+/* Precompute the converted value of every raw reading of a type 1 SDR */
+static void
+sensor_lut_build(uint8_t fru, uint8_t sensor_num) {
+  sdr_full_t *sdr;
+  float *lut;
+  int x;
+
+  // y = (mx + b * 10^b_exp) * 10^r_exp
+  uint8_t m_lsb, m_msb, m;
+  uint8_t b_lsb, b_msb, b;
+  int8_t b_exp, r_exp;
+  float offset, scale;
+
+  sdr = &g_sinfo[fru-1][sensor_num].sdr;
+
+  if (!g_sinfo[fru-1][sensor_num].valid || sdr->type != 1) {
+    free(g_sensor_lut[fru-1][sensor_num]);
+    g_sensor_lut[fru-1][sensor_num] = NULL;
+    return;
+  }
+
+  lut = g_sensor_lut[fru-1][sensor_num];
+  if (lut == NULL) {
+    lut = malloc(256 * sizeof(float));
+    if (lut == NULL) {
+      syslog(LOG_WARNING, "sensor_lut_build: malloc failed for FRU %d num 0x%X",
+          fru, sensor_num);
+      return;
+    }
+  }
+
+  m_lsb = sdr->m_val;
+  m_msb = sdr->m_tolerance >> 6;
+  m = (m_msb << 8) | m_lsb;
+
+  b_lsb = sdr->b_val;
+  b_msb = sdr->b_accuracy >> 6;
+  b = (b_msb << 8) | b_lsb;
+
+  // exponents are 2's complement 4-bit number
+  b_exp = sdr->rb_exp & 0xF;
+  if (b_exp > 7) {
+    b_exp = (~b_exp + 1) & 0xF;
+    b_exp = -b_exp;
+  }
+  r_exp = (sdr->rb_exp >> 4) & 0xF;
+  if (r_exp > 7) {
+    r_exp = (~r_exp + 1) & 0xF;
+    r_exp = -r_exp;
+  }
+
+  //printf("m:%d, b:%d, b_exp:%d, r_exp:%d\n", m, b, b_exp, r_exp);
+
+  offset = b * pow(10, b_exp);
+  scale = pow(10, r_exp);
+
+  for (x = 0; x < 256; x++) {
+    lut[x] = ((m * x) + offset) * scale;
+
+    if ((sensor_num == BIC_SENSOR_SOC_THERM_MARGIN) && (lut[x] > 0)) {
+      lut[x] -= (float) THERMAL_CONSTANT;
+    }
+  }
+
+  g_sensor_lut[fru-1][sensor_num] = lut;
+}
+
 static int
 bic_read_sensor_wrapper(uint8_t fru, uint8_t sensor_num, bool discrete,
     void *value) {
@@ -395,41 +472,11 @@ bic_read_sensor_wrapper(uint8_t fru, uint8_t sensor_num, bool discrete,
     return 0;
   }
 
-  // y = (mx + b * 10^b_exp) * 10^r_exp
-  uint8_t x;
-  uint8_t m_lsb, m_msb, m;
-  uint8_t b_lsb, b_msb, b;
-  int8_t b_exp, r_exp;
-
-  x = sensor.value;
-
-  m_lsb = sdr->m_val;
-  m_msb = sdr->m_tolerance >> 6;
-  m = (m_msb << 8) | m_lsb;
-
-  b_lsb = sdr->b_val;
-  b_msb = sdr->b_accuracy >> 6;
-  b = (b_msb << 8) | b_lsb;
-
-  // exponents are 2's complement 4-bit number
-  b_exp = sdr->rb_exp & 0xF;
-  if (b_exp > 7) {
-    b_exp = (~b_exp + 1) & 0xF;
-    b_exp = -b_exp;
-  }
-  r_exp = (sdr->rb_exp >> 4) & 0xF;
-  if (r_exp > 7) {
-    r_exp = (~r_exp + 1) & 0xF;
-    r_exp = -r_exp;
+  if (g_sensor_lut[fru-1][sensor_num] == NULL) {
+    return -1;
   }
 
-  //printf("m:%d, x:%d, b:%d, b_exp:%d, r_exp:%d\n", m, x, b, b_exp, r_exp);
-
-  * (float *) value = ((m * x) + (b * pow(10, b_exp))) * (pow(10, r_exp));
-
-  if ((sensor_num == BIC_SENSOR_SOC_THERM_MARGIN) && (* (float *) value > 0)) {
-   * (float *) value -= (float) THERMAL_CONSTANT;
-  }
+  * (float *) value = g_sensor_lut[fru-1][sensor_num][sensor.value];
 
   return 0;
 }
@@ -544,21 +591,43 @@ yosemite_sensor_sdr_init(uint8_t fru, sensor_info_t *sinfo) {
   return 0;
 }
 
+/*
+ * Load the slot's SDR dump and its conversion tables. They are reloaded
+ * whenever bic-cached rewrites the dump (inode, size or mtime change).
+ */
 static int
 yosemite_sdr_init(uint8_t fru) {
 
   static bool init_done[MAX_NUM_FRUS] = {false};
+  static struct stat sdr_st[MAX_NUM_FRUS];
+  char path[64] = {0};
+  struct stat st;
+  int num;
+
+  if (init_done[fru - 1]) {
+    if (yosemite_sensor_sdr_path(fru, path) < 0 || stat(path, &st) < 0)
+      return 0;
+    if (st.st_ino == sdr_st[fru - 1].st_ino &&
+        st.st_size == sdr_st[fru - 1].st_size &&
+        st.st_mtime == sdr_st[fru - 1].st_mtime)
+      return 0;
+  } else if (yosemite_sensor_sdr_path(fru, path) < 0 || stat(path, &st) < 0) {
+    return ERR_NOT_READY;
+  }
 
-  if (!init_done[fru - 1]) {
-
-    sensor_info_t *sinfo = g_sinfo[fru-1];
+  sensor_info_t *sinfo = g_sinfo[fru-1];
 
-    if (yosemite_sensor_sdr_init(fru, sinfo) < 0)
-      return ERR_NOT_READY;
+  memset(sinfo, 0, sizeof(g_sinfo[fru-1]));
+  if (yosemite_sensor_sdr_init(fru, sinfo) < 0)
+    return ERR_NOT_READY;
 
-    init_done[fru - 1] = true;
+  for (num = 0; num < MAX_SENSOR_NUM; num++) {
+    sensor_lut_build(fru, num);
   }
 
+  sdr_st[fru - 1] = st;
+  init_done[fru - 1] = true;
+
   return 0;
 }
 
@@ -801,8 +870,8 @@ yosemite_sensor_name(uint8_t fru, uint8_t sensor_num, char *name) {
 }
 
 
-int
-yosemite_sensor_read(uint8_t fru, uint8_t sensor_num, void *value) {
+static int
+yosemite_sensor_read_hw(uint8_t fru, uint8_t sensor_num, void *value) {
 
   float volt;
   float curr;
@@ -897,5 +966,19 @@ yosemite_sensor_read(uint8_t fru, uint8_t sensor_num, void *value) {
       }
       break;
   }
+
+  return -1;
+}
+
+/*
+ * All the daemons read sensors through here, so concurrent requests for
+ * the same sensor share one I2C/IPMB transaction and repeat requests are
+ * served from the shared sensor cache within the sensor's freshness window.
+ */
+int
+yosemite_sensor_read(uint8_t fru, uint8_t sensor_num, void *value) {
+
+  return sensor_cache_read_through(fru, sensor_num, yosemite_sensor_read_hw,
+      value);
 }
 
@@ -25,6 +25,8 @@
 #include <string.h>
 #include <pthread.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <sys/un.h>
@@ -502,16 +504,51 @@ led_sync_handler() {
   uint8_t slot;
   uint8_t spb_hlth = 0;
   uint8_t nic_hlth = 0;
+  bool sled_ident = false;
+  bool stale = true;
+  bool changed = false;
+  struct timespec ts;
+  long start, elapsed;
+  char *keys[] = {"identify_sled", "identify_slot1", "identify_slot2",
+                  "identify_slot3", "identify_slot4", "spb_sensor_health",
+                  "nic_sensor_health"};
+  struct pollfd pfd;
 
 #ifdef DEBUG
   syslog(LOG_INFO, "led_handler for slot %d\n", slot);
 #endif
 
+  // Wake up on a change of these keys instead of re-reading them each round
+  pfd.fd = pal_subscribe_key_value(keys, sizeof(keys) / sizeof(keys[0]));
+  pfd.events = POLLIN;
+
   while (1) {
+    if (pfd.fd < 0 || changed || pal_key_value_changed(pfd.fd) != 0 ||
+        stale) {
+      changed = false;
+      memset(identify, 0x0, 16);
+      ret = pal_get_key_value("identify_sled", identify);
+      sled_ident = (ret == 0 && !strcmp(identify, "on"));
+
+      // Check if slot needs to be identified
+      ident = 0;
+      for (slot = 1; slot <= MAX_NUM_SLOTS; slot++)  {
+        id_arr[slot] = 0x0;
+        sprintf(tstr, "identify_slot%d", slot);
+        memset(identify, 0x0, 16);
+        ret = pal_get_key_value(tstr, identify);
+        if (ret == 0 && !strcmp(identify, "on")) {
+          id_arr[slot] = 0x1;
+          ident = 1;
+        }
+      }
+
+      stale = pal_get_fru_health(FRU_SPB, &spb_hlth) ||
+              pal_get_fru_health(FRU_NIC, &nic_hlth);
+    }
+
     // Handle Slot IDENTIFY condition
-    memset(identify, 0x0, 16);
-    ret = pal_get_key_value("identify_sled", identify);
-    if (ret == 0 && !strcmp(identify, "on")) {
+    if (sled_ident) {
       // Turn OFF Blue LED
       for (slot = 1; slot <= MAX_NUM_SLOTS; slot++) {
         g_sync_led[slot] = 1;
@@ -533,14 +570,7 @@ led_sync_handler() {
     }
 
     // Handle Sled level health condition
-    ret = pal_get_fru_health(FRU_SPB, &spb_hlth);
-    if (ret) {
-      sleep(1);
-      continue;
-    }
-
-    ret = pal_get_fru_health(FRU_NIC, &nic_hlth);
-    if (ret) {
+    if (stale) {
       sleep(1);
       continue;
     }
@@ -566,19 +596,6 @@ led_sync_handler() {
       continue;
     }
 
-    // Check if slot needs to be identified
-    ident = 0;
-    for (slot = 1; slot <= MAX_NUM_SLOTS; slot++)  {
-      id_arr[slot] = 0x0;
-      sprintf(tstr, "identify_slot%d", slot);
-      memset(identify, 0x0, 16);
-      ret = pal_get_key_value(tstr, identify);
-      if (ret == 0 && !strcmp(identify, "on")) {
-        id_arr[slot] = 0x1;
-        ident = 1;
-      }
-    }
-
     // Get hand switch position to see if this is selected server
     ret = pal_get_hand_sw(&pos);
     if (ret) {
@@ -643,7 +660,21 @@ led_sync_handler() {
     for (slot = 1; slot <= 4; slot++) {
       g_sync_led[slot] = 0;
     }
-    msleep(200);
+
+    // Wait for the hand switch, or less if an identify key changes. The fd
+    // also wakes up on other writes to the store: keep the pace for those.
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    start = ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+    if (pfd.fd < 0 || poll(&pfd, 1, 200) < 0) {
+      msleep(200);
+    } else if (pfd.revents & POLLIN) {
+      changed = (pal_key_value_changed(pfd.fd) == 1);
+      clock_gettime(CLOCK_MONOTONIC, &ts);
+      elapsed = ts.tv_sec * 1000 + ts.tv_nsec / 1000000 - start;
+      if (!changed && elapsed < 200) {
+        msleep(200 - elapsed);
+      }
+    }
   }
 }
 
@@ -206,7 +206,10 @@ gpio_monitor_poll(uint8_t fru_flag) {
   uint8_t fru;
   uint32_t revised_pins, n_pin_val, o_pin_val[MAX_NUM_SLOTS + 1] = {0};
   gpio_pin_t *gpios;
-  char pwr_state[MAX_VALUE_LEN];
+  char pwr_state[MAX_NUM_SLOTS + 1][MAX_VALUE_LEN];
+  char pwr_key[MAX_NUM_SLOTS][MAX_KEY_LEN];
+  char *keys[MAX_NUM_SLOTS];
+  int pwr_fd;
 
   uint32_t status;
   bic_gpio_t gpio = {0};
@@ -251,8 +254,22 @@ gpio_monitor_poll(uint8_t fru_flag) {
     }
   }
 
+  /* Re-read the last power states only when one of them changed */
+  for (fru = 1; fru <= MAX_NUM_SLOTS; fru++) {
+    sprintf(pwr_key[fru-1], "pwr_server%d_last_state", fru);
+    keys[fru-1] = pwr_key[fru-1];
+  }
+  pwr_fd = pal_subscribe_key_value(keys, MAX_NUM_SLOTS);
+
   /* Keep monitoring each fru's gpio pins every 4 * GPIOD_READ_DELAY seconds */
   while(1) {
+    if (pwr_fd < 0 || pal_key_value_changed(pwr_fd) != 0) {
+      for (fru = 1; fru <= MAX_NUM_SLOTS; fru++) {
+        memset(pwr_state[fru], 0, MAX_VALUE_LEN);
+        pal_get_last_pwr_state(fru, pwr_state[fru]);
+      }
+    }
+
     for (fru = 1; fru <= MAX_NUM_SLOTS; fru++) {
       if (!(GETBIT(fru_flag, fru))) {
         usleep(DELAY_GPIOD_READ);
@@ -266,13 +283,10 @@ gpio_monitor_poll(uint8_t fru_flag) {
         continue;
       }
 
-      memset(pwr_state, 0, MAX_VALUE_LEN);
-      pal_get_last_pwr_state(fru, pwr_state);
-
       /* Get the GPIO pins */
       if ((ret = bic_get_gpio(fru, (bic_gpio_t *) &n_pin_val)) < 0) {
         /* log the error message only when the CPU is on but not reachable. */
-        if (!(strcmp(pwr_state, "on"))) {
+        if (!(strcmp(pwr_state[fru], "on"))) {
 #ifdef DEBUG
           syslog(LOG_WARNING, "gpio_monitor_poll: bic_get_gpio failed for "
               " fru %u", fru);
@@ -299,7 +313,7 @@ gpio_monitor_poll(uint8_t fru_flag) {
              * GPIO - PWRGOOD_CPU assert indicates that the CPU is turned off or in a bad shape.
              * Raise an error and change the LPS from on to off or vice versa for deassert.
              */
-            if (!(strcmp(pwr_state, "on")))
+            if (!(strcmp(pwr_state[fru], "on")))
               pal_set_last_pwr_state(fru, "off");
 
             syslog(LOG_CRIT, "FRU: %d, System powered OFF", fru);
@@ -308,7 +322,7 @@ gpio_monitor_poll(uint8_t fru_flag) {
             bic_set_gpio(fru, GPIO_BMC_READY_N, 0);
           } else {
 
-            if (!(strcmp(pwr_state, "off")))
+            if (!(strcmp(pwr_state[fru], "off")))
               pal_set_last_pwr_state(fru, "on");
 
             syslog(LOG_CRIT, "FRU: %d, System powered ON", fru);
@@ -31,6 +31,11 @@
 #include <syslog.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/inotify.h>
+#include <openbmc/pal.h>
 #include "fruid.h"
 
 #define EEPROM_SPB      "/sys/class/i2c-adapter/i2c-8/8-0051/eeprom"
@@ -40,8 +45,25 @@
 #define BIN_NIC         "/tmp/fruid_nic.bin"
 #define BIN_SLOT        "/tmp/fruid_slot%d.bin"
 
+// Directory and name of BIN_SLOT, watched for rewrites
+#define BIN_SLOT_DIR    "/tmp"
+#define BIN_SLOT_NAME   "fruid_slot%d.bin"
+
 #define FRUID_SIZE        256
 
+// FRU image of a slot, as last read from its BIN_SLOT file
+typedef struct {
+  bool valid; // false: reload from the file on next access
+  int size; // 0 if the file does not exist
+  unsigned char *data;
+} fruid_cache_t;
+
+static fruid_cache_t g_fruid_cache[MAX_NODES+1];
+static pthread_mutex_t m_fruid = PTHREAD_MUTEX_INITIALIZER;
+
+// The cache is only trusted while inotify reports the file changes
+static bool g_fruid_watched = false;
+
 /*
  * copy_eeprom_to_bin - copy the eeprom to binary file im /tmp directory
  *
@@ -97,62 +119,174 @@ int copy_eeprom_to_bin(const char * eeprom_file, const char * bin_file) {
   return 0;
 }
 
-/* Populate the platform specific eeprom for fruid info */
-int plat_fruid_init(void) {
-
-  int ret;
-
-  ret = copy_eeprom_to_bin(EEPROM_SPB, BIN_SPB);
-  ret = copy_eeprom_to_bin(EEPROM_NIC, BIN_NIC);
-
-  return ret;
-}
-
-int plat_fruid_size(unsigned char payload_id) {
+// Read the BIN_SLOT file of a slot into the cache, m_fruid held
+static void
+fruid_cache_load(unsigned char payload_id) {
+  fruid_cache_t *cache = &g_fruid_cache[payload_id];
   char fpath[64] = {0};
   struct stat buf;
-  int ret;
+  unsigned char *data;
+  int fd;
+
+  cache->valid = true;
+  cache->size = 0;
 
   // Fill the file path for a given slot
   sprintf(fpath, BIN_SLOT, payload_id);
 
-  // check the size of the file and return size
-  ret = stat(fpath, &buf);
-  if (ret) {
-    return 0;
+  fd = open(fpath, O_RDONLY);
+  if (fd < 0) {
+    return;
+  }
+
+  if (fstat(fd, &buf) || buf.st_size == 0) {
+    close(fd);
+    return;
+  }
+
+  data = realloc(cache->data, buf.st_size);
+  if (data == NULL) {
+    close(fd);
+    return;
+  }
+  cache->data = data;
+
+  if (read(fd, cache->data, buf.st_size) != buf.st_size) {
+    syslog(LOG_WARNING, "fruid_cache_load: read %s failed", fpath);
+    close(fd);
+    return;
   }
 
-  return buf.st_size;
+  cache->size = buf.st_size;
+  close(fd);
 }
 
-int plat_fruid_data(unsigned char payload_id, int offset, int count, unsigned char *data) {
-  char fpath[64] = {0};
-  int fd;
-  int ret;
+// Cached FRU image of a slot, NULL for a wrong payload ID; m_fruid held
+static fruid_cache_t *
+fruid_cache_get(unsigned char payload_id) {
+  if (payload_id < 1 || payload_id > MAX_NODES) {
+    return NULL;
+  }
 
-  // Fill the file path for a given slot
-  sprintf(fpath, BIN_SLOT, payload_id);
+  if (!g_fruid_cache[payload_id].valid || !g_fruid_watched) {
+    fruid_cache_load(payload_id);
+  }
 
-  // open file for read purpose
-  fd = open(fpath, O_RDONLY);
+  return &g_fruid_cache[payload_id];
+}
+
+// Drop the cached image of the slot files bic-cached or an update rewrote
+static void *
+fruid_watch_handler(void *arg) {
+  int fd = *(int *) arg;
+  char buf[4096]
+      __attribute__ ((aligned(__alignof__(struct inotify_event))));
+  struct inotify_event *ev;
+  char *p;
+  int n, slot;
+
+  while (1) {
+    n = read(fd, buf, sizeof(buf));
+    if (n <= 0) {
+      if (n < 0 && errno == EINTR) {
+        continue;
+      }
+      break;
+    }
+
+    pthread_mutex_lock(&m_fruid);
+    for (p = buf; p < buf + n; p += sizeof(struct inotify_event) + ev->len) {
+      ev = (struct inotify_event *) p;
+      if (ev->mask & IN_Q_OVERFLOW) {
+        for (slot = 1; slot <= MAX_NODES; slot++) {
+          g_fruid_cache[slot].valid = false;
+        }
+      } else if (ev->len && sscanf(ev->name, BIN_SLOT_NAME, &slot) == 1 &&
+                 slot >= 1 && slot <= MAX_NODES) {
+        g_fruid_cache[slot].valid = false;
+      }
+    }
+    pthread_mutex_unlock(&m_fruid);
+  }
+
+  // Without notifications, go back to reading the files every time
+  syslog(LOG_WARNING, "fruid_watch_handler: inotify read failed");
+  pthread_mutex_lock(&m_fruid);
+  g_fruid_watched = false;
+  pthread_mutex_unlock(&m_fruid);
+  close(fd);
+
+  return NULL;
+}
+
+static void
+fruid_watch_init(void) {
+  static int fd;
+  pthread_t tid;
+
+  fd = inotify_init();
   if (fd < 0) {
-    return fd;
+    syslog(LOG_WARNING, "fruid_watch_init: inotify_init failed");
+    return;
   }
 
-  // seek position based on given offset
-  ret = lseek(fd, offset, SEEK_SET);
-  if (ret < 0) {
+  if (inotify_add_watch(fd, BIN_SLOT_DIR,
+                        IN_CLOSE_WRITE | IN_MOVED_TO | IN_DELETE) < 0) {
+    syslog(LOG_WARNING, "fruid_watch_init: inotify_add_watch failed");
     close(fd);
-    return ret;
+    return;
   }
 
-  // read the file content
-  ret = read(fd, data, count);
-  if (ret != count) {
+  g_fruid_watched = true;
+  if (pthread_create(&tid, NULL, fruid_watch_handler, &fd) != 0) {
+    syslog(LOG_WARNING, "fruid_watch_init: pthread_create failed");
+    g_fruid_watched = false;
     close(fd);
-    return -1;
+    return;
   }
+  pthread_detach(tid);
+}
 
-  close(fd);
-  return 0;
+/* Populate the platform specific eeprom for fruid info */
+int plat_fruid_init(void) {
+
+  int ret;
+
+  ret = copy_eeprom_to_bin(EEPROM_SPB, BIN_SPB);
+  ret = copy_eeprom_to_bin(EEPROM_NIC, BIN_NIC);
+
+  // Keep the slot FRU images in memory, refreshed when rewritten
+  fruid_watch_init();
+
+  return ret;
+}
+
+int plat_fruid_size(unsigned char payload_id) {
+  fruid_cache_t *cache;
+  int size = 0;
+
+  pthread_mutex_lock(&m_fruid);
+  cache = fruid_cache_get(payload_id);
+  if (cache) {
+    size = cache->size;
+  }
+  pthread_mutex_unlock(&m_fruid);
+
+  return size;
+}
+
+int plat_fruid_data(unsigned char payload_id, int offset, int count, unsigned char *data) {
+  fruid_cache_t *cache;
+  int ret = -1;
+
+  // Served from the cached image, the file is read only after it changed
+  pthread_mutex_lock(&m_fruid);
+  cache = fruid_cache_get(payload_id);
+  if (cache && offset >= 0 && count >= 0 && offset + count <= cache->size) {
+    memcpy(data, &cache->data[offset], count);
+    ret = 0;
+  }
+  pthread_mutex_unlock(&m_fruid);
+
+  return ret;
 }